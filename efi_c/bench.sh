@@ -0,0 +1,124 @@
+#!/bin/sh
+
+# Boot the autoload (INSTALL.DAT) path headless N times and summarize the kernel's serial
+#   boot stage times as min/median/p95 microseconds per stage.
+# Usage: ./bench.sh <runs> <disk image> [baseline results file]
+# Results are written to bench_results.txt; save a copy of it to compare later runs against.
+# Set ARCH (x86_64 or aarch64) and OVMF (firmware file) in the environment, as "make bench" does.
+
+RUNS=${1:-10}
+IMAGE=${2:-../UEFI-GPT-image-creator/bench.hdd}
+BASELINE=$3
+ARCH=${ARCH:-x86_64}
+TIMEOUT=${BENCH_TIMEOUT:-60}
+RESULTS=bench_results.txt
+STAGES=bench_stages.txt
+LOG=bench_serial.log
+
+# The kernel exits QEMU when "bench_exit" is on its command line: isa-debug-exit on x86_64
+#   exits with (code << 1) | 1, semihosting on aarch64 exits with the code itself
+if [ "$ARCH" = aarch64 ]; then
+    OVMF=${OVMF:-QEMU_EFI_AARCH64.raw}
+    EXIT_OK=0
+    run_qemu() {
+        qemu-system-aarch64 \
+        -drive format=raw,file="$IMAGE" \
+        -bios "$OVMF" \
+        -machine virt \
+        -cpu max \
+        -smp 4 \
+        -device virtio-gpu-pci \
+        -display none \
+        -serial stdio \
+        -semihosting \
+        -snapshot \
+        -net none
+    }
+else
+    OVMF=${OVMF:-../UEFI-GPT-image-creator/bios64.bin}
+    EXIT_OK=1
+    run_qemu() {
+        qemu-system-x86_64 \
+        -drive format=raw,file="$IMAGE" \
+        -bios "$OVMF" \
+        -m 256M \
+        -smp 4 \
+        -vga std \
+        -display none \
+        -serial stdio \
+        -machine q35 \
+        -device isa-debug-exit,iobase=0xf4,iosize=0x01 \
+        -snapshot \
+        -net none
+    }
+fi
+
+: > "$STAGES"
+run=1
+while [ "$run" -le "$RUNS" ]; do
+    # Kill QEMU if the kernel never exits, e.g. a hang or a failed load back at the menu
+    run_qemu < /dev/null > "$LOG" 2>&1 &
+    pid=$!
+    ( sleep "$TIMEOUT"; kill "$pid" 2>/dev/null ) &
+    watchdog=$!
+    wait "$pid"
+    status=$?
+    kill "$watchdog" 2>/dev/null
+
+    if [ "$status" -ne "$EXIT_OK" ]; then
+        echo "Run $run: QEMU exited with $status, expected $EXIT_OK; serial output is in $LOG" >&2
+        exit 1
+    fi
+
+    # Stage lines are "<us>: <name>" between "Boot stages (us):" and the "Boot: <us> us" total
+    tr -d '\r' < "$LOG" | awk -v run="$run" '
+        /^Boot stages \(us\):/ { in_table = 1; next }
+        in_table && /^Boot: / { printf "%s\tTotal\t%s\n", run, $2; in_table = 0; next }
+        in_table && /^[0-9]+: / {
+            us = substr($0, 1, index($0, ":") - 1)
+            printf "%s\t%s\t%s\n", run, substr($0, index($0, ":") + 2), us
+        }' >> "$STAGES"
+
+    echo "Run $run/$RUNS done"
+    run=$((run + 1))
+done
+
+# Min/median/p95 per stage in boot order; baseline medians are matched up by stage name
+awk -F '\t' -v baseline="$BASELINE" '
+    BEGIN {
+        if (baseline != "") {
+            while ((getline line < baseline) > 0) {
+                split(line, f, "\t")
+                if (f[1] != "stage") base[f[1]] = f[3]
+            }
+        }
+    }
+    {
+        if (!($2 in count)) order[num_stages++] = $2
+        values[$2, count[$2]++] = $3
+    }
+    END {
+        printf "stage\tmin_us\tmedian_us\tp95_us%s\n", baseline != "" ? "\tbaseline_median_us\tchange" : ""
+        for (s = 0; s < num_stages; s++) {
+            name = order[s]
+            n = count[name]
+            for (i = 0; i < n; i++) v[i] = values[name, i] + 0
+            for (i = 1; i < n; i++) {   # Insertion sort, runs are few
+                x = v[i]
+                for (j = i - 1; j >= 0 && v[j] > x; j--) v[j+1] = v[j]
+                v[j+1] = x
+            }
+            median = v[int((n - 1) / 2)]
+            p95 = v[int((n * 95 + 99) / 100) - 1]
+            printf "%s\t%d\t%d\t%d", name, v[0], median, p95
+            if (baseline != "") {
+                if ((name in base) && base[name] > 0)
+                    printf "\t%d\t%+.1f%%", base[name], ((median - base[name]) * 100) / base[name]
+                else
+                    printf "\t-\t-"
+            }
+            printf "\n"
+        }
+    }' "$STAGES" > "$RESULTS"
+
+cat "$RESULTS"
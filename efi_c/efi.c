@@ -25,6 +25,20 @@
 // Kernel start address in higher memory (64-bit) - last 2 GiBs of virtual memory
 #define KERNEL_START_ADDRESS 0xFFFFFFFF80000000
 
+// Higher half direct map of all physical memory for the kernel - start of upper half of 
+//   48 bit virtual memory
+#define PHYSMAP_START_ADDRESS 0xFFFF800000000000
+
+// Runtime services memory window in higher memory - 1GiB below the kernel
+#define RUNTIME_START_ADDRESS 0xFFFFFFFF40000000
+
+// Boot info block (Kernel_Parms and tags) in higher memory - 1GiB above the kernel
+#define BOOT_INFO_START_ADDRESS 0xFFFFFFFFC0000000
+
+// Extra descriptors to leave room for in memory map buffers, for the map changing between 
+//   getting the map & ExitBootServices() due to allocations
+#define MMAP_EXTRA_DESCRIPTORS 16
+
 #ifdef __clang__
 int _fltused = 0;   // If using floating point code & lld-link, need to define this
 #endif
@@ -61,6 +75,7 @@ EFI_GRAPHICS_OUTPUT_BLT_PIXEL cursor_buffer[] = {
 EFI_GRAPHICS_OUTPUT_BLT_PIXEL save_buffer[8*8] = {0};
 
 bool autoload_kernel = false;   // Autoload kernel instead of main menu?
+bool map_physmap = true;        // Map all physical memory at PHYSMAP_START_ADDRESS for kernel?
 
 // ====================
 // Set Text Mode
@@ -863,8 +878,305 @@ VOID EFIAPI print_datetime(__attribute__((unused)) IN EFI_EVENT event, IN VOID *
     cout->SetCursorPosition(cout, save_col, save_row);
 }
 
+// File viewer window & line index sizes
+#define VIEW_WINDOW_SIZE   4096     // Bytes of file data kept in memory at a time
+#define VIEW_INDEX_ENTRIES 512      // Max line offset checkpoints kept for text mode
+#define VIEW_TAB_WIDTH     4
+
+// Paged file viewer state; only 1 window of the file is in memory at a time
+typedef struct {
+    EFI_FILE_PROTOCOL *file;
+    UINT64 file_size;
+    UINT64 window_start;                    // File offset of window[0]
+    UINTN  window_len;                      // Valid bytes in window
+    UINT8  window[VIEW_WINDOW_SIZE];
+    UINT64 line_index[VIEW_INDEX_ENTRIES];  // File offset of every <index_stride>th display line
+    UINTN  index_count;                     // Valid entries in line_index
+    UINTN  index_stride;                    // Lines between entries, doubled when index fills up
+    UINT64 total_lines;                     // Total display lines, 0 until end of file is indexed
+} File_View;
+
+// ===============================================================================
+// Get byte at file offset for file viewer, reading in a new window if needed.
+//   Returns -1 at end of file or on read error
+// ===============================================================================
+INTN view_byte(File_View *view, UINT64 offset) {
+    if (offset >= view->file_size) return -1;
+
+    if (offset < view->window_start || offset >= view->window_start + view->window_len) {
+        // Read in aligned window containing this offset
+        view->window_start = offset & ~(UINT64)(VIEW_WINDOW_SIZE-1);
+        view->window_len = VIEW_WINDOW_SIZE;
+        if (EFI_ERROR(view->file->SetPosition(view->file, view->window_start)) ||
+            EFI_ERROR(view->file->Read(view->file, &view->window_len, view->window)) ||
+            view->window_len == 0) {
+            view->window_len = 0;
+            return -1;
+        }
+        if (offset >= view->window_start + view->window_len) return -1;
+    }
+    return view->window[offset - view->window_start];
+}
+
+// =================================================================================
+// Get 1 text display line starting at file offset, line ends at LF or when screen
+//   width is filled. If line is not NULL, fills it with the printable characters.
+//   Returns file offset of the next display line, or file size on a read error or if
+//   no progress can be made, so callers scanning forward always stop
+// =================================================================================
+UINT64 view_next_line(File_View *view, UINT64 offset, CHAR16 *line, UINTN width) {
+    const UINT64 start = offset;
+    UINTN col = 0;
+    INTN c;
+    while ((c = view_byte(view, offset)) >= 0) {
+        if (c == '\n') { offset++; break; }
+        if (c == '\r') { offset++; continue; }
+
+        UINTN char_width = (c == '\t') ? VIEW_TAB_WIDTH - (col % VIEW_TAB_WIDTH) : 1;
+        if (col + char_width > width) break;    // Character starts next display line
+
+        for (UINTN i = 0; i < char_width; i++) {
+            if (line) line[col] = (c >= 0x20 && c < 0x7F) ? (CHAR16)c : (c == '\t' ? u' ' : u'.');
+            col++;
+        }
+        offset++;
+    }
+    if (line) line[col] = u'\0';
+    if (c < 0 || offset == start) return view->file_size;  // End of file, read error, or stuck
+    return offset;
+}
+
+// =================================================================================
+// Get file offset of a text display line, extending the line index as needed.
+//   Index holds 1 offset every <index_stride> lines; when full, every other entry is
+//   dropped and the stride doubles, so memory use is constant for any file size.
+//   Returns file size if line is past the end of the file
+// =================================================================================
+UINT64 view_line_offset(File_View *view, UINT64 line_num, UINTN width) {
+    UINT64 entry = line_num / view->index_stride;
+
+    // Extend index until it covers the entry for this line or the end of the file
+    while (entry >= view->index_count && view->total_lines == 0) {
+        UINT64 offset = view->line_index[view->index_count-1];
+        UINTN lines = 0;
+        while (lines < view->index_stride && offset < view->file_size) {
+            offset = view_next_line(view, offset, NULL, width);
+            lines++;
+        }
+
+        if (offset >= view->file_size) {
+            view->total_lines = (view->index_count-1) * view->index_stride + lines;
+            if (view->total_lines == 0) view->total_lines = 1;  // Empty file has 1 blank line
+            break;
+        }
+
+        if (view->index_count == VIEW_INDEX_ENTRIES) {
+            // Index is full, keep every other entry and double the stride
+            for (UINTN i = 0; i < VIEW_INDEX_ENTRIES/2; i++)
+                view->line_index[i] = view->line_index[i*2];
+            view->index_count = VIEW_INDEX_ENTRIES/2;
+            view->index_stride *= 2;
+            entry = line_num / view->index_stride;
+            continue;   // Last scanned run is not on the new stride, rescan from last entry
+        }
+        view->line_index[view->index_count++] = offset;
+    }
+
+    if (view->total_lines && line_num >= view->total_lines) return view->file_size;
+    if (entry >= view->index_count) entry = view->index_count-1;
+
+    // Scan forward from nearest indexed line
+    UINT64 offset = view->line_index[entry];
+    for (UINT64 line = entry * view->index_stride; line < line_num && offset < view->file_size; line++)
+        offset = view_next_line(view, offset, NULL, width);
+
+    return offset;
+}
+
+// =================================================================================
+// Get text display line containing a file offset, extending the line index as needed
+// =================================================================================
+UINT64 view_line_at_offset(File_View *view, UINT64 target, UINTN width) {
+    // Extend index until it passes the target offset or reaches the end of the file
+    while (view->total_lines == 0 && view->line_index[view->index_count-1] <= target)
+        view_line_offset(view, view->index_count * view->index_stride, width);
+
+    // Find last indexed line at or before target, then scan forward to it
+    UINTN entry = 0;
+    while (entry+1 < view->index_count && view->line_index[entry+1] <= target) entry++;
+
+    UINT64 line = entry * view->index_stride;
+    UINT64 offset = view->line_index[entry];
+    while (offset < view->file_size) {
+        UINT64 next = view_next_line(view, offset, NULL, width);
+        if (next > target || next >= view->file_size) break;
+        offset = next;
+        line++;
+    }
+    return line;
+}
+
+// ===============================================================================
+// View a file a screen at a time in text or hex mode, without reading the whole 
+//   file into memory
+// ===============================================================================
+EFI_STATUS view_file(EFI_FILE_PROTOCOL *file, EFI_FILE_INFO *file_info) {
+    EFI_STATUS status = EFI_SUCCESS;
+    File_View *view = NULL;
+
+    view = scratch_alloc(sizeof *view);
+    if (!view) {
+        error(EFI_OUT_OF_RESOURCES, u"Could not allocate memory for file viewer.\r\n");
+        return EFI_OUT_OF_RESOURCES;
+    }
+
+    view->file         = file;
+    view->file_size    = file_info->FileSize;
+    view->window_start = 0;
+    view->window_len   = 0;
+    view->line_index[0] = 0;    // Line 0 always starts at offset 0
+    view->index_count  = 1;
+    view->index_stride = 1;
+    view->total_lines  = 0;
+
+    // Use hex mode to start if first window of file has any NUL bytes, e.g. a binary file
+    bool hex_mode = false;
+    if (view_byte(view, 0) >= 0) {
+        for (UINTN i = 0; i < view->window_len && !hex_mode; i++) 
+            if (view->window[i] == 0) hex_mode = true;
+    }
+
+    // Top and bottom rows are the title & keybinds, leave last column empty to not scroll screen
+    CHAR16 line[256];
+    const UINTN rows  = text_rows - 2;
+    const UINTN width = (UINTN)text_cols - 1 < ARRAY_SIZE(line) - 1 ? (UINTN)text_cols - 1 
+                                                                     : ARRAY_SIZE(line) - 1;
+    const UINTN bytes_per_row = (text_cols >= 80) ? 16 : 8;   // For hex mode
+    const UINT64 hex_rows = (view->file_size + bytes_per_row-1) / bytes_per_row;
+    const CHAR16 hex_digits[] = u"0123456789ABCDEF";
+
+    UINT64 top_line = 0, top_row = 0;   // Top of screen for text & hex modes
+
+    while (true) {
+        cout->ClearScreen(cout);
+        printf_c16(u"%s (%llu bytes) [%s]\r\n", 
+                   file_info->FileName, view->file_size, hex_mode ? u"HEX" : u"TEXT");
+
+        if (hex_mode) {
+            UINT64 offset = top_row * bytes_per_row;
+            for (UINTN row = 0; row < rows && offset < view->file_size; row++) {
+                // "OOOOOOOOOOOOOOOO: XX XX XX ... |ascii...|", full 64bit offset
+                UINTN i = 0;
+                for (INTN shift = 60; shift >= 0; shift -= 4) line[i++] = hex_digits[(offset >> shift) & 0xF];
+                line[i++] = u':';
+
+                for (UINTN b = 0; b < bytes_per_row; b++) {
+                    INTN c = view_byte(view, offset + b);
+                    line[i++] = u' ';
+                    line[i++] = c < 0 ? u' ' : hex_digits[(c >> 4) & 0xF];
+                    line[i++] = c < 0 ? u' ' : hex_digits[c & 0xF];
+                }
+
+                line[i++] = u' ';
+                line[i++] = u'|';
+                for (UINTN b = 0; b < bytes_per_row; b++) {
+                    INTN c = view_byte(view, offset + b);
+                    if (c < 0) break;
+                    line[i++] = (c >= 0x20 && c < 0x7F) ? (CHAR16)c : u'.';
+                }
+                line[i++] = u'|';
+                line[i++] = u'\r';
+                line[i++] = u'\n';
+                line[i] = u'\0';
+                cout->OutputString(cout, line);
+                offset += bytes_per_row;
+            }
+
+        } else {
+            UINT64 offset = view_line_offset(view, top_line, width);
+            for (UINTN row = 0; row < rows && offset < view->file_size; row++) {
+                offset = view_next_line(view, offset, line, width);
+                cout->OutputString(cout, line);
+                cout->OutputString(cout, u"\r\n");
+            }
+        }
+
+        // Print keybinds at bottom of screen
+        cout->SetCursorPosition(cout, 0, text_rows-1);
+        printf_c16(u"Up/Down/PgUp/PgDn/Home/End = Scroll, H = Hex/Text, Esc = Go Back");
+
+        UINT64 *top = hex_mode ? &top_row : &top_line;
+        UINT64 step = 0; 
+        bool up = false;
+
+        EFI_INPUT_KEY key = get_key();
+        switch (key.ScanCode) {
+            case SCANCODE_ESC:
+                // ESC Key, exit and go back to file list
+                goto cleanup;
+                break;
+
+            case SCANCODE_UP_ARROW:
+            case SCANCODE_DOWN_ARROW:
+                step = 1;
+                up = (key.ScanCode == SCANCODE_UP_ARROW);
+                break;
+
+            case SCANCODE_PAGE_UP:
+            case SCANCODE_PAGE_DOWN:
+                step = rows;
+                up = (key.ScanCode == SCANCODE_PAGE_UP);
+                break;
+
+            case SCANCODE_HOME:
+                *top = 0;
+                break;
+
+            case SCANCODE_END:
+                step = ~0ULL;
+                break;
+
+            default:
+                if (key.UnicodeChar == u'h' || key.UnicodeChar == u'H') {
+                    // Keep the same file position at the top of the screen when switching modes
+                    if (hex_mode) 
+                        top_line = view_line_at_offset(view, top_row * bytes_per_row, width);
+                    else 
+                        top_row = view_line_offset(view, top_line, width) / bytes_per_row;
+
+                    hex_mode = !hex_mode;
+                }
+                break;
+        }
+
+        if (step == 0) continue;
+        if (up) {
+            *top = (*top > step) ? *top - step : 0;
+            continue;
+        }
+
+        // Scroll down, stopping with the last line/row at the bottom of the screen
+        UINT64 total = hex_rows;
+        if (!hex_mode) {
+            if (step != ~0ULL && view_line_offset(view, *top + step + rows, width) < view->file_size) {
+                *top += step;   // Still more lines after new screen, no need to index to the end
+                continue;
+            }
+
+            // Only index to the end of the file when actually needed e.g. End key
+            view_line_offset(view, ~0ULL, width);
+            total = view->total_lines;
+        }
+        UINT64 last_top = (total > rows) ? total - rows : 0;
+        *top = (step == ~0ULL || *top + step > last_top) ? last_top : *top + step;
+    }
+
+    cleanup:
+    return status;
+}
+
 // ================================================
-// Read & print files in the EFI System Partition
+// Read & view files in the EFI System Partition
 // ================================================
 EFI_STATUS read_esp_files(void) {
     EFI_STATUS status = EFI_SUCCESS;
@@ -984,17 +1296,7 @@ EFI_STATUS read_esp_files(void) {
                         continue;   // Continue overall loop and print new directory entries
                     } 
 
-                    // Else this is a file, print contents:
-                    // Allocate buffer for file
-                    VOID *buffer = NULL;
-                    buf_size = file_info.FileSize;
-                    status = bs->AllocatePool(EfiLoaderData, buf_size, &buffer);
-                    if (EFI_ERROR(status)) {
-                        error(status, u"Could not allocate memory for file %s\r\n", file_info.FileName);
-                        goto done;
-                    }
-
-                    // Open file
+                    // Else this is a file, open and view contents a screen at a time
                     EFI_FILE_PROTOCOL *file = NULL;
                     status = dirp->Open(dirp, 
                                         &file, 
@@ -1007,46 +1309,12 @@ EFI_STATUS read_esp_files(void) {
                         goto done;
                     }
 
-                    // Read file into buffer
-                    status = dirp->Read(file, &buf_size, buffer);
-                    if (EFI_ERROR(status)) {
-                        error(status, u"Could not read file %s into buffer.\r\n", file_info.FileName);
-                        goto done;
-                    } 
-
-                    if (buf_size != file_info.FileSize) {
-                        error(0, u"Could not read all of file %s into buffer.\r\n" 
-                              u"Bytes read: %u, Expected: %u\r\n",
-                              file_info.FileName, buf_size, file_info.FileSize);
-                        goto done;
-                    }
-
-                    // Print buffer contents
-                    printf_c16(u"\r\nFile Contents:\r\n");
-
-                    char *pos = (char *)buffer;
-                    for (UINTN bytes = buf_size; bytes > 0; bytes--) {
-                        CHAR16 str[2];
-                        str[0] = *pos;
-                        str[1] = u'\0';
-                        if (*pos == '\n') {
-                            // Convert LF newline to CRLF
-                            printf_c16(u"\r\n");
-                        } else {
-                            printf_c16(u"%s", str);
-                        }
-
-                        pos++;
-                    }
-
-                    printf_c16(u"\r\n\r\nPress any key to continue...\r\n");
-                    get_key();
-
-                    // Free memory for file when done
-                    bs->FreePool(buffer);
+                    status = view_file(file, &file_info);
 
                     // Close file handle
                     dirp->Close(file);
+
+                    if (EFI_ERROR(status)) goto done;
                 }
                 break;
         }
@@ -1214,14 +1482,30 @@ VOID *load_elf(VOID *elf_buffer, EFI_PHYSICAL_ADDRESS *file_buffer, UINTN *file_
     EFI_PHYSICAL_ADDRESS program_buffer = 0;
     UINTN pages_needed = (max_memory_needed + (PAGE_SIZE-1)) / PAGE_SIZE;
 
-    status = bs->AllocatePages(AllocateAnyPages, EfiLoaderCode, pages_needed, &program_buffer);
+    // If segments are aligned to more than a page e.g. 2MiB, the physical buffer needs the same
+    //   alignment for the kernel to be mapped with large pages. Over allocate by the alignment, 
+    //   then free the unaligned pages before and after the aligned buffer.
+    UINTN extra_pages = (max_alignment / PAGE_SIZE) - 1;
+
+    status = bs->AllocatePages(AllocateAnyPages, EfiLoaderCode, pages_needed + extra_pages, 
+                               &program_buffer);
     if (EFI_ERROR(status)) {
         error(status, u"Could not allocate memory for ELF program\r\n");
         return NULL;
     }
 
+    if (extra_pages > 0) {
+        EFI_PHYSICAL_ADDRESS aligned_buffer = (program_buffer + max_alignment-1) & ~(max_alignment-1);
+        UINTN head_pages = (aligned_buffer - program_buffer) / PAGE_SIZE;
+        UINTN tail_pages = extra_pages - head_pages;
+
+        if (head_pages > 0) bs->FreePages(program_buffer, head_pages);
+        if (tail_pages > 0) bs->FreePages(aligned_buffer + (pages_needed * PAGE_SIZE), tail_pages);
+        program_buffer = aligned_buffer;
+    }
+
     // Zero init buffer, to ensure 0 padding for all program sections
-    memset((VOID *)program_buffer, 0, max_memory_needed);
+    parallel_memset((VOID *)program_buffer, 0, max_memory_needed);
 
     // Fill out input parms for caller
     *file_buffer = program_buffer;
@@ -1345,8 +1629,10 @@ EFI_STATUS get_memory_map(Memory_Map_Info *mmap) {
 
     // Allocate buffer for actual memory map for size in mmap->size;
     //   need to allocate enough space for an additional memory descriptor or 2 in the map due to
-    //   this allocation itself.
-    mmap->size += mmap->desc_size * 2;  
+    //   this allocation itself, plus slack so the map can be gotten again into the same buffer 
+    //   after a few more allocations, see refresh_memory_map()
+    mmap->size += mmap->desc_size * MMAP_EXTRA_DESCRIPTORS;  
+    mmap->buffer_size = mmap->size;
     status = bs->AllocatePool(EfiLoaderData, mmap->size,(VOID **)&mmap->map);
     if (EFI_ERROR(status)) {
         error(status, u"Could not allocate buffer for memory map '%s'\r\n");
@@ -1368,41 +1654,123 @@ EFI_STATUS get_memory_map(Memory_Map_Info *mmap) {
     return EFI_SUCCESS;
 }
 
+// ===========================================================================
+// Get the memory map again into an existing buffer from get_memory_map(). 
+//   This does not allocate or print anything, so it can be used right before 
+//   ExitBootServices() and to retry it.
+// ===========================================================================
+EFI_STATUS refresh_memory_map(Memory_Map_Info *mmap) { 
+    mmap->size = mmap->buffer_size;
+    return bs->GetMemoryMap(&mmap->size,
+                            mmap->map,
+                            &mmap->key,
+                            &mmap->desc_size,
+                            &mmap->desc_version);
+}
+
+// ============================================================================
+// Get kernel command line: this image's load options if they are text e.g. 
+//   from the UEFI shell or a boot option, otherwise the CMDLINE= line from 
+//   INSTALL.DAT. Returns an ASCII string in scratch_arena, or NULL.
+// ============================================================================
+char *get_kernel_cmdline(void) {
+    char *cmdline = NULL;
+
+    EFI_GUID lip_guid = EFI_LOADED_IMAGE_PROTOCOL_GUID;
+    EFI_LOADED_IMAGE_PROTOCOL *lip = NULL;
+    EFI_STATUS status = bs->OpenProtocol(image,
+                                         &lip_guid,
+                                         (VOID **)&lip,
+                                         image,
+                                         NULL,
+                                         EFI_OPEN_PROTOCOL_GET_PROTOCOL);
+    if (!EFI_ERROR(status) && lip->LoadOptions && lip->LoadOptionsSize >= sizeof(CHAR16)) {
+        // Boot options can have binary data, only use printable text
+        CHAR16 *options = lip->LoadOptions;
+        UINTN len = lip->LoadOptionsSize / sizeof(CHAR16), i = 0;
+        while (i < len && options[i] >= u' ' && options[i] <= u'~') i++;
+
+        if (i > 0 && (i == len || options[i] == u'\0') && (cmdline = scratch_alloc(i + 1))) {
+            for (UINTN j = 0; j < i; j++) cmdline[j] = (char)options[j];
+            cmdline[i] = '\0';
+            return cmdline;
+        }
+    }
+
+    UINTN size = 0;
+    char *install_data = read_esp_file_to_buffer(u"\\EFI\\BOOT\\INSTALL.DAT", &size);
+    if (!install_data) return NULL;
+
+    char key[] = "CMDLINE=";
+    const UINTN key_len = sizeof key - 1;
+    for (UINTN i = 0; i + key_len <= size; i++) {
+        if ((i > 0 && install_data[i-1] != '\n') || memcmp(install_data + i, key, key_len)) 
+            continue;
+
+        UINTN start = i + key_len, end = start;
+        while (end < size && install_data[end] && install_data[end] != '\r' && install_data[end] != '\n') 
+            end++;
+
+        if ((cmdline = scratch_alloc(end - start + 1))) {
+            memcpy(cmdline, install_data + start, end - start);
+            cmdline[end - start] = '\0';
+        }
+        break;
+    }
+
+    return cmdline;
+}
+
 // ==========================================
 // Read a file from the basic data partition
 // ==========================================
 EFI_STATUS load_kernel(void) {
     EFI_HII_PACKAGE_LIST_HEADER *pkg_list = NULL;   
     EFI_STATUS status = EFI_SUCCESS;
+    EFI_PHYSICAL_ADDRESS pt_pool = 0, cpu_block = 0;   // Preallocated for after ExitBootServices()
+    EFI_PHYSICAL_ADDRESS boot_info = 0, ap_trampoline = 0;
+    UINTN pt_pool_pages = 0, boot_info_pages = 0, cpu_block_pages = 0;
+    const UINTN STACK_PAGES = 16;               // 64KiB stack per CPU
+    const UINTN CPU_PAGES = STACK_PAGES + 2;    // Arch tables page, CPU data page, & stack
+    VOID *disk_buffer = NULL, *psf_font = NULL;     // Data partition files, from AllocatePages()
+    UINTN file_size = 0, psf_size = 0;              // Their sizes in bytes
+    char *cmdline = NULL;
+    EFI_PHYSICAL_ADDRESS kernel_buffer = 0;     // Loaded kernel image, or disk_buffer if flat
+    UINTN kernel_size = 0;
+    UINTN glyphs_size[2] = {0};     // Size of each font's glyph buffer
+    UINT32 first_stage = boot_stages.count;     // Stages from here are dropped if load fails
+    Arena_Mark scratch_mark = arena_mark(&scratch_arena);   // Font & cmdline temporaries
 
     // Defined in efi_lib.h
     Kernel_Parms kparms = {     
         .mmap                 = {0},
         .gop_mode             = {0},
-        .RuntimeServices      = rs,
+        .RuntimeServices      = st->RuntimeServices,  // Not rs, it can be a profiling shim
         .NumberOfTableEntries = st->NumberOfTableEntries,
         .ConfigurationTable   = st->ConfigurationTable,
         .num_fonts            = 0,
         .fonts                = NULL,
+        .physmap_base         = 0,
+        .load_start_time      = arch_read_timestamp(),
+        .clock                = timestamp_clock,
     };
 
     cout->ClearScreen(cout);
 
     // Get kernel file from data partition on disk 
-    UINTN file_size = 0;
-    VOID *disk_buffer = read_data_partition_file_to_buffer("kernel", false, &file_size);
+    disk_buffer = read_data_partition_file_to_buffer("kernel", false, &file_size);
     if (!disk_buffer) {
         error(0, u"Could not find or read kernel file to buffer\r\n");
         goto cleanup;
     }
 
     // Load Kernel binary depending on format (initial header bytes)
+    boot_stage("load_elf", NULL);
     UINT8 *hdr = disk_buffer;
     printf_c16(u"Header bytes: [%hhx][%hhx][%hhx][%hhx]\r\n", 
            hdr[0], hdr[1], hdr[2], hdr[3]);
-
-    EFI_PHYSICAL_ADDRESS kernel_buffer = 0;
-    UINTN kernel_size = 0;
+    printf_c16(u"File size: %u, checksum: %llx (%u CPUs)\r\n", 
+           file_size, parallel_checksum(disk_buffer, file_size), num_cpus);
 
     // Load kernel binary and get the entry point
     // Get around compiler warning about function vs void pointer
@@ -1413,7 +1781,9 @@ EFI_STATUS load_kernel(void) {
     if (!memcmp(hdr, (UINT8[4]){0x7F, 'E', 'L', 'F'}, 4)) {
         printf_c16(u"ELF\r\n");
         print_elf_info(disk_buffer); // Print ELF header and loadable program header information
+        PMU_Sample pmu_start = pmu_begin();
         *(void **)&entry_point = load_elf(disk_buffer, &kernel_buffer, &kernel_size);   
+        pmu_end("load_elf", &pmu_start);
 
     } else if (!memcmp(hdr, (UINT8[2]){'M', 'Z'}, 2)) {
         printf_c16(u"PE\r\n");
@@ -1437,23 +1807,23 @@ EFI_STATUS load_kernel(void) {
            u"Higher address entry point: %llx\r\n",
             kernel_buffer, kernel_size, (UINTN)entry_point, higher_entry_point);
 
-    if (!entry_point) {   
-        // Clean up/free pages for allocated kernel buffer
-        bs->FreePages(kernel_buffer, kernel_size / PAGE_SIZE);
-        goto cleanup;     
-    }
+    if (!entry_point) goto cleanup;     // Kernel buffer pages are freed there
 
     if (!autoload_kernel) {
+        boot_stage_wait("Wait for user");
         printf_c16(u"\r\nPress ESC to abort, or another key to load kernel...\r\n");
         EFI_INPUT_KEY key = get_key();
         if (key.ScanCode == SCANCODE_ESC)
             goto cleanup;
+
+        kparms.load_start_time = arch_read_timestamp();  // Don't time waiting for the user
     }
 
     // Close Timer Event so that it does not continue to fire off
     bs->CloseEvent(timer_event);
 
     // Initialize Kernel Parameters
+    boot_stage("GOP SetMode", NULL);
     EFI_GRAPHICS_OUTPUT_PROTOCOL *gop = NULL;
     bool set_mode = false;
     if (autoload_kernel) {
@@ -1471,8 +1841,6 @@ EFI_STATUS load_kernel(void) {
         if (!str_pos) goto gop_done;
         UINT32 yres = atoi(str_pos);
 
-        bs->FreePool(inst_file_buf);
-
         status = set_gop_mode(&gop, xres, yres); 
         set_mode = !EFI_ERROR(status);
     } 
@@ -1493,16 +1861,16 @@ EFI_STATUS load_kernel(void) {
 
     // Allocate buffer for kernel bitmap fonts
     kparms.num_fonts = 2;
-    status = bs->AllocatePool(EfiLoaderData, 
-                              kparms.num_fonts * sizeof *kparms.fonts, 
-                              (VOID **)&kparms.fonts);
-    if (EFI_ERROR(status)) {
-        error(status, u"Could not allocate buffer for kernel bitmap font parms.\r\n");
+    kparms.fonts = scratch_alloc(kparms.num_fonts * sizeof *kparms.fonts);
+    if (!kparms.fonts) {
+        error(EFI_OUT_OF_RESOURCES, u"Could not allocate buffer for kernel bitmap font parms.\r\n");
         goto cleanup;
     }
+    memset(kparms.fonts, 0, kparms.num_fonts * sizeof *kparms.fonts);
 
     // Get simple font info & glyphs from HII database for kernel to use as a bitmap font 
     //   for printing
+    boot_stage("HII font export", NULL);
     pkg_list = hii_database_package_list(EFI_HII_PACKAGE_SIMPLE_FONTS);    
     if (pkg_list) {
         // Fill in kernel parm font with narrow glyph info from EFI HII simple font (8x19)
@@ -1525,11 +1893,10 @@ EFI_STATUS load_kernel(void) {
         UINTN glyph_size = ((font.width + 7) / 8) * font.height; 
 
         // Allocate extra 8 bytes for bitmap mask printing in kernel
-        status = bs->AllocatePool(EfiLoaderData, 
-                                  (max_glyphs * glyph_size) + 8,    
-                                  (VOID **)&kparms.fonts[0].glyphs);
-        if (EFI_ERROR(status)) {
-            error(status, u"Could not allocate buffer for kernel parm font narrow glyphs bitmaps.\r\n");
+        glyphs_size[0] = (max_glyphs * glyph_size) + 8;
+        kparms.fonts[0].glyphs = scratch_alloc(glyphs_size[0]);
+        if (!kparms.fonts[0].glyphs) {
+            error(EFI_OUT_OF_RESOURCES, u"Could not allocate buffer for kernel parm font narrow glyphs bitmaps.\r\n");
             goto cleanup;
         }
 
@@ -1549,83 +1916,356 @@ EFI_STATUS load_kernel(void) {
     // Get PSF font file for another bitmap font to use;
     //   this one should be stored in the disk image's data partition
     char *psf_name = "ter-132n.psf";
-    UINTN psf_size = 0;
-    VOID *psf_font = read_data_partition_file_to_buffer(psf_name, false, &psf_size);
+    psf_font = read_data_partition_file_to_buffer(psf_name, false, &psf_size);
+    PSF2_Header *psf2_hdr = psf_font;
+    if (psf_font && (psf_size < sizeof *psf2_hdr || psf2_hdr->magic != PSF2_FONT_MAGIC ||
+                     psf2_hdr->headersize < sizeof *psf2_hdr || psf2_hdr->headersize > psf_size)) {
+        error(EFI_UNSUPPORTED, u"PSF font file %hhs has a bad header.\r\n", psf_name);
+        bs->FreePages((EFI_PHYSICAL_ADDRESS)psf_font, EFI_SIZE_TO_PAGES(psf_size));
+        psf_font = NULL;
+    }
     if (psf_font) {
-        PSF2_Header *psf2_hdr = psf_font;
+        // Glyph bitmaps start at headersize, which can be more than the header struct
+        glyphs_size[1] = psf_size - psf2_hdr->headersize + 8;   // Extra bytes for mask printing
         kparms.fonts[1] = (Bitmap_Font){
             .name            = psf_name,
             .width           = psf2_hdr->width,
             .height          = psf2_hdr->height,
             .left_col_first  = true,                   // Pixels in memory are stored left to right
             .num_glyphs      = psf2_hdr->num_glyphs,
-            .glyphs          = (uint8_t *)(psf2_hdr+1),
+            .glyphs          = (uint8_t *)psf_font + psf2_hdr->headersize,
         };
     }
 
-    // Get Memory Map
+    // Get kernel command line & ACPI RSDP for boot info
+    boot_stage("Boot info & allocations", NULL);
+    cmdline = get_kernel_cmdline();
+    bool dump_page_tables = cmdline && strstr(cmdline, "page_tables");  // All mappings to serial
+
+    Boot_Tag_ACPI acpi = {0};
+    acpi.rsdp = get_acpi_rsdp();
+    if (acpi.rsdp) acpi.revision = ((UINT8 *)acpi.rsdp)[15];
+
+    // Count CPUs in the ACPI MADT, to set up memory for each CPU for the kernel
+    UINT64 bsp_id = arch_cpu_id();
+    ACPI_TABLE_HEADER *madt = acpi_find_table(acpi.rsdp, "APIC");
+    UINTN cpu_count = acpi_madt_cpus(madt, bsp_id, NULL, 0, &kparms.interrupt_controller_base);
+    arch_get_cpu_topology(&kparms.topology, cpu_count);
+
+    // Get memory map to size the page table pool & boot info from; the buffer has room for the 
+    //   map to grow from the allocations below, and is reused for the final map
     if (EFI_ERROR(get_memory_map(&kparms.mmap))) goto cleanup;
 
-    // Exit boot services before calling kernel
-    UINTN retries = 0;
-    const UINTN MAX_RETRIES = 5;
-    while (EFI_ERROR(bs->ExitBootServices(image, kparms.mmap.key)) && retries < MAX_RETRIES) {
-        // firmware could do a partial shutdown, need to get memory map again
-        //   and try exit boot services again 
-        bs->FreePool(kparms.mmap.map);
-        if (EFI_ERROR(get_memory_map(&kparms.mmap))) goto cleanup;
-        retries++;
-    }
-    if (retries == MAX_RETRIES) {
-        error(0, u"Could not Exit Boot Services!\r\n");
+    // Size boot info block: Kernel_Parms, then a tag for each variable sized part. 
+    //   The memory maps are filled in after ExitBootServices(); the kernel memory map can have 
+    //   more regions than there are EFI descriptors, from splitting out kept memory.
+    UINTN memory_map_capacity = ((kparms.mmap.buffer_size / kparms.mmap.desc_size) * 2) + 16;
+    UINTN fonts_size = kparms.num_fonts * sizeof *kparms.fonts;
+    for (UINTN i = 0; i < kparms.num_fonts; i++) {
+        if (!kparms.fonts[i].glyphs) continue;
+        fonts_size += ((strlen(kparms.fonts[i].name) + 1 + 7) & ~(UINTN)7) + 
+                      ((glyphs_size[i] + 7) & ~(UINTN)7);
+    }
+
+    UINTN boot_info_size = BOOT_INFO_TAGS_OFFSET +
+        BOOT_TAG_SIZE(kparms.gop_mode.SizeOfInfo) +
+        BOOT_TAG_SIZE(kparms.mmap.buffer_size) +
+        BOOT_TAG_SIZE(memory_map_capacity * sizeof(Kernel_Memory_Region)) +
+        BOOT_TAG_SIZE(fonts_size) +
+        BOOT_TAG_SIZE(kparms.NumberOfTableEntries * sizeof *kparms.ConfigurationTable) +
+        BOOT_TAG_SIZE(sizeof acpi) +
+        BOOT_TAG_SIZE(cmdline ? strlen(cmdline) + 1 : 0) +
+        BOOT_TAG_SIZE(cpu_count * sizeof(Boot_CPU)) +
+        BOOT_TAG_SIZE(0);
+
+    // Reserve all memory needed after ExitBootServices() now: page tables & runtime memory map 
+    //   come from a preallocated pool, and per CPU memory & boot info are allocated here too.
+    //   The AP trampoline loads CR3 in real mode, so page tables need to be below 4GiB.
+    boot_info_pages = (boot_info_size + (PAGE_SIZE-1)) / PAGE_SIZE;
+    status = bs->AllocatePages(AllocateAnyPages, EfiLoaderData, boot_info_pages, &boot_info);
+    if (EFI_ERROR(status)) {
+        error(status, u"Could not allocate %u pages for boot info.\r\n", boot_info_pages);
         goto cleanup;
     }
 
-    // Initialize page tables
-    arch_init_page_tables(&kparms.mmap);
+    pt_pool_pages = page_table_pages_estimate(&kparms.mmap) + boot_info_pages + 
+                    (kparms.mmap.buffer_size + (PAGE_SIZE-1)) / PAGE_SIZE;
+    pt_pool = 0xFFFFFFFF;
+    status = bs->AllocatePages(AllocateMaxAddress, EfiLoaderData, pt_pool_pages, &pt_pool);
+    if (EFI_ERROR(status)) {
+        pt_pool = 0;
+        error(status, u"Could not allocate %u pages for page tables.\r\n", pt_pool_pages);
+        goto cleanup;
+    }
 
-    // Identity mapping all available memory 
-    identity_map_efi_mmap(&kparms.mmap);
+    uint32_t stack_size = STACK_PAGES * PAGE_SIZE;
+    cpu_block_pages = cpu_count * CPU_PAGES;
+    status = bs->AllocatePages(AllocateAnyPages, EfiLoaderData, cpu_block_pages, &cpu_block);
+    if (EFI_ERROR(status)) {
+        cpu_block = 0;
+        error(status, u"Could not allocate kernel stacks for %u CPUs.\r\n", cpu_count);
+        goto cleanup;
+    }
+    parallel_memset((VOID *)cpu_block, 0, cpu_block_pages * PAGE_SIZE);
 
-    // Identity map runtime services memory & set new runtime address map
-    set_runtime_address_map(&kparms.mmap);
+    // AP startup code runs in real mode first, and the SIPI vector is a page number below 1MiB; 
+    //   without it, the kernel can still run on the BSP only
+    if (cpu_count > 1) {
+        ap_trampoline = 0xFFFFF;
+        status = bs->AllocatePages(AllocateMaxAddress, EfiLoaderData, 1, &ap_trampoline);
+        if (EFI_ERROR(status)) ap_trampoline = 0;
+    }
 
-    // Remap kernel to higher addresses
-    for (UINTN i = 0; i < (kernel_size + (PAGE_SIZE-1)) / PAGE_SIZE; i++) 
-        arch_map_page(kernel_buffer + (i*PAGE_SIZE), 
-                      KERNEL_START_ADDRESS + (i*PAGE_SIZE), 
-                      &kparms.mmap); 
+    Page_Allocator pt_allocator = {0};
+    if (!page_allocator_init_range(&pt_allocator, pt_pool, pt_pool_pages)) {
+        error(0, u"Could not set up page table allocator for %u pages.\r\n", pt_pool_pages);
+        goto cleanup;
+    }
 
-    // NOTE: TODO: Remap kparms to higher address?
+    // Pack boot info; pointers in it are set to where the kernel sees the block
+    Boot_Info_Builder builder = {
+        .buffer       = (UINT8 *)boot_info,
+        .size         = BOOT_INFO_TAGS_OFFSET,
+        .capacity     = boot_info_pages * PAGE_SIZE,
+        .virtual_base = BOOT_INFO_START_ADDRESS,
+    };
+    parallel_memset(builder.buffer, 0, builder.capacity);
+
+    // Add all tags first, the block is sized for them but check anyway before filling them in
+    EFI_GRAPHICS_OUTPUT_MODE_INFORMATION *mode_info = 
+        boot_info_add_tag(&builder, BOOT_TAG_FRAMEBUFFER, kparms.gop_mode.SizeOfInfo);
+    EFI_MEMORY_DESCRIPTOR *efi_mmap = 
+        boot_info_add_tag(&builder, BOOT_TAG_EFI_MEMORY_MAP, kparms.mmap.buffer_size);
+    Kernel_Memory_Region *memory_map = 
+        boot_info_add_tag(&builder, BOOT_TAG_MEMORY_MAP, memory_map_capacity * sizeof *memory_map);
+    Bitmap_Font *fonts = boot_info_add_tag(&builder, BOOT_TAG_FONTS, fonts_size);
+    EFI_CONFIGURATION_TABLE *config_table = 
+        boot_info_add_tag(&builder, BOOT_TAG_CONFIG_TABLE, 
+                          kparms.NumberOfTableEntries * sizeof *kparms.ConfigurationTable);
+    Boot_Tag_ACPI *acpi_tag = boot_info_add_tag(&builder, BOOT_TAG_ACPI, sizeof acpi);
+    char *cmdline_tag = cmdline ? boot_info_add_tag(&builder, BOOT_TAG_CMDLINE, strlen(cmdline) + 1) 
+                                : NULL;
+    Boot_CPU *cpus = boot_info_add_tag(&builder, BOOT_TAG_CPUS, cpu_count * sizeof *cpus);
+
+    if (!mode_info || !efi_mmap || !memory_map || !fonts || !config_table || !acpi_tag || 
+        (cmdline && !cmdline_tag) || !cpus || !boot_info_add_tag(&builder, BOOT_TAG_END, 0)) {
+        error(EFI_BUFFER_TOO_SMALL, u"Boot info block is too small for all tags (%u bytes).\r\n", 
+              builder.capacity);
+        goto cleanup;
+    }
 
-    // Identity map framebuffer
-    for (UINTN i = 0; i < (kparms.gop_mode.FrameBufferSize + (PAGE_SIZE-1)) / PAGE_SIZE; i++) 
-        identity_map_page(kparms.gop_mode.FrameBufferBase + (i*PAGE_SIZE), &kparms.mmap); 
+    memcpy(mode_info, kparms.gop_mode.Info, kparms.gop_mode.SizeOfInfo);
+
+    // Fonts array, with each font's name & glyphs after it
+    UINT8 *font_data = (UINT8 *)(fonts + kparms.num_fonts);
+    for (UINTN i = 0; i < kparms.num_fonts; i++) {
+        if (!kparms.fonts[i].glyphs) continue;
+        fonts[i] = kparms.fonts[i];
+
+        UINTN name_size = strlen(kparms.fonts[i].name) + 1;
+        memcpy(font_data, kparms.fonts[i].name, name_size);
+        fonts[i].name = boot_info_virtual(&builder, font_data);
+        font_data += (name_size + 7) & ~(UINTN)7;
+
+        memcpy(font_data, kparms.fonts[i].glyphs, glyphs_size[i] - 8);
+        fonts[i].glyphs = boot_info_virtual(&builder, font_data);
+        font_data += (glyphs_size[i] + 7) & ~(UINTN)7;
+    }
+
+    memcpy(config_table, kparms.ConfigurationTable, 
+           kparms.NumberOfTableEntries * sizeof *kparms.ConfigurationTable);
+    memcpy(acpi_tag, &acpi, sizeof acpi);
+    if (cmdline) memcpy(cmdline_tag, cmdline, strlen(cmdline) + 1);
+
+    // CPUs, BSP first, each with its own arch tables, data page, & stack from the per CPU block
+    acpi_madt_cpus(madt, bsp_id, cpus, cpu_count, &kparms.interrupt_controller_base);
+    for (UINTN i = 0; i < cpu_count; i++) {
+        UINT8 *cpu_memory = (UINT8 *)cpu_block + (i * CPU_PAGES * PAGE_SIZE);
+        cpus[i].arch_data  = cpu_memory;
+        cpus[i].cpu_data   = cpu_memory + PAGE_SIZE;
+        cpus[i].stack_top  = (UINTN)cpu_memory + (CPU_PAGES * PAGE_SIZE);
+        cpus[i].stack_size = stack_size;
+        arch_init_cpu_tables(&cpus[i]);
+    }
+
+    // Everything the kernel needs from loader memory is in the boot info block now; a flat 
+    //   binary kernel runs from the file buffer itself, so that is not freed
+    if (kernel_buffer != (EFI_PHYSICAL_ADDRESS)disk_buffer) {
+        bs->FreePages((EFI_PHYSICAL_ADDRESS)disk_buffer, EFI_SIZE_TO_PAGES(file_size));
+        disk_buffer = NULL;
+    }
+    if (psf_font) bs->FreePages((EFI_PHYSICAL_ADDRESS)psf_font, EFI_SIZE_TO_PAGES(psf_size));
+    psf_font = NULL;
+    arena_reset(&scratch_arena, scratch_mark);  // Font package list, glyphs, cmdline
+    pkg_list = NULL;
+    cmdline = NULL;
+    kparms.fonts = NULL;
+
+    // Build page tables before exiting boot services; the allocations above changed the map, 
+    //   so get it again first. Memory ranges do not change from here on, only descriptor types, 
+    //   so these mappings stay valid for the final map.
+    if (EFI_ERROR(refresh_memory_map(&kparms.mmap))) {
+        error(0, u"Could not get memory map.\r\n");
+        goto cleanup;
+    }
 
-    // Identity map new stack for kernel
-    const UINTN STACK_PAGES = 16;   
-    void *kernel_stack = mmap_allocate_pages(&kparms.mmap, STACK_PAGES);   // 64KiB stack
-    uint32_t stack_size = STACK_PAGES * PAGE_SIZE;
-    memset(kernel_stack, 0, stack_size); // Initialize stack memory
+    // Initialize page tables
+    boot_stage("Page tables", NULL);
+    arch_init_page_tables(&pt_allocator);
+    page_map_conflicts = 0;
 
-    for (UINTN i = 0; i < STACK_PAGES; i++) 
-        identity_map_page((UINTN)kernel_stack + (i*PAGE_SIZE), &kparms.mmap); 
+    // Identity map framebuffer as write combining; this is done before mapping the memory map 
+    //   in case the framebuffer is also in there as uncached MMIO
+    arch_map_range(kparms.gop_mode.FrameBufferBase, kparms.gop_mode.FrameBufferBase,
+                   kparms.gop_mode.FrameBufferSize, MAP_CACHE_WC, &pt_allocator);
 
-    // Set page tables & paging, do other arch specific settings, and call kernel
-    arch_setup_and_call_kernel(higher_entry_point, kernel_stack, stack_size, &kparms);
+    // Identity mapping all available memory 
+    boot_stage("identity_map_efi_mmap", NULL);
+    PMU_Sample pmu_start = pmu_begin();
+    identity_map_efi_mmap(&kparms.mmap, &pt_allocator);
+    pmu_end("identity_map_efi_mmap", &pmu_start);
+
+    // Map all RAM again in the higher half for the kernel
+    boot_stage("Kernel mappings", NULL);
+    if (map_physmap) {
+        pmu_start = pmu_begin();
+        map_efi_mmap(&kparms.mmap, PHYSMAP_START_ADDRESS, true, &pt_allocator);
+        pmu_end("map_efi_mmap physmap", &pmu_start);
+        kparms.physmap_base = PHYSMAP_START_ADDRESS;
+    }
+
+    // Remap kernel to higher addresses, this uses 2MiB pages where the kernel was loaded at a 
+    //   2MiB aligned address e.g. from 2MiB aligned ELF segments
+    arch_map_range(kernel_buffer, KERNEL_START_ADDRESS, kernel_size, MAP_CACHE_WB | MAP_GLOBAL, 
+                   &pt_allocator);
+
+    // Map boot info block to higher addresses
+    arch_map_range(boot_info, BOOT_INFO_START_ADDRESS, boot_info_pages * PAGE_SIZE, 
+                   MAP_CACHE_WB | MAP_GLOBAL, &pt_allocator);
+
+    // Identity map per CPU memory & stacks for kernel
+    arch_map_range(cpu_block, cpu_block, cpu_block_pages * PAGE_SIZE, MAP_CACHE_WB, &pt_allocator);
+
+    // Identity map local APIC registers as uncached & install AP startup code, for the kernel 
+    //   to start APs with arch_start_aps()
+    if (kparms.interrupt_controller_base) 
+        arch_map_range(kparms.interrupt_controller_base, kparms.interrupt_controller_base, 
+                       PAGE_SIZE, MAP_CACHE_UC, &pt_allocator);
+
+    if (ap_trampoline) {
+        arch_map_range(ap_trampoline, ap_trampoline, PAGE_SIZE, MAP_CACHE_WB, &pt_allocator);
+        if (!arch_init_ap_trampoline(ap_trampoline)) {
+            bs->FreePages(ap_trampoline, 1);
+            ap_trampoline = 0;
+        }
+    }
+    kparms.ap_trampoline = ap_trampoline;
 
-    // Final cleanup
-    cleanup:
-    if (disk_buffer) bs->FreePool(disk_buffer); // Free memory for data partition file
-    if (pkg_list)    bs->FreePool(pkg_list);    // Free memory for simple font package list
+    // Exit boot services before calling kernel. Nothing is allocated or printed between getting 
+    //   the final memory map and ExitBootServices(); on failure the firmware may have done a 
+    //   partial shutdown, and only GetMemoryMap() is allowed before trying again.
+    const UINTN MAX_RETRIES = 5;
+    boot_stage("ExitBootServices", NULL);
+    kparms.exit_bs_start_time = arch_read_timestamp();
+    while (true) {
+        status = refresh_memory_map(&kparms.mmap);
+        if (!EFI_ERROR(status)) status = bs->ExitBootServices(image, kparms.mmap.key);
+        if (!EFI_ERROR(status) || kparms.exit_bs_retries == MAX_RETRIES) break;
+        kparms.exit_bs_retries++;
+    }
+    kparms.exit_bs_end_time = arch_read_timestamp();
 
-    if (kparms.fonts) {
-        // Free memory for kparms font glyphs
-        for (UINTN i = 0; i < kparms.num_fonts; i++)    
-            bs->FreePool(kparms.fonts[i].glyphs);
+    // Boot services may be partly shut down, so the console & memory frees in cleanup can't be
+    //   used; report on the serial port saved at startup, which needs no firmware, and halt
+    if (EFI_ERROR(status)) {
+        char msg[96];
+        sprintf(msg, "Could not exit boot services after %llu retries, status %llx; halting\r\n",
+                (UINT64)kparms.exit_bs_retries, (UINT64)status);
+        serial_write(msg);
+        while (true) arch_cpu_halt();
+    }
+
+    // Build page allocator for the kernel from the final memory map; boot services are gone so 
+    //   on failure there is nothing left to do but report it on serial & halt
+    boot_stage("Page allocator", NULL);
+    if (!page_allocator_init(&kparms.page_allocator, &kparms.mmap)) {
+        serial_write("Could not build kernel page allocator; halting\r\n");
+        while (true) arch_cpu_halt();
+    }
+
+    // Map runtime services memory into its own higher half window & set new runtime address map;
+    //   the runtime services pointer is then converted to use the new mapping, so the kernel 
+    //   does not need the identity mapping to call runtime services.
+    //   The window ends at the kernel; if runtime memory does not fit, or this fails otherwise,
+    //   runtime services are still usable at their physical addresses.
+    boot_stage("set_runtime_address_map", NULL);
+    if (!EFI_ERROR(set_runtime_address_map(&kparms.mmap, RUNTIME_START_ADDRESS, 
+                                                KERNEL_START_ADDRESS, &pt_allocator))) {
+        kparms.RuntimeServices = (EFI_RUNTIME_SERVICES *)
+            runtime_virtual_address(&kparms.mmap, (UINTN)kparms.RuntimeServices);
+    }
+
+    // Check the final page tables, and count tables & mappings; summary to serial & kernel
+    boot_stage("Page table stats", NULL);
+    arch_dump_page_tables(&kparms.page_tables, dump_page_tables);
+
+    // Copy final EFI memory map into boot info
+    boot_stage("Kernel memory map", NULL);
+    memcpy(efi_mmap, kparms.mmap.map, kparms.mmap.size);
+
+    // Create sorted & merged memory map for the kernel, with memory the kernel still uses marked 
+    //   as kept; memory from the page allocator is kept already, and all other loader memory is
+    //   reclaimable. The whole page table pool is kept: tables freed back to it (e.g. by 
+    //   arch_unmap_range()) leave holes, so the live tables are not just a prefix of the pool.
+    Memory_Range keep[] = {
+        { (UINTN)boot_info,       boot_info_pages * PAGE_SIZE },
+        { (UINTN)kernel_buffer,   kernel_size },
+        { (UINTN)cpu_block,       cpu_block_pages * PAGE_SIZE },
+        { (UINTN)ap_trampoline,   ap_trampoline ? PAGE_SIZE : 0 },
+        { (UINTN)pt_pool,         pt_pool_pages * PAGE_SIZE },
+    };
+    UINTN memory_map_count = fill_kernel_memory_map(&kparms.mmap, &kparms.page_allocator, 
+                                                    keep, ARRAY_SIZE(keep), 
+                                                    memory_map, memory_map_capacity);
+
+    // Fill out Kernel_Parms at the start of the boot info block; the last stage ends in kmain()
+    boot_stage("Handoff", NULL);
+    kparms.serial_base = serial_base;
+    kparms.boot_stages = boot_stages;
+    Kernel_Parms *boot_kparms = (Kernel_Parms *)builder.buffer;
+    *boot_kparms = kparms;
+    boot_kparms->magic              = BOOT_INFO_MAGIC;
+    boot_kparms->version            = BOOT_INFO_VERSION;
+    boot_kparms->size               = builder.size;
+    boot_kparms->mmap.map           = boot_info_virtual(&builder, efi_mmap);
+    boot_kparms->mmap.buffer_size   = kparms.mmap.buffer_size;
+    boot_kparms->gop_mode.Info      = boot_info_virtual(&builder, mode_info);
+    boot_kparms->fonts              = boot_info_virtual(&builder, fonts);
+    boot_kparms->ConfigurationTable = boot_info_virtual(&builder, config_table);
+    boot_kparms->memory_map         = boot_info_virtual(&builder, memory_map);
+    boot_kparms->memory_map_count   = min(memory_map_count, memory_map_capacity);
+    boot_kparms->cpus               = boot_info_virtual(&builder, cpus);
+    boot_kparms->cpu_count          = cpu_count;
+
+    // Set page tables & paging, do other arch specific settings, and call kernel on the BSP stack
+    arch_setup_and_call_kernel(higher_entry_point, &cpus[0], (Kernel_Parms *)BOOT_INFO_START_ADDRESS);
 
-        bs->FreePool(kparms.fonts);   // Free memory for kparms fonts array
-    }
+    // Final cleanup
+    cleanup:
+    boot_stages.count = first_stage;    // Next load attempt records its own stages
+    boot_stages.dropped = 0;
+    if (kernel_buffer && kernel_buffer != (EFI_PHYSICAL_ADDRESS)disk_buffer)
+        bs->FreePages(kernel_buffer, kernel_size / PAGE_SIZE);  // Free ELF/PE kernel image
+    if (disk_buffer)     bs->FreePages((EFI_PHYSICAL_ADDRESS)disk_buffer,     // Kernel file
+                                       EFI_SIZE_TO_PAGES(file_size));
+    if (kparms.mmap.map) bs->FreePool(kparms.mmap.map); // Free memory for memory map
+    if (psf_font)        bs->FreePages((EFI_PHYSICAL_ADDRESS)psf_font,        // PSF font file
+                                       EFI_SIZE_TO_PAGES(psf_size));
+    if (pt_pool)         bs->FreePages(pt_pool, pt_pool_pages);
+    if (cpu_block)       bs->FreePages(cpu_block, cpu_block_pages);
+    if (ap_trampoline)   bs->FreePages(ap_trampoline, 1);
+    if (boot_info)       bs->FreePages(boot_info, boot_info_pages);
+    arena_reset(&scratch_arena, scratch_mark);  // Font package list, glyphs, cmdline
 
     return EFI_SUCCESS;
 }
@@ -1689,6 +2329,42 @@ EFI_STATUS print_memory_map(void) {
     return EFI_SUCCESS;
 }
 
+// ======================================
+// Print CPU topology & cache hierarchy
+// ======================================
+EFI_STATUS print_cpu_info(void) { 
+    cout->ClearScreen(cout);
+
+    // Close Timer Event for cleanup
+    bs->CloseEvent(timer_event);
+
+    CPU_Topology topology = {0};
+    arch_get_cpu_topology(&topology, num_cpus);
+
+    printf_c16(u"Logical CPUs: %u, Packages: %u, Cores per package: %u, Threads per core: %u\r\n\r\n",
+               topology.logical_cpus, topology.packages, 
+               topology.cores_per_package, topology.threads_per_core);
+
+    const CHAR16 *cache_types[] = {
+        [CPU_CACHE_DATA]        = u"Data",
+        [CPU_CACHE_INSTRUCTION] = u"Instruction",
+        [CPU_CACHE_UNIFIED]     = u"Unified",
+    };
+
+    for (UINT32 i = 0; i < topology.num_caches; i++) {
+        CPU_Cache *cache = &topology.caches[i];
+        printf_c16(u"L%u %s: %u KiB, Line size: %u, Ways: %u, Sets: %u, Shared by: %u\r\n",
+                   cache->level, 
+                   cache->type <= CPU_CACHE_UNIFIED ? cache_types[cache->type] : u"Unknown",
+                   cache->size / 1024, cache->line_size, cache->ways, cache->sets, cache->shared_by);
+    }
+    if (topology.num_caches == 0) printf_c16(u"No cache info available.\r\n");
+
+    printf_c16(u"\r\nPress any key to go back...\r\n");
+    get_key();
+    return EFI_SUCCESS;
+}
+
 // =======================================
 // Print configuration table GUID values
 // =======================================
@@ -1959,22 +2635,25 @@ EFI_STATUS change_boot_variables(void) {
         return status;
     }
 
+    // Variable name buffer is reused for every screen, and only grows when a name does not fit;
+    //   GetNextVariableName() sets the size to the name's size, so it is reset to the capacity
+    //   before each call
+    UINTN var_name_capacity = 64 * sizeof(CHAR16);
+    CHAR16 *var_name_buf = NULL;
+    status = bs->AllocatePool(EfiLoaderData, var_name_capacity, (VOID **)&var_name_buf);
+    if (EFI_ERROR(status)) {
+        error(status, u"Could not allocate %u bytes for variable names.\r\n", var_name_capacity);
+        return status;
+    }
+
     // Overall screen loop
     UINT32 boot_order_attributes = 0;
     while (true) {
         cout->ClearScreen(cout);
 
-        UINTN var_name_size = 0;
-        CHAR16 *var_name_buf = 0;
+        UINTN var_name_size = var_name_capacity;
         EFI_GUID vendor_guid = {0};
 
-        var_name_size = 2;
-        status = bs->AllocatePool(EfiLoaderData, var_name_size, (VOID **)&var_name_buf);
-        if (EFI_ERROR(status)) {
-            error(status, u"Could not allocate 2 bytes...\r\n");
-            return status;
-        }
-
         // Set variable name to point to initial single null byte, to start off call to get list of
         //   variable names
         *var_name_buf = u'\0';
@@ -1983,18 +2662,21 @@ EFI_STATUS change_boot_variables(void) {
         while (status != EFI_NOT_FOUND) {   // End of list
             if (status == EFI_BUFFER_TOO_SMALL) {
                 // Reallocate larger buffer for variable name
+                UINTN new_capacity = max(var_name_size, var_name_capacity * 2);
                 CHAR16 *temp_buf = NULL;
-                status = bs->AllocatePool(EfiLoaderData, var_name_size, (VOID **)&temp_buf);
+                status = bs->AllocatePool(EfiLoaderData, new_capacity, (VOID **)&temp_buf);
                 if (EFI_ERROR(status)) {
                     error(status, u"Could not allocate %u bytes of memory for next variable name.\r\n",
-                                  var_name_size);
-                    return status;
+                                  new_capacity);
+                    goto cleanup;
                 }
                 
                 strcpy_c16(temp_buf, var_name_buf);  // Copy old buffer to new buffer
                 bs->FreePool(var_name_buf);          // Free old buffer
                 var_name_buf = temp_buf;             // Set new buffer
+                var_name_capacity = new_capacity;
 
+                var_name_size = var_name_capacity;
                 status = rs->GetNextVariableName(&var_name_size, var_name_buf, &vendor_guid);
                 continue;
             }
@@ -2006,13 +2688,14 @@ EFI_STATUS change_boot_variables(void) {
                 // Get variable value
                 UINT32 attributes = 0;
                 UINTN data_size = 0;
-                VOID *data = NULL;
+                Arena_Mark data_mark = arena_mark(&scratch_arena);  // Data is only needed here
 
                 // Call first with 0 data size to get actual size needed
                 rs->GetVariable(var_name_buf, &vendor_guid, &attributes, &data_size, NULL);
 
-                status = bs->AllocatePool(EfiLoaderData, data_size, (VOID **)&data);
-                if (EFI_ERROR(status)) {
+                VOID *data = scratch_alloc(data_size);
+                if (!data) {
+                    status = EFI_OUT_OF_RESOURCES;
                     error(status, u"Could not allocate %u bytes of memory for GetVariable().\r\n",
                                   data_size);
                     goto cleanup;
@@ -2069,6 +2752,7 @@ EFI_STATUS change_boot_variables(void) {
                         dpttp->ConvertDevicePathToText(file_path_list, FALSE, FALSE);
 
                     printf_c16(u"Device Path: %s\r\n", device_path_text ? device_path_text : u"(null)");
+                    if (device_path_text) bs->FreePool(device_path_text);
 
                     UINT8 *optional_data = (UINT8 *)file_path_list + load_option->FilePathListLength;
                     UINTN optional_data_size = data_size - (optional_data - (UINT8 *)data);
@@ -2086,7 +2770,7 @@ EFI_STATUS change_boot_variables(void) {
                 printf_c16(u"\r\n");  // Unhandled Boot* variable, go on with space before next one
 
                 next:
-                bs->FreePool(data);
+                arena_reset(&scratch_arena, data_mark);
             }
 
             // Pause at bottom of screen
@@ -2095,6 +2779,7 @@ EFI_STATUS change_boot_variables(void) {
                 get_key();
                 cout->ClearScreen(cout);
             }
+            var_name_size = var_name_capacity;
             status = rs->GetNextVariableName(&var_name_size, var_name_buf, &vendor_guid);
         }
 
@@ -2137,16 +2822,15 @@ EFI_STATUS change_boot_variables(void) {
             }
 
         } else {
-            bs->FreePool(var_name_buf);
             break;
         }
-
-        cleanup:
-        // Free buffers when done
-        bs->FreePool(var_name_buf);
     }
+    status = EFI_SUCCESS;
 
-    return EFI_SUCCESS;
+    cleanup:
+    // Free buffers when done
+    bs->FreePool(var_name_buf);
+    return status;
 }
 
 // =================================================================
@@ -2213,7 +2897,8 @@ EFI_STATUS install_to_disk(void) {
         char buf[512];
         sprintf(buf, "GOP_MODE=%u\r\n"
                      "XRES=%u\r\n"
-                     "YRES=%u\r\n",
+                     "YRES=%u\r\n"
+                     "CMDLINE=\r\n",      // Kernel command line, can be edited later
                      mode_num,
                      fb_width,
                      fb_height);
@@ -2250,6 +2935,7 @@ EFI_STATUS write_to_another_disk(void) {
     UINTN num_handles = 0;
     EFI_HANDLE *handle_buffer = NULL;
     EFI_BLOCK_IO_PROTOCOL *disk_image_bio = NULL, *chosen_disk_bio = NULL;
+    VOID *file_buffer = NULL, *image_buffer = NULL;
 
     cout->ClearScreen(cout);
 
@@ -2264,30 +2950,29 @@ EFI_STATUS write_to_another_disk(void) {
     // Get size of disk image from file 
     CHAR16 *file_name = u"\\EFI\\BOOT\\FILE.TXT";
     UINTN buf_size = 0;
-    VOID *file_buffer = NULL;
     file_buffer = read_esp_file_to_buffer(file_name, &buf_size);
     if (!file_buffer) {
         error(0, u"Could not find or read file '%s' to buffer\r\n", file_name);
-        return 1;
+        status = 1;
+        goto cleanup;
     }
 
     char *str_pos = strstr(file_buffer, "DISK_SIZE=");
     if (!str_pos) {
         error(0, u"Could not find disk image size in FILE.TXT\r\n");
-        return 1;
+        status = 1;
+        goto cleanup;
     }
 
     str_pos += strlen("DISK_SIZE=");
     UINTN disk_image_size = atoi(str_pos);
 
-    // Free file buffer when done
-    bs->FreePool(file_buffer);
 
     // Loop through and print all full disk Block IO protocol Media 
     status = bs->LocateHandleBuffer(ByProtocol, &bio_guid, NULL, &num_handles, &handle_buffer);
     if (EFI_ERROR(status)) {
         error(status, u"Could not locate any Block IO Protocols.\r\n");
-        return status;
+        goto cleanup;
     }
 
     UINT32 last_media_id = -1;  // Keep track of currently opened Media info
@@ -2366,9 +3051,10 @@ EFI_STATUS write_to_another_disk(void) {
         }
     }
 
-    if (!found) {
+    if (!found || !disk_image_bio) {
         error(0, u"Could not find media with ID %u\r\n", chosen_media);
-        return 1;
+        status = 1;
+        goto cleanup;
     }
 
     // Ask user to install bootloader yes/no. If yes, will autoload kernel on next
@@ -2388,12 +3074,13 @@ EFI_STATUS write_to_another_disk(void) {
            from_block_size, to_block_size,
            from_blocks, to_blocks);
 
-    // Allocate buffer to hold copy of disk image
-    VOID *image_buffer = NULL;
-    status = bs->AllocatePool(EfiLoaderData, disk_image_size, &image_buffer);
+    // Allocate buffer to hold copy of disk image, in whole blocks for both disks
+    status = bs->AllocatePool(EfiLoaderData, 
+                              max(from_blocks * from_block_size, to_blocks * to_block_size), 
+                              &image_buffer);
     if (EFI_ERROR(status)) {
         error(status, u"Could not allocate memory for disk image.\r\n");
-        return status;
+        goto cleanup;
     }
 
     // Read Blocks from disk image media to buffer
@@ -2405,7 +3092,7 @@ EFI_STATUS write_to_another_disk(void) {
                                         image_buffer);
     if (EFI_ERROR(status)) {
         error(status, u"Could not read blocks from disk image media to buffer.\r\n");
-        return status;
+        goto cleanup;
     }
 
     // Write Blocks from buffer to chosen media disk 
@@ -2417,27 +3104,117 @@ EFI_STATUS write_to_another_disk(void) {
                                           image_buffer);
     if (EFI_ERROR(status)) {
         error(status, u"Could not write blocks from buffer to chosen disk.\r\n");
-        return status;
+        goto cleanup;
     }
 
-    // Cleanup
-    bs->FreePool(image_buffer);
-
     printf_c16(u"\r\nDisk Image written to chosen disk.\r\n"
            u"Reboot and choose new boot option when able.\r\n");
 
+    printf_c16(u"\r\nPress any key to go back...\r\n");
+    get_key();
+
+    // Cleanup
+    cleanup:
+    if (handle_buffer) bs->FreePool(handle_buffer);
+    if (image_buffer)  bs->FreePool(image_buffer);
+    return status;
+}
+
+#ifdef PROFILE_FIRMWARE
+// =================================================================
+// Print firmware call profile from the profiling shims, and write 
+//   it to the ESP as PROFILE.TXT
+// =================================================================
+EFI_STATUS print_firmware_profile(void) {
+    EFI_STATUS status = EFI_SUCCESS;
+    char *report = NULL;
+
+    cout->ClearScreen(cout);
+
+    // Call sites are printed as offsets from the loader image base
+    EFI_GUID lip_guid = EFI_LOADED_IMAGE_PROTOCOL_GUID;
+    EFI_LOADED_IMAGE_PROTOCOL *lip = NULL;
+    bs->OpenProtocol(image, &lip_guid, (VOID **)&lip, image, NULL, EFI_OPEN_PROTOCOL_GET_PROTOCOL);
+
+    report = scratch_alloc(PROFILE_REPORT_SIZE);
+    if (!report) {
+        error(EFI_OUT_OF_RESOURCES, u"Could not allocate buffer for profile report.\r\n");
+        return EFI_OUT_OF_RESOURCES;
+    }
+    UINTN report_size = firmware_profile_report(report, PROFILE_REPORT_SIZE, 
+                                                lip ? (UINTN)lip->ImageBase : 0);
+
+    // Print report a line at a time
+    char *line = report;
+    while (*line) {
+        char *end = line;
+        while (*end && *end != '\n') end++;
+        char saved = *end;
+        *end = '\0';
+        printf_c16(u"%hhs\n", line);
+        *end = saved;
+        line = saved ? end + 1 : end;
+
+        // Pause if reached bottom of screen
+        if (cout->Mode->CursorRow >= text_rows-2) {
+            printf_c16(u"Press any key to continue...\r\n");
+            get_key();
+            cout->ClearScreen(cout);
+        }
+    }
+
+    // Write report to ESP, replacing an older report
+    EFI_FILE_PROTOCOL *root = esp_root_dir();
+    EFI_FILE_PROTOCOL *file = NULL;
+    CHAR16 *path = u"\\EFI\\BOOT\\PROFILE.TXT";
+    if (!root) {
+        error(0, u"Could not get ESP root directory.\r\n");
+        goto cleanup;
+    }
+
+    if (!EFI_ERROR(root->Open(root, &file, path, EFI_FILE_MODE_READ | EFI_FILE_MODE_WRITE, 0))) {
+        file->Delete(file);     // Also closes file
+        file = NULL;
+    }
+
+    status = root->Open(root, &file, path, 
+                        EFI_FILE_MODE_CREATE | EFI_FILE_MODE_READ | EFI_FILE_MODE_WRITE, 0);
+    if (EFI_ERROR(status) || EFI_ERROR(status = file->Write(file, &report_size, report))) {
+        error(status, u"Could not write file '%s'\r\n", path);
+        goto cleanup;
+    }
+    printf_c16(u"\r\nWrote report to '%s'\r\n", path);
+
+    cleanup:
+    if (file) file->Close(file);
+    if (root) root->Close(root);
+
     printf_c16(u"\r\nPress any key to go back...\r\n");
     get_key();
     return EFI_SUCCESS;
 }
+#endif
 
 // ====================
 // Entry Point
 // ====================
 EFI_STATUS efi_main(EFI_HANDLE ImageHandle, EFI_SYSTEM_TABLE *SystemTable) {
+    // Timestamp ticks are usable before calibration, stage times are converted later
+    boot_stage("Init & clock calibration", NULL);
+
     // Initialize global variables
     init_global_variables(ImageHandle, SystemTable);
 
+    // Calibrate timestamp counter for now_ns(), before anything is timed with it
+    CLOCK_SOURCE clock_source = CLOCK_SOURCE_NONE;
+    UINT32 clock_flags = 0;
+    UINT64 frequency = arch_calibrate_timestamp(get_acpi_rsdp(), &clock_source, &clock_flags);
+    timestamp_clock_init(frequency, clock_source, clock_flags);
+
+    // Serial port for kernel boot stage output & loader PMU regions
+    serial_base = arch_serial_base(get_acpi_rsdp());
+    pmu_init();
+
     // Reset Console Inputs/Outputs
     cin->Reset(cin, FALSE);
     cout->Reset(cout, FALSE);
@@ -2458,6 +3235,7 @@ EFI_STATUS efi_main(EFI_HANDLE ImageHandle, EFI_SYSTEM_TABLE *SystemTable) {
     text_cols = cols;
 
     // Check for "installed" file to autoload kernel instead of main menu, or not
+    boot_stage("Autoload check", NULL);
     EFI_FILE_PROTOCOL *root = esp_root_dir();
     if (root) {
         EFI_STATUS status = EFI_SUCCESS;
@@ -2470,6 +3248,7 @@ EFI_STATUS efi_main(EFI_HANDLE ImageHandle, EFI_SYSTEM_TABLE *SystemTable) {
     }
 
     if (autoload_kernel) load_kernel(); // Load kernel; Should not return!
+    boot_stage_wait("Main menu");
 
     // Menu text on screen
     const CHAR16 *menu_choices[] = {
@@ -2480,6 +3259,7 @@ EFI_STATUS efi_main(EFI_HANDLE ImageHandle, EFI_SYSTEM_TABLE *SystemTable) {
         u"Read ESP Files",
         u"Print Block IO Partitions",
         u"Print Memory Map",
+        u"Print CPU Info",
         u"Print Configuration Tables",
         u"Print ACPI Tables",
         u"Print EFI Global Variables",
@@ -2487,6 +3267,9 @@ EFI_STATUS efi_main(EFI_HANDLE ImageHandle, EFI_SYSTEM_TABLE *SystemTable) {
         u"Change Boot Variables",
         u"Write Disk Image Image To Other Disk",
         u"Install Bootloader & Autoload Kernel",
+#ifdef PROFILE_FIRMWARE
+        u"Print Firmware Call Profile",
+#endif
     };
 
     // Functions to call for each menu option
@@ -2498,13 +3281,17 @@ EFI_STATUS efi_main(EFI_HANDLE ImageHandle, EFI_SYSTEM_TABLE *SystemTable) {
         read_esp_files,
         print_block_io_partitions,
         print_memory_map,
+        print_cpu_info,
         print_config_tables,
         print_acpi_tables,
         print_efi_global_variables,
         load_kernel,
         change_boot_variables,
         write_to_another_disk,
-        install_to_disk
+        install_to_disk,
+#ifdef PROFILE_FIRMWARE
+        print_firmware_profile,
+#endif
     };
 
     // Connect all controllers found for all handles, to hopefully fix
@@ -2601,10 +3388,19 @@ EFI_STATUS efi_main(EFI_HANDLE ImageHandle, EFI_SYSTEM_TABLE *SystemTable) {
                         cout->ClearScreen(cout);
 
                         // Enter key, select choice
+#ifdef TRACK_ALLOCS
+                        UINT64 alloc_mark = track_allocs_mark();
+#endif
                         EFI_STATUS return_status = menu_funcs[current_row]();
                         if (EFI_ERROR(return_status)) 
                             error(return_status, u"Press any key to go back...");
 
+                        // Nothing in scratch memory outlives the action
+                        arena_free_all(&scratch_arena);
+#ifdef TRACK_ALLOCS
+                        track_allocs_report(menu_choices[current_row], alloc_mark);
+#endif
+
                         // Will leave input loop and reprint main menu
                         getting_input = false; 
                     }
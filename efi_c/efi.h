@@ -67,6 +67,10 @@ typedef UINT64 EFI_VIRTUAL_ADDRESS;
 //  UEFI Spec 2.10A Appendix B.1
 #define SCANCODE_UP_ARROW   0x1
 #define SCANCODE_DOWN_ARROW 0x2
+#define SCANCODE_HOME       0x5
+#define SCANCODE_END        0x6
+#define SCANCODE_PAGE_UP    0x9
+#define SCANCODE_PAGE_DOWN  0xA
 #define SCANCODE_ESC        0x17
 
 #define EFI_SIMPLE_NETWORK_PROTOCOL_GUID \
@@ -178,10 +182,18 @@ typedef UINT64 EFI_VIRTUAL_ADDRESS;
 {0xEBD0A0A2, 0xB9E5, 0x4433, \
 0x87, 0xC0, {0x68, 0xB6, 0xB7, 0x26, 0x99, 0xC7}}
 
+#define EFI_MP_SERVICES_PROTOCOL_GUID \
+{0x3fdda605,0xa76e,0x4f46,\
+0xad,0x29,{0x12,0xf4,0x53,0x1b,0x3d,0x08}}
+
 #define EFI_PCI_IO_PROTOCOL_GUID \
 {0x4cf5b200,0x68b8,0x4ca5, \
 0x9e,0xec, {0xb2, 0x3e, 0x3f, 0x50, 0x02, 0x9a}}
 
+#define EFI_TIMESTAMP_PROTOCOL_GUID \
+{0xafbfde41,0x2e6e,0x4262, \
+0xba,0x65, {0x62, 0xb9, 0x23, 0x6e, 0x54, 0x95}}
+
 // EFI_STATUS Codes - UEFI Spec 2.10 Appendix D
 #define EFI_SUCCESS 0ULL
 
@@ -191,16 +203,22 @@ typedef UINT64 EFI_VIRTUAL_ADDRESS;
 
 #define EFI_UNSUPPORTED      ENCODE_ERROR(3)
 #define EFI_BUFFER_TOO_SMALL ENCODE_ERROR(5)
+#define EFI_NOT_READY        ENCODE_ERROR(6)
 #define EFI_DEVICE_ERROR     ENCODE_ERROR(7)
+#define EFI_OUT_OF_RESOURCES ENCODE_ERROR(9)
 #define EFI_NOT_FOUND        ENCODE_ERROR(14)
+#define EFI_TIMEOUT          ENCODE_ERROR(18)
 #define EFI_CRC_ERROR        ENCODE_ERROR(27)
 
 #define MAX_EFI_ERROR 36
 const CHAR16 *EFI_ERROR_STRINGS[MAX_EFI_ERROR] = {
     [3]  = u"EFI_UNSUPPORTED",
     [5]  = u"EFI_BUFFER_TOO_SMALL",
+    [6]  = u"EFI_NOT_READY",
     [7]  = u"EFI_DEVICE_ERROR",
+    [9]  = u"EFI_OUT_OF_RESOURCES",
     [14] = u"EFI_NOT_FOUND",
+    [18] = u"EFI_TIMEOUT",
     [27] = u"EFI_CRC_ERROR",
 };
 
@@ -813,6 +831,12 @@ typedef enum {
     MaxAllocateType
 } EFI_ALLOCATE_TYPE;
 
+// Pages for AllocatePages()/FreePages() are always 4KiB
+#define EFI_PAGE_SIZE  4096
+#define EFI_PAGE_MASK  0xFFF
+#define EFI_PAGE_SHIFT 12
+#define EFI_SIZE_TO_PAGES(size) (((size) >> EFI_PAGE_SHIFT) + (((size) & EFI_PAGE_MASK) ? 1 : 0))
+
 // EFI_MEMORY_TYPE: UEFI Spec 2.10 section 7.2.1
 typedef enum {
     EfiReservedMemoryType,
@@ -1201,6 +1225,13 @@ EFI_STATUS
     IN EFI_EVENT Event
 );
 
+// EFI_CHECK_EVENT: UEFI Spec 2.10 section 7.1.6
+typedef
+EFI_STATUS
+(EFIAPI *EFI_CHECK_EVENT) (
+    IN EFI_EVENT Event
+);
+
 // EFI_EXIT_BOOT_SERVICES: UEFI Spec 2.10 section 7.4.6
 typedef
 EFI_STATUS
@@ -1209,6 +1240,13 @@ EFI_STATUS
     IN UINTN      MapKey
 );
 
+// EFI_STALL: UEFI Spec 2.10 7.5.2
+typedef
+EFI_STATUS
+(EFIAPI *EFI_STALL) (
+    IN UINTN Microseconds
+);
+
 // EFI_SET_WATCHDOG_TIMER: UEFI Spec 2.10 7.5.1
 typedef
 EFI_STATUS
@@ -1827,7 +1865,7 @@ typedef struct {
     EFI_WAIT_FOR_EVENT WaitForEvent;
     void*              SignalEvent;
     EFI_CLOSE_EVENT    CloseEvent;
-    void*              CheckEvent;
+    EFI_CHECK_EVENT    CheckEvent;
 
     //
     // Protocol Handler Services
@@ -1855,7 +1893,7 @@ typedef struct {
     // Miscellaneous Services
     //
     void*                  GetNextMonotonicCount;
-    void*                  Stall;
+    EFI_STALL              Stall;
     EFI_SET_WATCHDOG_TIMER SetWatchdogTimer;
 
     //
@@ -2065,3 +2103,138 @@ typedef struct EFI_HII_DATABASE_PROTOCOL {
     void                               *GetPackageListHandle;
 } EFI_HII_DATABASE_PROTOCOL;
 
+// EFI_MP_SERVICES_PROTOCOL
+typedef struct EFI_MP_SERVICES_PROTOCOL EFI_MP_SERVICES_PROTOCOL;
+
+// EFI_AP_PROCEDURE: PI Spec 1.8 Vol. 2 section 13.4
+typedef
+VOID
+(EFIAPI *EFI_AP_PROCEDURE) (
+    IN OUT VOID *ProcedureArgument
+);
+
+// EFI_MP_SERVICES_GET_NUMBER_OF_PROCESSORS: PI Spec 1.8 Vol. 2 section 13.4.2
+typedef
+EFI_STATUS
+(EFIAPI *EFI_MP_SERVICES_GET_NUMBER_OF_PROCESSORS) (
+    IN EFI_MP_SERVICES_PROTOCOL *This,
+    OUT UINTN                   *NumberOfProcessors,
+    OUT UINTN                   *NumberOfEnabledProcessors
+);
+
+// Processor status flags for EFI_PROCESSOR_INFORMATION
+#define PROCESSOR_AS_BSP_BIT        0x00000001
+#define PROCESSOR_ENABLED_BIT       0x00000002
+#define PROCESSOR_HEALTH_STATUS_BIT 0x00000004
+
+// Set in ProcessorNumber for GetProcessorInfo() to also get ExtendedInformation
+#define CPU_V2_EXTENDED_TOPOLOGY (1 << 24)
+
+typedef struct {
+    UINT32 Package;
+    UINT32 Core;
+    UINT32 Thread;
+} EFI_CPU_PHYSICAL_LOCATION;
+
+typedef struct {
+    UINT32 Package;
+    UINT32 Module;
+    UINT32 Tile;
+    UINT32 Die;
+    UINT32 Core;
+    UINT32 Thread;
+} EFI_CPU_PHYSICAL_LOCATION2;
+
+typedef union {
+    EFI_CPU_PHYSICAL_LOCATION2 Location2;
+} EXTENDED_PROCESSOR_INFORMATION;
+
+// EFI_PROCESSOR_INFORMATION: PI Spec 1.8 Vol. 2 section 13.4.3
+typedef struct {
+    UINT64                         ProcessorId;
+    UINT32                         StatusFlag;
+    EFI_CPU_PHYSICAL_LOCATION      Location;
+    EXTENDED_PROCESSOR_INFORMATION ExtendedInformation;
+} EFI_PROCESSOR_INFORMATION;
+
+// EFI_MP_SERVICES_GET_PROCESSOR_INFO: PI Spec 1.8 Vol. 2 section 13.4.3
+typedef
+EFI_STATUS
+(EFIAPI *EFI_MP_SERVICES_GET_PROCESSOR_INFO) (
+    IN EFI_MP_SERVICES_PROTOCOL   *This,
+    IN UINTN                      ProcessorNumber,
+    OUT EFI_PROCESSOR_INFORMATION *ProcessorInfoBuffer
+);
+
+// EFI_MP_SERVICES_STARTUP_ALL_APS: PI Spec 1.8 Vol. 2 section 13.4.4
+typedef
+EFI_STATUS
+(EFIAPI *EFI_MP_SERVICES_STARTUP_ALL_APS) (
+    IN EFI_MP_SERVICES_PROTOCOL *This,
+    IN EFI_AP_PROCEDURE         Procedure,
+    IN BOOLEAN                  SingleThread,
+    IN EFI_EVENT                WaitEvent OPTIONAL,
+    IN UINTN                    TimeoutInMicroSeconds,
+    IN VOID                     *ProcedureArgument OPTIONAL,
+    OUT UINTN                   **FailedCpuList OPTIONAL
+);
+
+// EFI_MP_SERVICES_STARTUP_THIS_AP: PI Spec 1.8 Vol. 2 section 13.4.5
+typedef
+EFI_STATUS
+(EFIAPI *EFI_MP_SERVICES_STARTUP_THIS_AP) (
+    IN EFI_MP_SERVICES_PROTOCOL *This,
+    IN EFI_AP_PROCEDURE         Procedure,
+    IN UINTN                    ProcessorNumber,
+    IN EFI_EVENT                WaitEvent OPTIONAL,
+    IN UINTN                    TimeoutInMicroseconds,
+    IN VOID                     *ProcedureArgument OPTIONAL,
+    OUT BOOLEAN                 *Finished OPTIONAL
+);
+
+// EFI_MP_SERVICES_WHOAMI: PI Spec 1.8 Vol. 2 section 13.4.8
+typedef
+EFI_STATUS
+(EFIAPI *EFI_MP_SERVICES_WHOAMI) (
+    IN EFI_MP_SERVICES_PROTOCOL *This,
+    OUT UINTN                   *ProcessorNumber
+);
+
+// EFI_MP_SERVICES_PROTOCOL: PI Spec 1.8 Vol. 2 section 13.4.1
+typedef struct EFI_MP_SERVICES_PROTOCOL {
+    EFI_MP_SERVICES_GET_NUMBER_OF_PROCESSORS GetNumberOfProcessors;
+    EFI_MP_SERVICES_GET_PROCESSOR_INFO       GetProcessorInfo;
+    EFI_MP_SERVICES_STARTUP_ALL_APS          StartupAllAPs;
+    EFI_MP_SERVICES_STARTUP_THIS_AP          StartupThisAP;
+    //EFI_MP_SERVICES_SWITCH_BSP               SwitchBSP;
+    //EFI_MP_SERVICES_ENABLEDISABLEAP          EnableDisableAP;
+    void                                     *SwitchBSP;
+    void                                     *EnableDisableAP;
+    EFI_MP_SERVICES_WHOAMI                   WhoAmI;
+} EFI_MP_SERVICES_PROTOCOL;
+
+// EFI_TIMESTAMP_PROPERTIES: UEFI Spec 2.10 section 36.3.3
+typedef struct {
+    UINT64 Frequency;
+    UINT64 EndValue;
+} EFI_TIMESTAMP_PROPERTIES;
+
+// EFI_TIMESTAMP_GET: UEFI Spec 2.10 section 36.3.2
+typedef
+UINT64
+(EFIAPI *EFI_TIMESTAMP_GET) (
+    VOID
+);
+
+// EFI_TIMESTAMP_GET_PROPERTIES: UEFI Spec 2.10 section 36.3.3
+typedef
+EFI_STATUS
+(EFIAPI *EFI_TIMESTAMP_GET_PROPERTIES) (
+    OUT EFI_TIMESTAMP_PROPERTIES *Properties
+);
+
+// EFI_TIMESTAMP_PROTOCOL: UEFI Spec 2.10 section 36.3.1
+typedef struct {
+    EFI_TIMESTAMP_GET            GetTimestamp;
+    EFI_TIMESTAMP_GET_PROPERTIES GetProperties;
+} EFI_TIMESTAMP_PROTOCOL;
@@ -15,11 +15,14 @@
 // -----------------
 #define ARRAY_SIZE(x) (sizeof (x) / sizeof (x)[0])
 #define max(x, y) ((x) > (y) ? (x) : (y))
+#define min(x, y) ((x) < (y) ? (x) : (y))
 
 // -----------------
 // Global constants
 // -----------------
 #define PAGE_SIZE 4096  // 4KiB
+#define PAGE_SIZE_2MIB 0x200000     // 2MiB large page
+#define PAGE_SIZE_1GIB 0x40000000   // 1GiB large page
 
 // ELF Header - x86_64
 typedef struct {
@@ -144,6 +147,17 @@ typedef struct {
     UINT32 Characteristics;
 }__attribute__ ((packed)) PE_Section_Header_64;
 
+// Memory cache types for page mappings, used by arch_map_range() etc.
+typedef enum {
+    MAP_CACHE_WB = 0,   // Write back, normal RAM
+    MAP_CACHE_WT,       // Write through
+    MAP_CACHE_WC,       // Write combining e.g. framebuffer
+    MAP_CACHE_UC,       // Uncached e.g. MMIO & reserved memory
+
+    MAP_GLOBAL = 0x100, // Flag to OR with a cache type; mapping is the same in all address 
+                        //   spaces e.g. kernel higher half, and is kept in the TLB on CR3 loads
+} MAP_CACHE_TYPE;
+
 // Timer event context is the text mode screen bounds
 typedef struct {
     UINT32 rows; 
@@ -157,6 +171,7 @@ typedef struct {
     UINTN                 key;
     UINTN                 desc_size;
     UINT32                desc_version;
+    UINTN                 buffer_size;  // Allocated size of map buffer, can be more than size
 } Memory_Map_Info;
 
 // Bitmapped font info (assuming monospaced)
@@ -170,8 +185,182 @@ typedef struct {
                                 //   e.g. PSF font, or right->left e.g. terminus?
 } Bitmap_Font;
 
+// Physical page allocator; 1 bit per page starting at base address, set bits are used pages
+typedef struct {
+    UINT64 *bitmap;
+    UINTN  base;            // Physical address of first page in bitmap
+    UINTN  total_pages;     // Number of pages tracked in bitmap
+    UINTN  free_pages;      // Number of free pages left
+    UINTN  next_free;       // Lowest page index that could be free, to start searches from
+} Page_Allocator;
+
+// Page table statistics from arch_dump_page_tables()
+typedef struct {
+    UINT64 tables[4];       // Tables per level, [0] is the top level e.g. x86_64 PML4
+    UINT64 pages[3];        // Leaf entries by page size: 4KiB, 2MiB, 1GiB
+    UINT64 cache_bytes[4];  // Mapped bytes per MAP_CACHE_TYPE
+    UINT64 global_bytes;    // Mapped bytes with MAP_GLOBAL
+    UINT64 runs;            // Virtually & physically contiguous ranges with the same attributes
+    UINT64 misaligned;      // Large page entries with physical address bits below the page size
+    UINT64 cache_aliases;   // Overlapping physical ranges mapped with different cache types
+    UINT64 map_conflicts;   // Pages arch_map_range() skipped, already mapped to another address
+    bool   walked;          // Tables were walked; false if the arch can't, all counts are 0 then
+} Page_Table_Stats;
+
+// Kernel memory map region types, simplified from EFI memory types
+typedef enum {
+    KERNEL_MEMORY_USABLE = 0,       // Free RAM
+    KERNEL_MEMORY_RECLAIMABLE,      // Boot services & loader RAM, usable once the kernel is done 
+                                    //   with anything the loader left there e.g. the initial 
+                                    //   GDT/TSS on the loader stack
+    KERNEL_MEMORY_KEEP,             // RAM in use by the kernel: page allocator & page tables, 
+                                    //   kernel image & stack, kernel parms, fonts, etc.
+    KERNEL_MEMORY_ACPI_RECLAIMABLE, // ACPI tables, usable after they are parsed
+    KERNEL_MEMORY_ACPI_NVS,         // ACPI non volatile storage
+    KERNEL_MEMORY_RUNTIME,          // Runtime services code & data
+    KERNEL_MEMORY_MMIO,             // Memory mapped IO
+    KERNEL_MEMORY_RESERVED,         // Anything else, do not use
+} KERNEL_MEMORY_TYPE;
+
+// Kernel memory map entry; entries are sorted by address and adjacent entries of the same 
+//   type are merged
+typedef struct {
+    UINT64             base;
+    UINT64             pages;
+    KERNEL_MEMORY_TYPE type;
+} Kernel_Memory_Region;
+
+// Physical address range, e.g. for loader memory the kernel still needs
+typedef struct {
+    UINTN base;
+    UINTN size;
+} Memory_Range;
+
+// Boot info block: Kernel_Parms followed by tags for all variable sized data, in 1 page aligned
+//   allocation mapped into the kernel's higher half. Pointers in Kernel_Parms point to tag data 
+//   in the block, and the kernel can find other tags with boot_info_find_tag().
+#define BOOT_INFO_MAGIC   0x4F464E49544F4F42ULL   // "BOOTINFO"
+#define BOOT_INFO_VERSION 1
+
+typedef enum {
+    BOOT_TAG_END = 0,           // Last tag, no data
+    BOOT_TAG_FRAMEBUFFER,       // EFI_GRAPHICS_OUTPUT_MODE_INFORMATION, for gop_mode.Info
+    BOOT_TAG_EFI_MEMORY_MAP,    // EFI_MEMORY_DESCRIPTORs, for mmap.map
+    BOOT_TAG_MEMORY_MAP,        // Kernel_Memory_Regions, for memory_map
+    BOOT_TAG_FONTS,             // Bitmap_Fonts for fonts, followed by font names & glyphs
+    BOOT_TAG_CONFIG_TABLE,      // EFI_CONFIGURATION_TABLEs, for ConfigurationTable
+    BOOT_TAG_ACPI,              // Boot_Tag_ACPI
+    BOOT_TAG_CMDLINE,           // Null terminated ASCII kernel command line
+    BOOT_TAG_CPUS,              // Boot_CPUs, for cpus
+} BOOT_TAG_TYPE;
+
+// Tag header, tag data follows it. Tags are 8 byte aligned.
+typedef struct {
+    UINT32 type;    // BOOT_TAG_TYPE
+    UINT32 size;    // Size of data after this header
+} Boot_Tag;
+
+#define BOOT_TAG_SIZE(data_size) (sizeof(Boot_Tag) + (((data_size) + 7) & ~(UINTN)7))
+
+typedef struct {
+    UINT64 rsdp;        // Physical address of ACPI RSDP
+    UINT32 revision;    // RSDP revision, 0 for ACPI 1.0 (RSDT only), 2+ for XSDT
+} Boot_Tag_ACPI;
+
+// CPU features enabled by the loader on each CPU, for Kernel_Parms cpu_features
+#define CPU_FEATURE_SSE          (1 << 0)   // SSE & FXSAVE/FXRSTOR
+#define CPU_FEATURE_XSAVE        (1 << 1)   // XSAVE/XRSTOR, xsave_size is for XCR0 features
+#define CPU_FEATURE_AVX          (1 << 2)
+#define CPU_FEATURE_AVX512       (1 << 3)
+#define CPU_FEATURE_GLOBAL_PAGES (1 << 4)   // MAP_GLOBAL mappings stay in the TLB on CR3 loads
+#define CPU_FEATURE_PCID         (1 << 5)   // Process context IDs in CR3 bits 11:0
+#define CPU_FEATURE_INVPCID      (1 << 6)
+#define CPU_FEATURE_FSGSBASE     (1 << 7)   // RDFSBASE/WRFSBASE etc. instructions
+
+// Timestamp counter clock for now_ns(), calibrated by the loader
+typedef enum {
+    CLOCK_SOURCE_NONE = 0,      // Not calibrated, now_ns() returns 0
+    CLOCK_SOURCE_CPUID,         // TSC frequency from CPUID leaf 0x15
+    CLOCK_SOURCE_HPET,          // Measured against the HPET main counter
+    CLOCK_SOURCE_PM_TIMER,      // Measured against the ACPI PM timer
+    CLOCK_SOURCE_TIMESTAMP,     // Measured against EFI_TIMESTAMP_PROTOCOL
+    CLOCK_SOURCE_STALL,         // Measured with bs->Stall()
+    CLOCK_SOURCE_CNTFRQ,        // aarch64 generic timer frequency from CNTFRQ_EL0
+} CLOCK_SOURCE;
+
+#define CLOCK_INVARIANT 0x1     // Constant rate in all power states e.g. invariant TSC
+
+typedef struct {
+    UINT64 frequency;           // arch_read_timestamp() ticks per second
+    UINT64 boot_ticks;          // Timestamp at calibration, now_ns() counts from here
+    UINT32 source;              // CLOCK_SOURCE
+    UINT32 flags;               // CLOCK_* flags
+} Timestamp_Clock;
+
+// Boot stage timestamps from efi_main() to kmain(), from boot_stage()
+#define MAX_BOOT_STAGES 40
+#define BOOT_STAGE_WAIT 0x1     // Stage is time spent waiting on the user, not loading
+
+typedef struct {
+    char   name[32];
+    UINT64 timestamp;           // arch_read_timestamp() at start of stage
+    UINT32 flags;               // BOOT_STAGE_*
+} Boot_Stage;
+
+typedef struct {
+    UINT32     count;
+    UINT32     dropped;         // Stages not recorded, table was full
+    Boot_Stage stages[MAX_BOOT_STAGES];
+} Boot_Stages;
+
+// CPU cache & topology info from arch_get_cpu_topology()
+#define MAX_CPU_CACHES 8
+
+typedef enum {
+    CPU_CACHE_DATA = 1,
+    CPU_CACHE_INSTRUCTION,
+    CPU_CACHE_UNIFIED,
+} CPU_CACHE_TYPE;
+
+typedef struct {
+    UINT8  level;           // 1 = L1, etc.
+    UINT8  type;            // CPU_CACHE_TYPE
+    UINT16 line_size;       // Bytes
+    UINT16 ways;            // Associativity
+    UINT16 shared_by;       // Logical CPUs sharing this cache, 0 if unknown
+    UINT32 sets;
+    UINT32 size;            // Bytes
+} CPU_Cache;
+
+typedef struct {
+    UINT32    logical_cpus;
+    UINT32    packages;
+    UINT32    cores_per_package;
+    UINT32    threads_per_core;
+    UINT32    num_caches;
+    CPU_Cache caches[MAX_CPU_CACHES];
+} CPU_Topology;
+
+// Boot_CPU flags
+#define BOOT_CPU_BSP     0x1    // Bootstrap processor, running the loader & kmain()
+#define BOOT_CPU_STARTED 0x2    // Set by arch_start_aps() when the CPU reached its entry point
+
+// Per CPU info & memory set up by the loader; addresses are physical (identity mapped)
+typedef struct {
+    UINT64 hw_id;           // Local APIC/x2APIC ID, or MPIDR for aarch64
+    UINT32 acpi_uid;        // ACPI processor UID
+    UINT32 flags;           // BOOT_CPU_* flags
+    UINT64 stack_top;       // Top of this CPU's kernel stack
+    UINT64 stack_size;
+    VOID   *arch_data;      // Arch specific per CPU tables e.g. GDT & TSS, 1 page
+    VOID   *cpu_data;       // Zeroed page for the kernel's per CPU data
+} Boot_CPU;
+
 // Example Kernel Parameters
 typedef struct {
+    UINT64                            magic;            // BOOT_INFO_MAGIC
+    UINT32                            version;          // BOOT_INFO_VERSION
+    UINT32                            size;             // Size of whole block including tags
     Memory_Map_Info                   mmap; 
     EFI_GRAPHICS_OUTPUT_PROTOCOL_MODE gop_mode;
     EFI_RUNTIME_SERVICES              *RuntimeServices;
@@ -179,11 +368,40 @@ typedef struct {
     EFI_CONFIGURATION_TABLE           *ConfigurationTable;
     UINTN                             num_fonts;
     Bitmap_Font                       *fonts;
+    UINTN                             physmap_base;     // Higher half direct map of all physical 
+                                                        //   memory, 0 if not mapped
+    Page_Allocator                    page_allocator;   // Physical page allocator, already holds
+                                                        //   page tables, kernel stack, etc.
+    Kernel_Memory_Region              *memory_map;      // Sorted & merged memory map for kernel
+    UINTN                             memory_map_count; //   memory manager setup
+    UINT64                            load_start_time;  // arch_read_timestamp() when kernel load
+                                                        //   started, for handoff timing
+    UINT64                            exit_bs_start_time;   // Before final GetMemoryMap()
+    UINT64                            exit_bs_end_time;     // After ExitBootServices() succeeded
+    UINTN                             exit_bs_retries;      
+    Boot_CPU                          *cpus;            // CPUs from ACPI MADT, BSP first
+    UINTN                             cpu_count;
+    UINT64                            interrupt_controller_base;    // Local APIC (x86)
+    UINT64                            ap_trampoline;    // Physical address of AP startup code for
+                                                        //   arch_start_aps(), 0 if not available
+    UINT64                            cpu_features;     // CPU_FEATURE_* enabled before calling kernel
+    UINT32                            xsave_size;       // Bytes to save enabled FPU/SIMD state
+    CPU_Topology                      topology;         // Packages, cores, threads, & caches
+    Timestamp_Clock                   clock;            // Calibrated timestamp clock for now_ns()
+    UINT64                            serial_base;      // Serial port I/O port or MMIO address, 0 if none
+    Boot_Stages                       boot_stages;      // Loader stage timestamps, in order
+    Page_Table_Stats                  page_tables;      // Final page tables handed to the kernel
 } Kernel_Parms;
 
 // Kernel entry point typedef
 typedef void EFIAPI (*Entry_Point)(Kernel_Parms *);
 
+// Entry point for application processors started with arch_start_aps()
+typedef void EFIAPI (*AP_Entry_Point)(Kernel_Parms *, Boot_CPU *);
+
+// Offset of first tag in boot info block
+#define BOOT_INFO_TAGS_OFFSET ((sizeof(Kernel_Parms) + 7) & ~(UINTN)7)
+
 // EFI Configuration Table GUIDs and string names
 typedef struct {
     EFI_GUID guid;
@@ -213,6 +431,67 @@ typedef struct {
     UINT32 creator_revision;
 } ACPI_TABLE_HEADER;
 
+// Multiple APIC Description Table (MADT) & interrupt controller structures
+//   taken from ACPI Spec 6.4 section 5.2.12
+typedef struct {
+    ACPI_TABLE_HEADER header;           // Signature "APIC"
+    UINT32            local_apic_address;
+    UINT32            flags;
+} __attribute__ ((packed)) ACPI_MADT;
+
+typedef enum {
+    MADT_LOCAL_APIC          = 0x0,
+    MADT_LOCAL_APIC_OVERRIDE = 0x5,
+    MADT_LOCAL_X2APIC        = 0x9,
+    MADT_GICC                = 0xB,
+} MADT_ENTRY_TYPE;
+
+typedef struct {
+    UINT8 type;
+    UINT8 length;
+} __attribute__ ((packed)) MADT_Entry_Header;
+
+#define MADT_CPU_ENABLED        0x1     // Local APIC/x2APIC/GICC flags
+#define MADT_CPU_ONLINE_CAPABLE 0x2
+
+typedef struct {
+    MADT_Entry_Header header;
+    UINT8             acpi_processor_uid;
+    UINT8             apic_id;
+    UINT32            flags;
+} __attribute__ ((packed)) MADT_Local_APIC;
+
+typedef struct {
+    MADT_Entry_Header header;
+    UINT16            reserved;
+    UINT64            local_apic_address;
+} __attribute__ ((packed)) MADT_Local_APIC_Override;
+
+typedef struct {
+    MADT_Entry_Header header;
+    UINT16            reserved;
+    UINT32            x2apic_id;
+    UINT32            flags;
+    UINT32            acpi_processor_uid;
+} __attribute__ ((packed)) MADT_Local_X2APIC;
+
+typedef struct {
+    MADT_Entry_Header header;
+    UINT16            reserved;
+    UINT32            cpu_interface_number;
+    UINT32            acpi_processor_uid;
+    UINT32            flags;
+    UINT32            parking_protocol_version;
+    UINT32            performance_interrupt_gsiv;
+    UINT64            parked_address;
+    UINT64            physical_base_address;
+    UINT64            gicv;
+    UINT64            gich;
+    UINT32            vgic_maintenance_interrupt;
+    UINT64            gicr_base_address;
+    UINT64            mpidr;
+} __attribute__ ((packed)) MADT_GICC_Entry;
+
 // PSF Font types
 // Adapted from https://wiki.osdev.org/PC_Screen_Font
 #define PSF2_FONT_MAGIC 0x864ab572
@@ -242,6 +521,21 @@ EFI_HANDLE image = NULL;                        // Image handle
 
 INT32 text_rows = 0, text_cols = 0;             // Current text mode screen rows & columns
 
+EFI_MP_SERVICES_PROTOCOL *mp_services = NULL;   // Multiprocessor services, NULL if not available
+UINTN num_cpus = 1;                             // Number of enabled processors including BSP
+
+Timestamp_Clock timestamp_clock = {0};          // Clock for now_ns(), set by loader & kernel
+Boot_Stages boot_stages = {0};                  // Stage timestamps from boot_stage()
+UINT64 serial_base = 0;                         // Serial port for serial_write(), 0 if none
+UINT64 page_map_conflicts = 0;                  // Pages arch_map_range() found mapped elsewhere
+
+#ifdef TRACK_ALLOCS
+void track_allocs_init(void);       // Allocation tracking, below
+#endif
+#ifdef PROFILE_FIRMWARE
+void profile_firmware_init(void);   // Firmware call profiler, below
+#endif
+
 // ======================
 // Set global variables
 // ======================
@@ -254,6 +548,24 @@ void init_global_variables(EFI_HANDLE handle, EFI_SYSTEM_TABLE *systable) {
     bs = st->BootServices;
     rs = st->RuntimeServices;
     image = handle;
+
+#ifdef TRACK_ALLOCS
+    track_allocs_init();
+#endif
+#ifdef PROFILE_FIRMWARE
+    profile_firmware_init();
+#endif
+
+    // Get MP services to run work on other processors, if there are any
+    EFI_GUID mp_guid = EFI_MP_SERVICES_PROTOCOL_GUID;
+    UINTN total_cpus = 0, enabled_cpus = 0;
+    if (!EFI_ERROR(bs->LocateProtocol(&mp_guid, NULL, (VOID **)&mp_services)) &&
+        !EFI_ERROR(mp_services->GetNumberOfProcessors(mp_services, &total_cpus, &enabled_cpus)) &&
+        enabled_cpus > 0) {
+        num_cpus = enabled_cpus;
+    } else {
+        mp_services = NULL;
+    }
 }
 
 // ====================
@@ -627,6 +939,332 @@ VOID *get_config_table_by_guid(EFI_GUID guid) {
     return NULL;    // Did not find config table
 }
 
+// ===================================================
+// Get ACPI RSDP, ACPI 2.0+ if available, 0 if none
+// ===================================================
+UINT64 get_acpi_rsdp(void) {
+    VOID *rsdp = get_config_table_by_guid((EFI_GUID)EFI_ACPI_TABLE_GUID);
+    if (!rsdp) rsdp = get_config_table_by_guid((EFI_GUID)ACPI_TABLE_GUID);
+    return (UINTN)rsdp;
+}
+
+// ======================================================================
+// Find an ACPI table by signature e.g. "APIC" for the MADT, from the 
+//   XSDT if the RSDP has one or the RSDT otherwise
+// ======================================================================
+ACPI_TABLE_HEADER *acpi_find_table(UINT64 rsdp_address, char *signature) {
+    if (!rsdp_address) return NULL;
+
+    UINT8 *rsdp = (UINT8 *)rsdp_address;
+    bool acpi_20 = rsdp[15] >= 2 && *(UINT64 *)&rsdp[24] != 0;
+    ACPI_TABLE_HEADER *header = acpi_20 ? (ACPI_TABLE_HEADER *)*(UINT64 *)&rsdp[24] 
+                                        : (ACPI_TABLE_HEADER *)(UINTN)*(UINT32 *)&rsdp[16];
+
+    UINTN entry_size = acpi_20 ? 8 : 4;
+    UINT8 *entries = (UINT8 *)header + sizeof *header;
+    for (UINTN i = 0; i < (header->length - sizeof *header) / entry_size; i++) {
+        ACPI_TABLE_HEADER *table = acpi_20 ? (ACPI_TABLE_HEADER *)*(UINT64 *)(entries + (i * 8))
+                                           : (ACPI_TABLE_HEADER *)(UINTN)*(UINT32 *)(entries + (i * 4));
+        if (!memcmp(table->signature, signature, 4)) return table;
+    }
+    return NULL;
+}
+
+// ======================================================================
+// Get enabled CPUs from the ACPI MADT, with the BSP (matching bsp_id) as
+//   the first entry. Returns the number of CPUs found, which can be more 
+//   than max_cpus; cpus can be NULL to only count. Also gets the local 
+//   APIC base address, which can be overridden by a MADT entry.
+//   Without a MADT, the BSP is the only CPU.
+// ======================================================================
+UINTN acpi_madt_cpus(ACPI_TABLE_HEADER *madt_header, UINT64 bsp_id, 
+                     Boot_CPU *cpus, UINTN max_cpus, UINT64 *interrupt_controller_base) {
+    ACPI_MADT *madt = (ACPI_MADT *)madt_header;
+    *interrupt_controller_base = madt ? madt->local_apic_address : 0;
+
+    UINTN count = 1;    // Entry 0 is saved for the BSP
+    bool bsp_found = false;
+    UINT8 *pos = madt ? (UINT8 *)(madt + 1) : NULL;
+    UINT8 *end = madt ? (UINT8 *)madt + madt->header.length : NULL;
+
+    while (pos + sizeof(MADT_Entry_Header) <= end) {
+        MADT_Entry_Header *entry = (MADT_Entry_Header *)pos;
+        if (entry->length < sizeof *entry) break;     // Bad table
+        pos += entry->length;
+
+        Boot_CPU cpu = {0};
+        UINT32 flags = 0;
+        switch (entry->type) {
+            case MADT_LOCAL_APIC: {
+                MADT_Local_APIC *lapic = (MADT_Local_APIC *)entry;
+                cpu.hw_id = lapic->apic_id;
+                cpu.acpi_uid = lapic->acpi_processor_uid;
+                flags = lapic->flags;
+            } break;
+
+            case MADT_LOCAL_X2APIC: {
+                MADT_Local_X2APIC *x2apic = (MADT_Local_X2APIC *)entry;
+                cpu.hw_id = x2apic->x2apic_id;
+                cpu.acpi_uid = x2apic->acpi_processor_uid;
+                flags = x2apic->flags;
+            } break;
+
+            case MADT_GICC: {
+                MADT_GICC_Entry *gicc = (MADT_GICC_Entry *)entry;
+                cpu.hw_id = gicc->mpidr;
+                cpu.acpi_uid = gicc->acpi_processor_uid;
+                flags = gicc->flags;
+            } break;
+
+            case MADT_LOCAL_APIC_OVERRIDE: 
+                *interrupt_controller_base = ((MADT_Local_APIC_Override *)entry)->local_apic_address;
+                continue;
+
+            default: continue;
+        }
+
+        if (!(flags & MADT_CPU_ENABLED)) continue;
+
+        // CPUs can be listed as both local APIC & x2APIC, skip duplicates
+        bool duplicate = (bsp_found && cpu.hw_id == bsp_id);
+        for (UINTN i = 1; cpus && i < min(count, max_cpus) && !duplicate; i++) 
+            if (cpus[i].hw_id == cpu.hw_id) duplicate = true;
+        if (duplicate) continue;
+
+        if (cpu.hw_id == bsp_id) {
+            cpu.flags = BOOT_CPU_BSP | BOOT_CPU_STARTED;
+            if (cpus && max_cpus > 0) cpus[0] = cpu;
+            bsp_found = true;
+            continue;
+        }
+
+        if (cpus && count < max_cpus) cpus[count] = cpu;
+        count++;
+    }
+
+    // BSP should always be in the MADT, but always have an entry for it
+    if (!bsp_found && cpus && max_cpus > 0) 
+        cpus[0] = (Boot_CPU){ .hw_id = bsp_id, .flags = BOOT_CPU_BSP | BOOT_CPU_STARTED };
+
+    return count;
+}
+
+// ======================================================================
+// Set timestamp clock for now_ns() from a calibrated frequency, with 
+//   the current timestamp as time 0
+// ======================================================================
+extern uint64_t arch_read_timestamp(void);
+
+void timestamp_clock_init(UINT64 frequency, CLOCK_SOURCE source, UINT32 flags) {
+    timestamp_clock = (Timestamp_Clock){
+        .frequency  = frequency,
+        .boot_ticks = arch_read_timestamp(),
+        .source     = frequency ? source : CLOCK_SOURCE_NONE,
+        .flags      = flags,
+    };
+}
+
+// ======================================================================
+// Measure arch_read_timestamp() frequency against the firmware's 
+//   EFI_TIMESTAMP_PROTOCOL counter, for when there is no better 
+//   reference; returns 0 if the protocol is not available
+// ======================================================================
+UINT64 efi_timestamp_frequency(UINT64 calibrate_ns) {
+    EFI_GUID timestamp_guid = EFI_TIMESTAMP_PROTOCOL_GUID;
+    EFI_TIMESTAMP_PROTOCOL *timestamp = NULL;
+    EFI_TIMESTAMP_PROPERTIES properties = {0};
+
+    if (!bs || EFI_ERROR(bs->LocateProtocol(&timestamp_guid, NULL, (VOID **)&timestamp)) ||
+        EFI_ERROR(timestamp->GetProperties(&properties)) || !properties.Frequency)
+        return 0;
+
+    UINT64 target = ((calibrate_ns / 1000) * properties.Frequency) / 1000000;
+    UINT64 start = timestamp->GetTimestamp();
+    UINT64 ticks_start = arch_read_timestamp();
+    UINT64 elapsed = 0;
+    while (elapsed < target) elapsed = (timestamp->GetTimestamp() - start) & properties.EndValue;
+    UINT64 ticks = arch_read_timestamp() - ticks_start;
+
+    return (ticks * properties.Frequency) / elapsed;
+}
+
+// ======================================================================
+// Convert timestamp ticks to nanoseconds & back; whole seconds and the
+//   remainder are converted separately so this does not overflow for 
+//   frequencies up to ~18GHz
+// ======================================================================
+UINT64 ticks_to_ns(UINT64 ticks) {
+    UINT64 freq = timestamp_clock.frequency;
+    if (!freq) return 0;
+    return ((ticks / freq) * 1000000000) + (((ticks % freq) * 1000000000) / freq);
+}
+
+UINT64 ns_to_ticks(UINT64 ns) {
+    UINT64 freq = timestamp_clock.frequency;
+    return ((ns / 1000000000) * freq) + (((ns % 1000000000) * freq) / 1000000000);
+}
+
+// ======================================================================
+// Nanoseconds since the timestamp clock was calibrated, without any 
+//   firmware calls; 0 if it was not calibrated
+// ======================================================================
+UINT64 now_ns(void) {
+    return ticks_to_ns(arch_read_timestamp() - timestamp_clock.boot_ticks);
+}
+
+// ======================================================================
+// Mark the start of a boot stage, named name + detail (can be NULL).
+//   This only saves a timestamp, formatting is left for the kernel.
+// ======================================================================
+void boot_stage(char *name, char *detail) {
+    UINT64 now = arch_read_timestamp();
+    if (boot_stages.count == MAX_BOOT_STAGES) {
+        boot_stages.dropped++;
+        return;
+    }
+
+    Boot_Stage *stage = &boot_stages.stages[boot_stages.count++];
+    stage->timestamp = now;
+
+    UINTN len = 0;
+    while (name && *name && len < sizeof stage->name - 1) stage->name[len++] = *name++;
+    while (detail && *detail && len < sizeof stage->name - 1) stage->name[len++] = *detail++;
+    stage->name[len] = '\0';
+    stage->flags = 0;
+}
+
+// Mark the start of a stage that waits on the user, to leave out of load time totals
+void boot_stage_wait(char *name) {
+    UINT32 count = boot_stages.count;
+    boot_stage(name, NULL);
+    if (boot_stages.count > count) boot_stages.stages[count].flags |= BOOT_STAGE_WAIT;
+}
+
+// ======================================================================
+// Write a string to the serial port, if there is one. Lines should end
+//   with "\r\n" for serial terminals.
+// ======================================================================
+extern void arch_serial_putc(uint64_t base, char c);
+
+void serial_write(char *string) {
+    if (!serial_base) return;
+    while (*string) arch_serial_putc(serial_base, *string++);
+}
+
+// ======================================================================
+// Parallel for: run work(start, end, arg) over chunks of [0, total), on 
+//   all enabled processors through MP services StartupAllAPs(), or only 
+//   on the BSP if MP services are not available. The BSP works on chunks 
+//   too, and processors take the next chunk from a shared counter until 
+//   all are done, so a slow or failed AP does not stall the others.
+//   Work functions run on APs, so they must not call boot services or
+//   print anything.
+// ======================================================================
+typedef void (*Parallel_Work)(UINTN start, UINTN end, void *arg);
+
+typedef struct {
+    Parallel_Work work;
+    void          *arg;
+    UINTN         total;
+    UINTN         chunk_size;
+    UINTN         next_chunk;   // Next chunk to run, atomically incremented
+} Parallel_For_Job;
+
+void parallel_for_run_chunks(Parallel_For_Job *job) {
+    while (true) {
+        UINTN start = __atomic_fetch_add(&job->next_chunk, 1, __ATOMIC_RELAXED) * job->chunk_size;
+        if (start >= job->total) break;
+
+        job->work(start, min(start + job->chunk_size, job->total), job->arg);
+    }
+}
+
+VOID EFIAPI parallel_for_ap(VOID *arg) {
+    parallel_for_run_chunks(arg);
+}
+
+// min_chunk is the smallest chunk worth starting an AP for, e.g. 256KiB for memset
+void parallel_for(UINTN total, UINTN min_chunk, Parallel_Work work, void *arg) {
+    if (total == 0) return;
+
+    // Partition into a few chunks per processor to balance uneven work
+    Parallel_For_Job job = {
+        .work       = work,
+        .arg        = arg,
+        .total      = total,
+        .chunk_size = max(max(min_chunk, 1), (total + (num_cpus * 4) - 1) / (num_cpus * 4)),
+        .next_chunk = 0,
+    };
+
+    // Start APs without waiting; the event is signaled when all APs are done
+    EFI_EVENT aps_done = NULL;
+    if (mp_services && num_cpus > 1 && total > job.chunk_size &&
+        !EFI_ERROR(bs->CreateEvent(0, TPL_APPLICATION, NULL, NULL, &aps_done))) {
+
+        if (EFI_ERROR(mp_services->StartupAllAPs(mp_services, parallel_for_ap, false, aps_done, 
+                                                 0, &job, NULL))) {
+            bs->CloseEvent(aps_done);
+            aps_done = NULL;
+        }
+    }
+
+    parallel_for_run_chunks(&job);
+
+    if (aps_done) {
+        while (bs->CheckEvent(aps_done) == EFI_NOT_READY) 
+            ;
+        bs->CloseEvent(aps_done);
+    }
+}
+
+typedef struct {
+    UINT8 *buffer;
+    UINT8 value;
+} Parallel_Memset_Args;
+
+void parallel_memset_work(UINTN start, UINTN end, void *arg) {
+    Parallel_Memset_Args *args = arg;
+    memset(args->buffer + start, args->value, end - start);
+}
+
+// ==============================================
+// memset a large buffer on all processors
+// ==============================================
+VOID *parallel_memset(VOID *dst, UINT8 c, UINTN len) {
+    Parallel_Memset_Args args = { .buffer = dst, .value = c };
+    parallel_for(len, 256*1024, parallel_memset_work, &args);
+    return dst;
+}
+
+typedef struct {
+    UINT8  *buffer;
+    UINTN  size;
+    UINT64 sum;     // Atomically added to by each chunk
+} Parallel_Checksum_Args;
+
+void parallel_checksum_work(UINTN start, UINTN end, void *arg) {
+    Parallel_Checksum_Args *args = arg;
+    UINT64 sum = 0;
+    for (UINTN i = start; i < end; i++) {
+        UINT64 word = 0;
+        if ((i * 8) + 8 <= args->size) word = *(UINT64 *)(args->buffer + (i * 8));
+        else memcpy(&word, args->buffer + (i * 8), args->size - (i * 8));  // Partial last word
+        sum += word * ((2 * i) + 1);
+    }
+    __atomic_fetch_add(&args->sum, sum, __ATOMIC_RELAXED);
+}
+
+// ===========================================================================
+// Get a 64 bit checksum of a buffer on all processors: the sum of each 
+//   8 byte word times an odd factor from its position, so chunks can be 
+//   summed in any order while moved or changed words still change the result
+// ===========================================================================
+UINT64 parallel_checksum(VOID *buffer, UINTN size) {
+    Parallel_Checksum_Args args = { .buffer = buffer, .size = size, .sum = 0 };
+    parallel_for((size + 7) / 8, 32*1024, parallel_checksum_work, &args);
+    return args.sum;
+}
+
 // ==========================================
 // (CHAR16) Add integer as string to buffer
 // ==========================================
@@ -1416,113 +2054,876 @@ bool sprintf(char *s, char *fmt, ...) {
     return format_string(s, fmt, args);
 }
 
-// =======================================================================
-// Print a formatted error message stderr and get a key from the user,
-//   so they can acknowledge the error and it doesn't go on immediately.
-// =======================================================================
-bool error(char *file, int line, const char *func, EFI_STATUS status, CHAR16 *fmt, ...) {
-    printf_c16(u"\r\nERROR: FILE %hhs, LINE %d, FUNCTION %hhs\r\n", file, line, func);
+// ======================================================================
+// Hardware performance counters around a region of code:
+//   PMU_Sample start = pmu_begin(); ...; pmu_end("name", &start);
+//   writes cycles, instructions per cycle, & LLC/dTLB misses per 1000 
+//   instructions for the region to serial. Events the CPU or hypervisor
+//   does not count are left out; with no PMU at all (e.g. QEMU TCG), 
+//   cycles are timestamp counter ticks and no misses are printed.
+// ======================================================================
+typedef enum {
+    PMU_CYCLES = 0,
+    PMU_INSTRUCTIONS,
+    PMU_LLC_MISSES,
+    PMU_DTLB_MISSES,
+    PMU_EVENT_COUNT,
+} PMU_EVENT;
 
-    // Print error code & string if applicable
-    if (status > 0 && status - TOP_BIT < MAX_EFI_ERROR)
-        printf_c16(u"STATUS: %#llx (%s)\r\n", status, EFI_ERROR_STRINGS[status-TOP_BIT]);
+typedef struct {
+    UINT64 counts[PMU_EVENT_COUNT];
+} PMU_Sample;
 
-    va_list args;
-    va_start(args, fmt);
-    bool result = vfprintf_c16(cerr, fmt, args); // Printf the error message to stderr
-    va_end(args);
+UINT32 pmu_events = 0;  // Bit (1 << PMU_EVENT) set for each event the PMU counts
 
-    get_key();  // User will respond with input before going on
-    return result;
-}
-#define error(...) error(__FILE__, __LINE__, __func__, __VA_ARGS__)
+extern uint32_t arch_pmu_init(void);
+extern void arch_pmu_read(uint64_t counts[PMU_EVENT_COUNT]);
 
-// ================================================
-// Get a number from the user and print to screen
-// ================================================
-BOOLEAN get_num(UINTN *number, UINT8 base) {
-    EFI_INPUT_KEY key = {0};
+// Enable available counters on this CPU; regions before this are cycle only
+void pmu_init(void) {
+    pmu_events = arch_pmu_init();
+}
 
-    if (!number) return false;  // Passed in NULL pointer
+PMU_Sample pmu_begin(void) {
+    PMU_Sample sample = {0};
+    arch_pmu_read(sample.counts);
+    if (!(pmu_events & (1 << PMU_CYCLES))) sample.counts[PMU_CYCLES] = arch_read_timestamp();
+    return sample;
+}
 
-    UINT8 pos = 0;
-    *number = 0;
-    do {
-        key = get_key();
-        if (key.ScanCode == SCANCODE_ESC) return false; // User wants to leave
+void pmu_end(char *name, PMU_Sample *start) {
+    PMU_Sample end = pmu_begin();
+    UINT64 delta[PMU_EVENT_COUNT];
+    for (UINTN i = 0; i < PMU_EVENT_COUNT; i++) delta[i] = end.counts[i] - start->counts[i];
+
+    char buf[256], *pos = buf;
+    sprintf(pos, "PMU %s: %llu %s", name, delta[PMU_CYCLES], 
+            (pmu_events & (1 << PMU_CYCLES)) ? "cycles" : "ticks (no PMU)");
+    pos += strlen(pos);
+
+    UINT64 instructions = delta[PMU_INSTRUCTIONS];
+    if ((pmu_events & (1 << PMU_INSTRUCTIONS)) && delta[PMU_CYCLES]) {
+        UINT64 ipc = (instructions * 100) / delta[PMU_CYCLES];
+        sprintf(pos, ", %llu instructions, IPC %llu.%llu%llu", instructions, 
+                ipc / 100, (ipc / 10) % 10, ipc % 10);
+        pos += strlen(pos);
+    }
 
-        // Backspace
-        if (key.UnicodeChar == u'\b' && pos > 0) {
-            printf_c16(u"\b"); 
-            pos--;
-            *number /= base;    // Remove last digit
+    char *miss_names[PMU_EVENT_COUNT] = { 
+        [PMU_LLC_MISSES] = "LLC misses", [PMU_DTLB_MISSES] = "dTLB misses",
+    };
+    for (UINTN i = PMU_LLC_MISSES; i < PMU_EVENT_COUNT; i++) {
+        if (!(pmu_events & (1 << PMU_CYCLES))) break;   // Timestamp ticks only
+        if (!(pmu_events & (1 << i))) continue;
+        sprintf(pos, ", %llu %s", delta[i], miss_names[i]);
+        pos += strlen(pos);
+        if ((pmu_events & (1 << PMU_INSTRUCTIONS)) && instructions) {
+            UINT64 mpki = (delta[i] * 10000) / instructions;    // Misses per 1000, 1 decimal
+            sprintf(pos, " (%llu.%llu MPKI)", mpki / 10, mpki % 10);
+            pos += strlen(pos);
         }
+    }
+    sprintf(pos, "\r\n");
+    serial_write(buf);
+}
 
-        if (isdigit_c16(key.UnicodeChar)) {
-            *number = (*number * base) + (key.UnicodeChar - u'0');
-            printf_c16(u"%c", key.UnicodeChar);
-            pos++;
+#ifdef PROFILE_FIRMWARE
+// ======================================================================
+// Firmware call profiler: init_global_variables() swaps bs, rs, cout, &
+//   cerr for copies of their tables where the services below are shims. Each 
+//   shim times the real call in timestamp ticks, and records it for the
+//   service and for the calling address. Disk IO protocols opened with
+//   bs->OpenProtocol() are wrapped the same way for ReadDisk/WriteDisk.
+// ======================================================================
+typedef enum {
+    PROFILE_ALLOCATE_PAGES = 0,
+    PROFILE_FREE_PAGES,
+    PROFILE_GET_MEMORY_MAP,
+    PROFILE_ALLOCATE_POOL,
+    PROFILE_FREE_POOL,
+    PROFILE_CONNECT_CONTROLLER,
+    PROFILE_OPEN_PROTOCOL,
+    PROFILE_CLOSE_PROTOCOL,
+    PROFILE_LOCATE_HANDLE_BUFFER,
+    PROFILE_LOCATE_PROTOCOL,
+    PROFILE_GET_TIME,
+    PROFILE_GET_VARIABLE,
+    PROFILE_GET_NEXT_VARIABLE_NAME,
+    PROFILE_SET_VARIABLE,
+    PROFILE_TEXT_RESET,
+    PROFILE_OUTPUT_STRING,
+    PROFILE_QUERY_MODE,
+    PROFILE_TEXT_SET_MODE,
+    PROFILE_SET_ATTRIBUTE,
+    PROFILE_CLEAR_SCREEN,
+    PROFILE_SET_CURSOR_POSITION,
+    PROFILE_READ_DISK,
+    PROFILE_WRITE_DISK,
+    PROFILE_SERVICE_COUNT,
+} PROFILE_SERVICE;
+
+char *profile_service_names[PROFILE_SERVICE_COUNT] = {
+    [PROFILE_ALLOCATE_PAGES]         = "bs->AllocatePages",
+    [PROFILE_FREE_PAGES]             = "bs->FreePages",
+    [PROFILE_GET_MEMORY_MAP]         = "bs->GetMemoryMap",
+    [PROFILE_ALLOCATE_POOL]          = "bs->AllocatePool",
+    [PROFILE_FREE_POOL]              = "bs->FreePool",
+    [PROFILE_CONNECT_CONTROLLER]     = "bs->ConnectController",
+    [PROFILE_OPEN_PROTOCOL]          = "bs->OpenProtocol",
+    [PROFILE_CLOSE_PROTOCOL]         = "bs->CloseProtocol",
+    [PROFILE_LOCATE_HANDLE_BUFFER]   = "bs->LocateHandleBuffer",
+    [PROFILE_LOCATE_PROTOCOL]        = "bs->LocateProtocol",
+    [PROFILE_GET_TIME]               = "rs->GetTime",
+    [PROFILE_GET_VARIABLE]           = "rs->GetVariable",
+    [PROFILE_GET_NEXT_VARIABLE_NAME] = "rs->GetNextVariableName",
+    [PROFILE_SET_VARIABLE]           = "rs->SetVariable",
+    [PROFILE_TEXT_RESET]             = "cout->Reset",
+    [PROFILE_OUTPUT_STRING]          = "cout->OutputString",
+    [PROFILE_QUERY_MODE]             = "cout->QueryMode",
+    [PROFILE_TEXT_SET_MODE]          = "cout->SetMode",
+    [PROFILE_SET_ATTRIBUTE]          = "cout->SetAttribute",
+    [PROFILE_CLEAR_SCREEN]           = "cout->ClearScreen",
+    [PROFILE_SET_CURSOR_POSITION]    = "cout->SetCursorPosition",
+    [PROFILE_READ_DISK]              = "DiskIO->ReadDisk",
+    [PROFILE_WRITE_DISK]             = "DiskIO->WriteDisk",
+};
 
-        } else if (base == 16) {
-            if (key.UnicodeChar >= u'a' && key.UnicodeChar <= u'f') {
-                *number = (*number * base) + (key.UnicodeChar - u'a' + 10);
-                printf_c16(u"%c", key.UnicodeChar);
-                pos++;
+#define PROFILE_BUCKETS     32  // Histogram bucket n counts calls of 2^n to 2^(n+1)-1 ticks
+#define MAX_PROFILE_SITES   256
+#define MAX_PROFILE_DISK_IO 32
 
-            } else if (key.UnicodeChar >= u'A' && key.UnicodeChar <= u'F') {
-                *number = (*number * base) + (key.UnicodeChar - u'A' + 10);
-                printf_c16(u"%c", key.UnicodeChar);
-                pos++;
-            }
-        }
-    } while (key.UnicodeChar != u'\r');
+typedef struct {
+    UINT64 calls;
+    UINT64 ticks;
+    UINT64 max_ticks;
+    UINT32 histogram[PROFILE_BUCKETS];
+} Profile_Stats;
 
-    return true;
+typedef struct {
+    UINTN           caller;     // Return address of the call
+    PROFILE_SERVICE service;
+    Profile_Stats   stats;
+} Profile_Site;
+
+// Disk IO shim, the shim protocol is first so This can be cast back to find the original
+typedef struct {
+    EFI_DISK_IO_PROTOCOL shim;
+    EFI_DISK_IO_PROTOCOL *original;
+} Profile_Disk_IO;
+
+Profile_Stats profile_services[PROFILE_SERVICE_COUNT] = {0};
+Profile_Site profile_sites[MAX_PROFILE_SITES] = {0};
+UINTN profile_site_count = 0;
+UINT64 profile_sites_dropped = 0;   // Calls not recorded per site, site table was full
+bool profile_recording = false;     // Set while recording, drops calls made from events then
+
+EFI_BOOT_SERVICES               *firmware_bs   = NULL;  // Real tables the shims call
+EFI_RUNTIME_SERVICES            *firmware_rs   = NULL;
+EFI_SIMPLE_TEXT_OUTPUT_PROTOCOL *firmware_cout = NULL;
+EFI_SIMPLE_TEXT_OUTPUT_PROTOCOL *firmware_cerr = NULL;
+EFI_BOOT_SERVICES               profile_bs;             // Shim tables
+EFI_RUNTIME_SERVICES            profile_rs;
+EFI_SIMPLE_TEXT_OUTPUT_PROTOCOL profile_cout;
+EFI_SIMPLE_TEXT_OUTPUT_PROTOCOL profile_cerr;
+Profile_Disk_IO                 profile_disk_io[MAX_PROFILE_DISK_IO];
+UINTN                           profile_disk_io_count = 0;
+
+void profile_add(Profile_Stats *stats, UINT64 ticks) {
+    UINTN bucket = 0;
+    while (bucket < PROFILE_BUCKETS-1 && (ticks >> (bucket + 1))) bucket++;
+
+    stats->calls++;
+    stats->ticks += ticks;
+    stats->max_ticks = max(stats->max_ticks, ticks);
+    stats->histogram[bucket]++;
 }
 
-// ====================
-// Print a GUID value
-// ====================
-void print_guid(EFI_GUID guid) { 
-    UINT8 *p = (UINT8 *)&guid;
-    printf_c16(u"{%x,%x,%x,%x,%x,{%x,%x,%x,%x,%x,%x}}\r\n",
-            *(UINT32 *)&p[0], *(UINT16 *)&p[4], *(UINT16 *)&p[6], 
-            (UINTN)p[8], (UINTN)p[9], (UINTN)p[10], (UINTN)p[11], (UINTN)p[12], (UINTN)p[13], 
-            (UINTN)p[14], (UINTN)p[15]);
+void profile_record(PROFILE_SERVICE service, void *caller, UINT64 start) {
+    UINT64 ticks = arch_read_timestamp() - start;
+    if (profile_recording) return;
+    profile_recording = true;
+
+    profile_add(&profile_services[service], ticks);
+
+    Profile_Site *site = NULL;
+    for (UINTN i = 0; i < profile_site_count && !site; i++) {
+        if (profile_sites[i].caller == (UINTN)caller && profile_sites[i].service == service) 
+            site = &profile_sites[i];
+    }
+    if (!site && profile_site_count < MAX_PROFILE_SITES) {
+        site = &profile_sites[profile_site_count++];
+        site->caller  = (UINTN)caller;
+        site->service = service;
+    }
+    if (site) profile_add(&site->stats, ticks);
+    else      profile_sites_dropped++;
+
+    profile_recording = false;
 }
 
-// ============================
-// Print an ACPI table header
-// ============================
-void print_acpi_table_header(ACPI_TABLE_HEADER header) { 
-    printf_c16(u"Signature: %.4hhs\r\n"
-           u"Length: %u\r\n"
-           u"Revision: %#x\r\n"
-           u"Checksum: %u\r\n"
-           u"OEMID: %.6hhs\r\n"
-           u"OEM Table ID: %.8hhs\r\n"
-           u"OEM Revision: %#x\r\n"
-           u"Creator ID: %.4hhs\r\n"
-           u"Creator Revision: %#x\r\n",
-           &header.signature[0],
-           (UINTN)header.length,
-           (UINTN)header.revision,
-           (UINTN)header.checksum,
-           &header.OEMID[0], 
-           &header.OEM_table_id[0],
-           (UINTN)header.OEM_revision,
-           &header.creator_id[0], 
-           (UINTN)header.creator_revision);
+// Time a firmware call & return its status; only for use in the shims below
+#define PROFILE_CALL(service, call) do {                                    \
+        UINT64 profile_start = arch_read_timestamp();                       \
+        EFI_STATUS profile_status = call;                                   \
+        profile_record(service, __builtin_return_address(0), profile_start); \
+        return profile_status;                                              \
+    } while (0)
+
+EFI_STATUS EFIAPI profile_allocate_pages(EFI_ALLOCATE_TYPE Type, EFI_MEMORY_TYPE MemoryType, 
+                                         UINTN Pages, EFI_PHYSICAL_ADDRESS *Memory) {
+    PROFILE_CALL(PROFILE_ALLOCATE_PAGES, firmware_bs->AllocatePages(Type, MemoryType, Pages, Memory));
 }
 
-// ===================================================================
-// Print information for an ELF file
-// NOTE: Assumes file is ELF64 PIE (Position Independent Executable)
-// ===================================================================
-void print_elf_info(VOID *elf_buffer) {
-    ELF_Header_64 *ehdr = elf_buffer;
+EFI_STATUS EFIAPI profile_free_pages(EFI_PHYSICAL_ADDRESS Memory, UINTN Pages) {
+    PROFILE_CALL(PROFILE_FREE_PAGES, firmware_bs->FreePages(Memory, Pages));
+}
 
-    // ELF header info
+EFI_STATUS EFIAPI profile_get_memory_map(UINTN *MemoryMapSize, EFI_MEMORY_DESCRIPTOR *MemoryMap,
+                                         UINTN *MapKey, UINTN *DescriptorSize, 
+                                         UINT32 *DescriptorVersion) {
+    PROFILE_CALL(PROFILE_GET_MEMORY_MAP, firmware_bs->GetMemoryMap(MemoryMapSize, MemoryMap, MapKey, 
+                                                                  DescriptorSize, DescriptorVersion));
+}
+
+EFI_STATUS EFIAPI profile_allocate_pool(EFI_MEMORY_TYPE PoolType, UINTN Size, VOID **Buffer) {
+    PROFILE_CALL(PROFILE_ALLOCATE_POOL, firmware_bs->AllocatePool(PoolType, Size, Buffer));
+}
+
+EFI_STATUS EFIAPI profile_free_pool(VOID *Buffer) {
+    PROFILE_CALL(PROFILE_FREE_POOL, firmware_bs->FreePool(Buffer));
+}
+
+EFI_STATUS EFIAPI profile_connect_controller(EFI_HANDLE ControllerHandle, EFI_HANDLE *DriverImageHandle,
+                                             EFI_DEVICE_PATH_PROTOCOL *RemainingDevicePath, 
+                                             BOOLEAN Recursive) {
+    PROFILE_CALL(PROFILE_CONNECT_CONTROLLER, 
+                 firmware_bs->ConnectController(ControllerHandle, DriverImageHandle, 
+                                                RemainingDevicePath, Recursive));
+}
+
+EFI_STATUS EFIAPI profile_read_disk(EFI_DISK_IO_PROTOCOL *This, UINT32 MediaId, UINT64 Offset, 
+                                    UINTN BufferSize, VOID *Buffer) {
+    EFI_DISK_IO_PROTOCOL *original = ((Profile_Disk_IO *)This)->original;
+    PROFILE_CALL(PROFILE_READ_DISK, original->ReadDisk(original, MediaId, Offset, BufferSize, Buffer));
+}
+
+EFI_STATUS EFIAPI profile_write_disk(EFI_DISK_IO_PROTOCOL *This, UINT32 MediaId, UINT64 Offset, 
+                                     UINTN BufferSize, VOID *Buffer) {
+    EFI_DISK_IO_PROTOCOL *original = ((Profile_Disk_IO *)This)->original;
+    PROFILE_CALL(PROFILE_WRITE_DISK, original->WriteDisk(original, MediaId, Offset, BufferSize, Buffer));
+}
+
+// Get the shim for a Disk IO protocol, or the protocol itself if there are no free shims
+EFI_DISK_IO_PROTOCOL *profile_wrap_disk_io(EFI_DISK_IO_PROTOCOL *dio) {
+    for (UINTN i = 0; i < profile_disk_io_count; i++) {
+        if (profile_disk_io[i].original == dio) return &profile_disk_io[i].shim;
+    }
+    if (profile_disk_io_count == MAX_PROFILE_DISK_IO) return dio;
+
+    Profile_Disk_IO *wrapped = &profile_disk_io[profile_disk_io_count++];
+    wrapped->original       = dio;
+    wrapped->shim.Revision  = dio->Revision;
+    wrapped->shim.ReadDisk  = profile_read_disk;
+    wrapped->shim.WriteDisk = profile_write_disk;
+    return &wrapped->shim;
+}
+
+EFI_STATUS EFIAPI profile_open_protocol(EFI_HANDLE Handle, EFI_GUID *Protocol, VOID **Interface,
+                                       EFI_HANDLE AgentHandle, EFI_HANDLE ControllerHandle, 
+                                       UINT32 Attributes) {
+    UINT64 start = arch_read_timestamp();
+    EFI_STATUS status = firmware_bs->OpenProtocol(Handle, Protocol, Interface, AgentHandle, 
+                                                  ControllerHandle, Attributes);
+    profile_record(PROFILE_OPEN_PROTOCOL, __builtin_return_address(0), start);
+
+    EFI_GUID dio_guid = EFI_DISK_IO_PROTOCOL_GUID;
+    if (!EFI_ERROR(status) && Interface && *Interface && !memcmp(Protocol, &dio_guid, sizeof dio_guid))
+        *Interface = profile_wrap_disk_io(*Interface);
+
+    return status;
+}
+
+EFI_STATUS EFIAPI profile_close_protocol(EFI_HANDLE Handle, EFI_GUID *Protocol, 
+                                        EFI_HANDLE AgentHandle, EFI_HANDLE ControllerHandle) {
+    PROFILE_CALL(PROFILE_CLOSE_PROTOCOL, 
+                 firmware_bs->CloseProtocol(Handle, Protocol, AgentHandle, ControllerHandle));
+}
+
+EFI_STATUS EFIAPI profile_locate_handle_buffer(EFI_LOCATE_SEARCH_TYPE SearchType, EFI_GUID *Protocol,
+                                               VOID *SearchKey, UINTN *NoHandles, 
+                                               EFI_HANDLE **Buffer) {
+    PROFILE_CALL(PROFILE_LOCATE_HANDLE_BUFFER, 
+                 firmware_bs->LocateHandleBuffer(SearchType, Protocol, SearchKey, NoHandles, Buffer));
+}
+
+EFI_STATUS EFIAPI profile_locate_protocol(EFI_GUID *Protocol, VOID *Registration, VOID **Interface) {
+    PROFILE_CALL(PROFILE_LOCATE_PROTOCOL, firmware_bs->LocateProtocol(Protocol, Registration, Interface));
+}
+
+EFI_STATUS EFIAPI profile_get_time(EFI_TIME *Time, EFI_TIME_CAPABILITIES *Capabilities) {
+    PROFILE_CALL(PROFILE_GET_TIME, firmware_rs->GetTime(Time, Capabilities));
+}
+
+EFI_STATUS EFIAPI profile_get_variable(CHAR16 *VariableName, EFI_GUID *VendorGuid, UINT32 *Attributes,
+                                       UINTN *DataSize, VOID *Data) {
+    PROFILE_CALL(PROFILE_GET_VARIABLE, 
+                 firmware_rs->GetVariable(VariableName, VendorGuid, Attributes, DataSize, Data));
+}
+
+EFI_STATUS EFIAPI profile_get_next_variable_name(UINTN *VariableNameSize, CHAR16 *VariableName, 
+                                                 EFI_GUID *VendorGuid) {
+    PROFILE_CALL(PROFILE_GET_NEXT_VARIABLE_NAME, 
+                 firmware_rs->GetNextVariableName(VariableNameSize, VariableName, VendorGuid));
+}
+
+EFI_STATUS EFIAPI profile_set_variable(CHAR16 *VariableName, EFI_GUID *VendorGuid, UINT32 Attributes,
+                                       UINTN DataSize, VOID *Data) {
+    PROFILE_CALL(PROFILE_SET_VARIABLE, 
+                 firmware_rs->SetVariable(VariableName, VendorGuid, Attributes, DataSize, Data));
+}
+
+// Text output shims pass the real protocol as This, firmware finds its private data from it;
+//   cout & cerr share the shims, so get the real protocol for the shim table called through
+EFI_SIMPLE_TEXT_OUTPUT_PROTOCOL *profile_text_protocol(EFI_SIMPLE_TEXT_OUTPUT_PROTOCOL *This) {
+    return This == &profile_cerr ? firmware_cerr : firmware_cout;
+}
+
+EFI_STATUS EFIAPI profile_text_reset(EFI_SIMPLE_TEXT_OUTPUT_PROTOCOL *This, BOOLEAN ExtendedVerification) {
+    EFI_SIMPLE_TEXT_OUTPUT_PROTOCOL *text = profile_text_protocol(This);
+    PROFILE_CALL(PROFILE_TEXT_RESET, text->Reset(text, ExtendedVerification));
+}
+
+EFI_STATUS EFIAPI profile_output_string(EFI_SIMPLE_TEXT_OUTPUT_PROTOCOL *This, CHAR16 *String) {
+    EFI_SIMPLE_TEXT_OUTPUT_PROTOCOL *text = profile_text_protocol(This);
+    PROFILE_CALL(PROFILE_OUTPUT_STRING, text->OutputString(text, String));
+}
+
+EFI_STATUS EFIAPI profile_query_mode(EFI_SIMPLE_TEXT_OUTPUT_PROTOCOL *This, UINTN ModeNumber, 
+                                     UINTN *Columns, UINTN *Rows) {
+    EFI_SIMPLE_TEXT_OUTPUT_PROTOCOL *text = profile_text_protocol(This);
+    PROFILE_CALL(PROFILE_QUERY_MODE, text->QueryMode(text, ModeNumber, Columns, Rows));
+}
+
+EFI_STATUS EFIAPI profile_text_set_mode(EFI_SIMPLE_TEXT_OUTPUT_PROTOCOL *This, UINTN ModeNumber) {
+    EFI_SIMPLE_TEXT_OUTPUT_PROTOCOL *text = profile_text_protocol(This);
+    PROFILE_CALL(PROFILE_TEXT_SET_MODE, text->SetMode(text, ModeNumber));
+}
+
+EFI_STATUS EFIAPI profile_set_attribute(EFI_SIMPLE_TEXT_OUTPUT_PROTOCOL *This, UINTN Attribute) {
+    EFI_SIMPLE_TEXT_OUTPUT_PROTOCOL *text = profile_text_protocol(This);
+    PROFILE_CALL(PROFILE_SET_ATTRIBUTE, text->SetAttribute(text, Attribute));
+}
+
+EFI_STATUS EFIAPI profile_clear_screen(EFI_SIMPLE_TEXT_OUTPUT_PROTOCOL *This) {
+    EFI_SIMPLE_TEXT_OUTPUT_PROTOCOL *text = profile_text_protocol(This);
+    PROFILE_CALL(PROFILE_CLEAR_SCREEN, text->ClearScreen(text));
+}
+
+EFI_STATUS EFIAPI profile_set_cursor_position(EFI_SIMPLE_TEXT_OUTPUT_PROTOCOL *This, UINTN Column, 
+                                              UINTN Row) {
+    EFI_SIMPLE_TEXT_OUTPUT_PROTOCOL *text = profile_text_protocol(This);
+    PROFILE_CALL(PROFILE_SET_CURSOR_POSITION, 
+                 text->SetCursorPosition(text, Column, Row));
+}
+
+// Swap bs, rs, cout, & cerr for the shim tables; other services are called directly through the copies
+void profile_firmware_init(void) {
+    firmware_bs = bs;
+    profile_bs = *bs;
+    profile_bs.AllocatePages      = profile_allocate_pages;
+    profile_bs.FreePages          = profile_free_pages;
+    profile_bs.GetMemoryMap       = profile_get_memory_map;
+    profile_bs.AllocatePool       = profile_allocate_pool;
+    profile_bs.FreePool           = profile_free_pool;
+    profile_bs.ConnectController  = profile_connect_controller;
+    profile_bs.OpenProtocol       = profile_open_protocol;
+    profile_bs.CloseProtocol      = profile_close_protocol;
+    profile_bs.LocateHandleBuffer = profile_locate_handle_buffer;
+    profile_bs.LocateProtocol     = profile_locate_protocol;
+    bs = &profile_bs;
+
+    firmware_rs = rs;
+    profile_rs = *rs;
+    profile_rs.GetTime             = profile_get_time;
+    profile_rs.GetVariable         = profile_get_variable;
+    profile_rs.GetNextVariableName = profile_get_next_variable_name;
+    profile_rs.SetVariable         = profile_set_variable;
+    rs = &profile_rs;
+
+    firmware_cout = cout;
+    profile_cout = *cout;
+    profile_cout.Reset             = profile_text_reset;
+    profile_cout.OutputString      = profile_output_string;
+    profile_cout.QueryMode         = profile_query_mode;
+    profile_cout.SetMode           = profile_text_set_mode;
+    profile_cout.SetAttribute      = profile_set_attribute;
+    profile_cout.ClearScreen       = profile_clear_screen;
+    profile_cout.SetCursorPosition = profile_set_cursor_position;
+    cout = &profile_cout;
+
+    firmware_cerr = cerr;
+    profile_cerr = *cerr;
+    profile_cerr.Reset             = profile_text_reset;
+    profile_cerr.OutputString      = profile_output_string;
+    profile_cerr.QueryMode         = profile_query_mode;
+    profile_cerr.SetMode           = profile_text_set_mode;
+    profile_cerr.SetAttribute      = profile_set_attribute;
+    profile_cerr.ClearScreen       = profile_clear_screen;
+    profile_cerr.SetCursorPosition = profile_set_cursor_position;
+    cerr = &profile_cerr;
+}
+
+// ======================================================================
+// Write profile report text to buffer: each service's calls, ticks, &
+//   histogram, then each call site from most to least total ticks. Call
+//   sites are offsets from image_base, to look up in the loader's map.
+//   PROFILE_REPORT_SIZE bytes fits a full report; text that does not fit
+//   in <size> bytes is cut off with a note. Returns the text length.
+// ======================================================================
+#define PROFILE_REPORT_SIZE ((PROFILE_SERVICE_COUNT * 2 + MAX_PROFILE_SITES + 8) * 160)
+#define PROFILE_REPORT_TRUNCATED "...report truncated\r\n"
+
+// Append text to report if it fits before <end>, with room for the NUL
+bool profile_report_append(char **pos, char *end, char *text) {
+    UINTN len = strlen(text);
+    if (len >= (UINTN)(end - *pos)) return false;
+    memcpy(*pos, text, len + 1);
+    *pos += len;
+    return true;
+}
+
+UINTN firmware_profile_report(char *buf, UINTN size, UINTN image_base) {
+    if (size < sizeof PROFILE_REPORT_TRUNCATED) return 0;
+
+    char *pos = buf, *end = buf + size - (sizeof PROFILE_REPORT_TRUNCATED - 1);
+    char line[256];     // Longest line is a call site with 4 20 digit numbers
+    *pos = '\0';
+    profile_recording = true;   // Don't profile calls made while reporting
+
+    sprintf(line, "Firmware calls (ticks at %llu Hz)\r\n", timestamp_clock.frequency);
+    if (!profile_report_append(&pos, end, line)) goto truncated;
+    for (UINTN i = 0; i < PROFILE_SERVICE_COUNT; i++) {
+        Profile_Stats *stats = &profile_services[i];
+        if (!stats->calls) continue;
+
+        sprintf(line, "%s: %llu calls, %llu ticks, avg %llu, max %llu\r\n  log2 histogram:", 
+                profile_service_names[i], stats->calls, stats->ticks, stats->ticks / stats->calls, 
+                stats->max_ticks);
+        if (!profile_report_append(&pos, end, line)) goto truncated;
+        for (UINTN j = 0; j < PROFILE_BUCKETS; j++) {
+            if (!stats->histogram[j]) continue;
+            sprintf(line, " 2^%u:%u", (UINT32)j, stats->histogram[j]);
+            if (!profile_report_append(&pos, end, line)) goto truncated;
+        }
+        if (!profile_report_append(&pos, end, "\r\n")) goto truncated;
+    }
+
+    // Sites sorted by total ticks, with a selection over what is left each time
+    sprintf(line, "\r\nCall sites (%llu calls not recorded)\r\n", profile_sites_dropped);
+    if (!profile_report_append(&pos, end, line)) goto truncated;
+    bool printed[MAX_PROFILE_SITES] = {0};
+    for (UINTN n = 0; n < profile_site_count; n++) {
+        Profile_Site *site = NULL;
+        UINTN index = 0;
+        for (UINTN i = 0; i < profile_site_count; i++) {
+            if (printed[i] || (site && profile_sites[i].stats.ticks <= site->stats.ticks)) continue;
+            site = &profile_sites[i];
+            index = i;
+        }
+        printed[index] = true;
+
+        sprintf(line, "+%llx %s: %llu calls, %llu ticks, avg %llu, max %llu\r\n", 
+                site->caller - image_base, profile_service_names[site->service], site->stats.calls, 
+                site->stats.ticks, site->stats.ticks / site->stats.calls, site->stats.max_ticks);
+        if (!profile_report_append(&pos, end, line)) goto truncated;
+    }
+
+    profile_recording = false;
+    return pos - buf;
+
+truncated:
+    // Room for this was kept past <end>
+    memcpy(pos, PROFILE_REPORT_TRUNCATED, sizeof PROFILE_REPORT_TRUNCATED);
+    pos += sizeof PROFILE_REPORT_TRUNCATED - 1;
+    profile_recording = false;
+    return pos - buf;
+}
+#endif
+
+#ifdef TRACK_ALLOCS
+// ======================================================================
+// Allocation tracking: init_global_variables() swaps bs for a copy where
+//   AllocatePool/AllocatePages/FreePool/FreePages record each live
+//   allocation's call site, size, & memory type, with the high water mark
+//   of live bytes. The main menu reports what each action left allocated.
+//   With PROFILE_FIRMWARE also on, the profiler shims wrap these, so
+//   memory call sites here are in the profiler.
+// ======================================================================
+#define MAX_TRACKED_ALLOCS 1024
+
+typedef struct {
+    UINTN           address;
+    UINTN           size;       // Bytes
+    UINTN           caller;     // Return address of the allocation call
+    UINT64          sequence;   // Allocation number, to find what an action allocated
+    EFI_MEMORY_TYPE memory_type;
+    bool            pages;      // AllocatePages(), else AllocatePool()
+} Alloc_Record;
+
+Alloc_Record tracked_allocs[MAX_TRACKED_ALLOCS] = {0};
+UINTN tracked_alloc_count = 0;
+UINT64 alloc_sequence = 0;          // Total allocations
+UINT64 untracked_allocs = 0;        // Allocations not recorded, table was full
+UINT64 unknown_frees = 0;           // Frees of memory not in the table
+UINTN live_alloc_bytes = 0;
+UINTN alloc_high_water = 0;         // Most live bytes since the last track_allocs_mark()
+UINTN track_image_base = 0;         // Call sites are reported as offsets from this
+const CHAR16 *last_report_action = NULL;    // Last reported action & total live bytes after it, 
+UINTN last_report_live = 0;                 //   to catch growth when an action is repeated
+
+EFI_BOOT_SERVICES *untracked_bs = NULL; // Table the tracking shims call
+EFI_BOOT_SERVICES track_bs;             // Shim table
+
+void track_alloc(UINTN address, UINTN size, EFI_MEMORY_TYPE memory_type, bool pages, void *caller) {
+    alloc_sequence++;
+    live_alloc_bytes += size;
+    alloc_high_water = max(alloc_high_water, live_alloc_bytes);
+    if (tracked_alloc_count == MAX_TRACKED_ALLOCS) {
+        untracked_allocs++;
+        return;
+    }
+
+    tracked_allocs[tracked_alloc_count++] = (Alloc_Record){
+        .address     = address,
+        .size        = size,
+        .caller      = (UINTN)caller,
+        .sequence    = alloc_sequence,
+        .memory_type = memory_type,
+        .pages       = pages,
+    };
+}
+
+// Free size bytes at address, or the whole allocation for size 0 (pool); pages can be freed in part
+void track_free(UINTN address, UINTN size) {
+    for (UINTN i = 0; i < tracked_alloc_count; i++) {
+        Alloc_Record *record = &tracked_allocs[i];
+        if (address < record->address || address >= record->address + record->size) continue;
+
+        if (size == 0 || size > record->size) size = record->size;
+        live_alloc_bytes -= size;
+        if (address == record->address) {
+            record->address += size;
+            record->size    -= size;
+        } else {
+            record->size = address - record->address;   // Freed from the middle to the end
+        }
+        if (record->size == 0) *record = tracked_allocs[--tracked_alloc_count];
+        return;
+    }
+    unknown_frees++;
+}
+
+EFI_STATUS EFIAPI track_allocate_pool(EFI_MEMORY_TYPE PoolType, UINTN Size, VOID **Buffer) {
+    EFI_STATUS status = untracked_bs->AllocatePool(PoolType, Size, Buffer);
+    if (!EFI_ERROR(status)) 
+        track_alloc((UINTN)*Buffer, Size, PoolType, false, __builtin_return_address(0));
+    return status;
+}
+
+EFI_STATUS EFIAPI track_free_pool(VOID *Buffer) {
+    EFI_STATUS status = untracked_bs->FreePool(Buffer);
+    if (!EFI_ERROR(status)) track_free((UINTN)Buffer, 0);
+    return status;
+}
+
+EFI_STATUS EFIAPI track_allocate_pages(EFI_ALLOCATE_TYPE Type, EFI_MEMORY_TYPE MemoryType, 
+                                       UINTN Pages, EFI_PHYSICAL_ADDRESS *Memory) {
+    EFI_STATUS status = untracked_bs->AllocatePages(Type, MemoryType, Pages, Memory);
+    if (!EFI_ERROR(status)) 
+        track_alloc(*Memory, Pages * PAGE_SIZE, MemoryType, true, __builtin_return_address(0));
+    return status;
+}
+
+EFI_STATUS EFIAPI track_free_pages(EFI_PHYSICAL_ADDRESS Memory, UINTN Pages) {
+    EFI_STATUS status = untracked_bs->FreePages(Memory, Pages);
+    if (!EFI_ERROR(status)) track_free(Memory, Pages * PAGE_SIZE);
+    return status;
+}
+
+void track_allocs_init(void) {
+    untracked_bs = bs;
+    track_bs = *bs;
+    track_bs.AllocatePool  = track_allocate_pool;
+    track_bs.FreePool      = track_free_pool;
+    track_bs.AllocatePages = track_allocate_pages;
+    track_bs.FreePages     = track_free_pages;
+    bs = &track_bs;
+
+    EFI_GUID lip_guid = EFI_LOADED_IMAGE_PROTOCOL_GUID;
+    EFI_LOADED_IMAGE_PROTOCOL *lip = NULL;
+    if (!EFI_ERROR(bs->OpenProtocol(image, &lip_guid, (VOID **)&lip, image, NULL, 
+                                    EFI_OPEN_PROTOCOL_GET_PROTOCOL)))
+        track_image_base = (UINTN)lip->ImageBase;
+}
+
+// Start tracking an action: returns the allocation number to report from, & resets the high water
+UINT64 track_allocs_mark(void) {
+    alloc_high_water = live_alloc_bytes;
+    return alloc_sequence + 1;
+}
+
+// ======================================================================
+// Report allocations made since mark that are still live, to serial, 
+//   and on screen when there are any. Running the same action again, e.g.
+//   Load Kernel, ESC, repeat, should keep a flat footprint: growth in total
+//   live bytes since the last run is reported too, even if the leaked 
+//   memory was freed with the wrong call and so still looks older.
+// ======================================================================
+void track_allocs_report(const CHAR16 *action, UINT64 mark) {
+    UINTN live_count = 0, live_bytes = 0;
+    for (UINTN i = 0; i < tracked_alloc_count; i++) {
+        if (tracked_allocs[i].sequence < mark) continue;
+        live_count++;
+        live_bytes += tracked_allocs[i].size;
+    }
+
+    UINTN growth = 0;
+    if (action == last_report_action && live_alloc_bytes > last_report_live) 
+        growth = live_alloc_bytes - last_report_live;
+    last_report_action = action;
+    last_report_live   = live_alloc_bytes;
+
+    char buf[160], repeat_buf[96] = {0};
+    sprintf(buf, "Allocations: %llu left live (%llu bytes), high water %llu bytes, total live %llu bytes "
+                 "(%llu untracked, %llu unknown frees)\r\n", 
+            (UINT64)live_count, (UINT64)live_bytes, (UINT64)alloc_high_water, 
+            (UINT64)live_alloc_bytes, untracked_allocs, unknown_frees);
+    serial_write(buf);
+    if (growth) {
+        sprintf(repeat_buf, "Repeated action: total live grew %llu bytes since its last run\r\n", 
+                (UINT64)growth);
+        serial_write(repeat_buf);
+    }
+    if (live_count == 0 && !growth) return;
+
+    cout->ClearScreen(cout);
+    printf_c16(u"%s:\r\n%hhs%hhs", action, buf, repeat_buf);
+    for (UINTN i = 0; i < tracked_alloc_count; i++) {
+        Alloc_Record *record = &tracked_allocs[i];
+        if (record->sequence < mark) continue;
+
+        sprintf(buf, "  +%llx: %s, %llu bytes at %llx, memory type %u\r\n", 
+                (UINT64)(record->caller - track_image_base), 
+                record->pages ? "AllocatePages" : "AllocatePool", 
+                (UINT64)record->size, (UINT64)record->address, (UINT32)record->memory_type);
+        serial_write(buf);
+        printf_c16(u"%hhs", buf);
+
+        // Pause if reached bottom of screen
+        if (cout->Mode->CursorRow >= text_rows-2) {
+            printf_c16(u"Press any key to continue...\r\n");
+            get_key();
+            cout->ClearScreen(cout);
+        }
+    }
+
+    printf_c16(u"\r\nPress any key to go back...\r\n");
+    get_key();
+}
+#endif
+
+// =======================================================================
+// Print a formatted error message stderr and get a key from the user,
+//   so they can acknowledge the error and it doesn't go on immediately.
+// =======================================================================
+bool error(char *file, int line, const char *func, EFI_STATUS status, CHAR16 *fmt, ...) {
+    printf_c16(u"\r\nERROR: FILE %hhs, LINE %d, FUNCTION %hhs\r\n", file, line, func);
+
+    // Print error code & string if applicable
+    if (status > 0 && status - TOP_BIT < MAX_EFI_ERROR)
+        printf_c16(u"STATUS: %#llx (%s)\r\n", status, EFI_ERROR_STRINGS[status-TOP_BIT]);
+
+    va_list args;
+    va_start(args, fmt);
+    bool result = vfprintf_c16(cerr, fmt, args); // Printf the error message to stderr
+    va_end(args);
+
+    get_key();  // User will respond with input before going on
+    return result;
+}
+#define error(...) error(__FILE__, __LINE__, __func__, __VA_ARGS__)
+
+// ============================================================================
+// Scratch arena: page-backed bump allocator for short-lived loader memory.
+//   Allocations are pointer bumps in chunks of ARENA_CHUNK_PAGES pages from 
+//   AllocatePages(); a chunk only gets bigger for a single larger allocation.
+//   There is no per-allocation free: take an arena_mark() and arena_reset() 
+//   to it, which gives chunks allocated after the mark back to the firmware.
+//   Data partition file reads (kernel, PSF font) are not in the arena; each is
+//   its own AllocatePages() buffer, freed with FreePages() by its byte size.
+// ============================================================================
+#define ARENA_CHUNK_PAGES 64    // 256KiB
+#define ARENA_ALIGN       16
+
+typedef struct Arena_Chunk {
+    struct Arena_Chunk *prev;   // Previous (older) chunk, NULL for the first one
+    UINTN               pages;  // Size of this chunk including this header
+} Arena_Chunk;
+
+typedef struct {
+    Arena_Chunk *chunk;         // Current (newest) chunk, NULL if nothing allocated
+    UINT8       *pos;           // Next free byte in current chunk
+    UINT8       *end;           // End of current chunk
+} Arena;
+
+typedef struct {
+    Arena_Chunk *chunk;
+    UINT8       *pos;
+} Arena_Mark;
+
+// Temporary memory for the current menu action or kernel load; the main menu
+//   frees all of it after each action, so nothing from here outlives one
+Arena scratch_arena = {0};
+
+// Returns ARENA_ALIGN aligned memory, or NULL if out of memory. Not zeroed.
+VOID *arena_alloc(Arena *arena, UINTN size) {
+    const UINTN header_size = (sizeof(Arena_Chunk) + ARENA_ALIGN-1) & ~(UINTN)(ARENA_ALIGN-1);
+    size = (size + ARENA_ALIGN-1) & ~(UINTN)(ARENA_ALIGN-1);
+
+    if (!arena->chunk || size > (UINTN)(arena->end - arena->pos)) {
+        // Rest of the current chunk is left unused until a reset back into it
+        UINTN pages = max(ARENA_CHUNK_PAGES, (header_size + size + PAGE_SIZE-1) / PAGE_SIZE);
+        EFI_PHYSICAL_ADDRESS address = 0;
+        if (EFI_ERROR(bs->AllocatePages(AllocateAnyPages, EfiLoaderData, pages, &address))) 
+            return NULL;
+
+        Arena_Chunk *chunk = (Arena_Chunk *)address;
+        chunk->prev  = arena->chunk;
+        chunk->pages = pages;
+
+        arena->chunk = chunk;
+        arena->pos   = (UINT8 *)chunk + header_size;
+        arena->end   = (UINT8 *)chunk + (pages * PAGE_SIZE);
+    }
+
+    VOID *result = arena->pos;
+    arena->pos += size;
+    return result;
+}
+
+Arena_Mark arena_mark(Arena *arena) {
+    return (Arena_Mark){ .chunk = arena->chunk, .pos = arena->pos };
+}
+
+// Free everything allocated since mark; chunks newer than the mark's chunk 
+//   are freed back to the firmware
+void arena_reset(Arena *arena, Arena_Mark mark) {
+    while (arena->chunk && arena->chunk != mark.chunk) {
+        Arena_Chunk *prev = arena->chunk->prev;
+        bs->FreePages((EFI_PHYSICAL_ADDRESS)arena->chunk, arena->chunk->pages);
+        arena->chunk = prev;
+    }
+
+    arena->pos = mark.pos;
+    arena->end = arena->chunk ? (UINT8 *)arena->chunk + (arena->chunk->pages * PAGE_SIZE) : NULL;
+}
+
+// Free all chunks
+void arena_free_all(Arena *arena) {
+    arena_reset(arena, (Arena_Mark){0});
+}
+
+// Allocate from scratch_arena
+VOID *scratch_alloc(UINTN size) {
+    return arena_alloc(&scratch_arena, size);
+}
+
+// ================================================
+// Get a number from the user and print to screen
+// ================================================
+BOOLEAN get_num(UINTN *number, UINT8 base) {
+    EFI_INPUT_KEY key = {0};
+
+    if (!number) return false;  // Passed in NULL pointer
+
+    UINT8 pos = 0;
+    *number = 0;
+    do {
+        key = get_key();
+        if (key.ScanCode == SCANCODE_ESC) return false; // User wants to leave
+
+        // Backspace
+        if (key.UnicodeChar == u'\b' && pos > 0) {
+            printf_c16(u"\b"); 
+            pos--;
+            *number /= base;    // Remove last digit
+        }
+
+        if (isdigit_c16(key.UnicodeChar)) {
+            *number = (*number * base) + (key.UnicodeChar - u'0');
+            printf_c16(u"%c", key.UnicodeChar);
+            pos++;
+
+        } else if (base == 16) {
+            if (key.UnicodeChar >= u'a' && key.UnicodeChar <= u'f') {
+                *number = (*number * base) + (key.UnicodeChar - u'a' + 10);
+                printf_c16(u"%c", key.UnicodeChar);
+                pos++;
+
+            } else if (key.UnicodeChar >= u'A' && key.UnicodeChar <= u'F') {
+                *number = (*number * base) + (key.UnicodeChar - u'A' + 10);
+                printf_c16(u"%c", key.UnicodeChar);
+                pos++;
+            }
+        }
+    } while (key.UnicodeChar != u'\r');
+
+    return true;
+}
+
+// ====================
+// Print a GUID value
+// ====================
+void print_guid(EFI_GUID guid) { 
+    UINT8 *p = (UINT8 *)&guid;
+    printf_c16(u"{%x,%x,%x,%x,%x,{%x,%x,%x,%x,%x,%x}}\r\n",
+            *(UINT32 *)&p[0], *(UINT16 *)&p[4], *(UINT16 *)&p[6], 
+            (UINTN)p[8], (UINTN)p[9], (UINTN)p[10], (UINTN)p[11], (UINTN)p[12], (UINTN)p[13], 
+            (UINTN)p[14], (UINTN)p[15]);
+}
+
+// ============================
+// Print an ACPI table header
+// ============================
+void print_acpi_table_header(ACPI_TABLE_HEADER header) { 
+    printf_c16(u"Signature: %.4hhs\r\n"
+           u"Length: %u\r\n"
+           u"Revision: %#x\r\n"
+           u"Checksum: %u\r\n"
+           u"OEMID: %.6hhs\r\n"
+           u"OEM Table ID: %.8hhs\r\n"
+           u"OEM Revision: %#x\r\n"
+           u"Creator ID: %.4hhs\r\n"
+           u"Creator Revision: %#x\r\n",
+           &header.signature[0],
+           (UINTN)header.length,
+           (UINTN)header.revision,
+           (UINTN)header.checksum,
+           &header.OEMID[0], 
+           &header.OEM_table_id[0],
+           (UINTN)header.OEM_revision,
+           &header.creator_id[0], 
+           (UINTN)header.creator_revision);
+}
+
+// ===================================================================
+// Print information for an ELF file
+// NOTE: Assumes file is ELF64 PIE (Position Independent Executable)
+// ===================================================================
+void print_elf_info(VOID *elf_buffer) {
+    ELF_Header_64 *ehdr = elf_buffer;
+
+    // ELF header info
     printf_c16(u"Type: %u, Machine: %x, Entry Point: %#llx\r\n"
            u"Pgm headers offset: %u, Elf Header Size: %u\r\n"
            u"Pgm entry size: %u, # of Pgm headers: %u\r\n",
@@ -1682,13 +3083,11 @@ EFI_FILE_PROTOCOL *esp_root_dir(VOID) {
 //   escaped as needed by the caller with '\\'.
 //
 // Returns: 
-//  - non-null pointer to allocated buffer with file data, 
-//      allocated with Boot Services AllocatePool(), or NULL if not 
-//      found or error.
+//  - non-null pointer to buffer with file data, allocated from 
+//      scratch_arena, or NULL if not found or error.
 //  - Size of returned buffer, if not NULL
 //
-//  NOTE: Caller will have to use FreePool() on returned buffer to 
-//    free allocated memory.
+//  NOTE: Buffer is valid until scratch_arena is reset, do not FreePool()
 // ===================================================================
 VOID *read_esp_file_to_buffer(CHAR16 *path, UINTN *file_size) {
     VOID *file_buffer = NULL;
@@ -1722,9 +3121,9 @@ VOID *read_esp_file_to_buffer(CHAR16 *path, UINTN *file_size) {
 
     // Allocate buffer for file
     buf_size = file_info.FileSize;
-    status = bs->AllocatePool(EfiLoaderData, buf_size, &file_buffer);
-    if (EFI_ERROR(status) || buf_size != file_info.FileSize) {
-        error(status, u"Could not allocate memory for file '%s'\r\n", path);
+    file_buffer = scratch_alloc(buf_size);
+    if (!file_buffer) {
+        error(EFI_OUT_OF_RESOURCES, u"Could not allocate memory for file '%s'\r\n", path);
         goto cleanup;
     }
 
@@ -1751,13 +3150,14 @@ VOID *read_esp_file_to_buffer(CHAR16 *path, UINTN *file_size) {
 // Read a file from a given disk (from input media ID), into an
 //   output buffer. 
 //
-// Returns: non-null pointer to allocated buffer with data, 
-//  allocated with Boot Services AllocatePool(), or NULL if not 
-//  found or error. If executable input parameter is true, then 
-//  allocate EfiLoaderCode memory type, else use EfiLoaderData.
+// Returns: address of allocated buffer with data, allocated with 
+//  Boot Services AllocatePages(), or 0 if not found or error. If 
+//  executable input parameter is true, then allocate EfiLoaderCode 
+//  memory type, else use EfiLoaderData.
 //
-//  NOTE: Caller will have to use FreePool() on returned buffer to 
-//    free allocated memory.
+//  NOTE: Caller will have to use 
+//    FreePages(buffer, EFI_SIZE_TO_PAGES(data_size)) on returned 
+//    buffer to free allocated memory.
 // =================================================================
 EFI_PHYSICAL_ADDRESS 
 read_disk_lbas_to_buffer(EFI_LBA disk_lba, UINTN data_size, UINT32 disk_mediaID, bool executable) {
@@ -1830,8 +3230,11 @@ read_disk_lbas_to_buffer(EFI_LBA disk_lba, UINTN data_size, UINT32 disk_mediaID,
 
     // Use Disk IO Read to read into allocated buffer
     status = diop->ReadDisk(diop, disk_mediaID, disk_lba * biop->Media->BlockSize, data_size, (VOID *)buffer);
-    if (EFI_ERROR(status)) 
+    if (EFI_ERROR(status)) {
         error(status, u"Could not read Disk LBAs into buffer.\r\n");
+        bs->FreePages(buffer, pages_needed);
+        buffer = 0;
+    }
 
     done:
     if (handle_buffer) bs->FreePool(handle_buffer);   // Free allocated handle buffer
@@ -2065,12 +3468,13 @@ EFI_STATUS get_disk_image_mediaID(UINT32 *mediaID) {
 //
 // Returns: 
 //  - non-null pointer to allocated buffer with file data, 
-//      allocated with Boot Services AllocatePool(), or NULL if not 
+//      allocated with Boot Services AllocatePages(), or NULL if not 
 //      found or error.
-//  - Size of returned buffer, if not NULL.
+//  - File size in bytes in ret_size, 0 on error.
 //
-//  NOTE: Caller will have to use FreePool() on returned buffer to 
-//    free allocated memory.
+//  NOTE: Caller will have to use 
+//    FreePages(buffer, EFI_SIZE_TO_PAGES(*ret_size)) on returned 
+//    buffer to free allocated memory.
 // ===============================================================
 VOID *read_data_partition_file_to_buffer(char *in_name, bool executable, UINTN *ret_size) {
     VOID *esp_file = NULL;
@@ -2086,6 +3490,7 @@ VOID *read_data_partition_file_to_buffer(char *in_name, bool executable, UINTN *
     }
 
     // Get FILE.TXT file from path "/EFI/BOOT/FILE.TXT"
+    boot_stage("FILE.TXT lookup: ", in_name);
     CHAR16 *file_name = u"\\EFI\\BOOT\\FILE.TXT";
     UINTN buf_size = 0;
     esp_file = read_esp_file_to_buffer(file_name, &buf_size);
@@ -2118,6 +3523,7 @@ VOID *read_data_partition_file_to_buffer(char *in_name, bool executable, UINTN *
     UINTN disk_lba = atoi(str_pos);
 
     // Read disk lbas for file into buffer
+    boot_stage("Read: ", in_name);
     data_file = (VOID *)read_disk_lbas_to_buffer(disk_lba, file_size, image_mediaID, executable);
     *ret_size = file_size;
     if (!data_file) {
@@ -2126,19 +3532,17 @@ VOID *read_data_partition_file_to_buffer(char *in_name, bool executable, UINTN *
     } 
 
     cleanup:
-    if (esp_file) bs->FreePool(esp_file);  
     return data_file;
 }
 
 // ==================================================
 // Get first package list found in the HII database
-// NOTE: This allocates memory with AllocatePool(),
-//   Caller should free returned address with e.g. 
-//   if (result) bs->FreePool(result);
+// NOTE: Result is allocated from scratch_arena,
+//   valid until scratch_arena is reset
 // ==================================================
 EFI_HII_PACKAGE_LIST_HEADER *hii_database_package_list(UINT8 package_type) {
     EFI_HII_PACKAGE_LIST_HEADER *pkg_list = NULL;   // Return variable
-    EFI_HII_HANDLE handle_buf = NULL;   
+    EFI_HII_HANDLE *handle_buf = NULL;   
 
     // Get HII database protocol instance
     EFI_HII_DATABASE_PROTOCOL *dbp = NULL;
@@ -2153,7 +3557,7 @@ EFI_HII_PACKAGE_LIST_HEADER *hii_database_package_list(UINT8 package_type) {
 
     // Get size of buffer needed for list of handles for package lists
     UINTN buf_len = 0;
-    status = dbp->ListPackageLists(dbp, package_type, NULL, &buf_len, &handle_buf); 
+    status = dbp->ListPackageLists(dbp, package_type, NULL, &buf_len, handle_buf); 
     if (status != EFI_BUFFER_TOO_SMALL && EFI_ERROR(status)) {
         error(status, u"Could not get size of list of handles for HII package lists for type %hhu.\r\n",
               package_type);
@@ -2161,15 +3565,15 @@ EFI_HII_PACKAGE_LIST_HEADER *hii_database_package_list(UINT8 package_type) {
     }
 
     // Allocate buffer for list of handles for package lists
-    status = bs->AllocatePool(EfiLoaderData, buf_len, (VOID **)&handle_buf);  
-    if (EFI_ERROR(status)) {
-        error(status, u"Could not allocate buffer for handle list for package lists type %hhu.\r\n",
+    handle_buf = scratch_alloc(buf_len);
+    if (!handle_buf) {
+        error(EFI_OUT_OF_RESOURCES, u"Could not allocate buffer for handle list for package lists type %hhu.\r\n",
               package_type);
         goto cleanup;
     }
 
     // Get list of handles with package type into buffer
-    status = dbp->ListPackageLists(dbp, package_type, NULL, &buf_len, &handle_buf); 
+    status = dbp->ListPackageLists(dbp, package_type, NULL, &buf_len, handle_buf); 
     if (EFI_ERROR(status)) {
         error(status, u"Could not get list of handles for HII package lists for type %hhu into buffer.\r\n",
               package_type);
@@ -2178,7 +3582,7 @@ EFI_HII_PACKAGE_LIST_HEADER *hii_database_package_list(UINT8 package_type) {
 
     // Get size of buffer needed for package list on handle
     UINTN buf_len2 = 0;
-    EFI_HII_HANDLE handle = handle_buf;    // Point to 1st handle in handle list    
+    EFI_HII_HANDLE handle = handle_buf[0];    // 1st handle in handle list    
     status = dbp->ExportPackageLists(dbp, handle, &buf_len2, pkg_list);  
     if (status != EFI_BUFFER_TOO_SMALL && EFI_ERROR(status)) {
         error(status, u"Could not get size of 1st package list for type %hhu.\r\n",
@@ -2187,9 +3591,9 @@ EFI_HII_PACKAGE_LIST_HEADER *hii_database_package_list(UINT8 package_type) {
     }
 
     // Allocate buffer for package list to export (1st package list on 1st handle)
-    status = bs->AllocatePool(EfiLoaderData, buf_len2, (VOID **)&pkg_list);
-    if (EFI_ERROR(status)) {
-        error(status, u"Could not allocate buffer for package list of type %hhu.\r\n",
+    pkg_list = scratch_alloc(buf_len2);
+    if (!pkg_list) {
+        error(EFI_OUT_OF_RESOURCES, u"Could not allocate buffer for package list of type %hhu.\r\n",
               package_type);
         goto cleanup;
     }
@@ -2202,11 +3606,8 @@ EFI_HII_PACKAGE_LIST_HEADER *hii_database_package_list(UINT8 package_type) {
         goto cleanup;
     }
 
-    // Free memory when done and return result
     cleanup:
-    if (handle_buf) bs->FreePool(handle_buf);
-
-    return pkg_list;    // Caller needs to free this with bs->FreePool()
+    return pkg_list;    // In scratch_arena, along with the handle list
 }
 
 // ---------------------------------------------------------------------
@@ -2308,76 +3709,586 @@ EFI_HII_PACKAGE_LIST_HEADER *hii_database_package_list(UINT8 package_type) {
 // if (simple_fonts) bs->FreePool(simple_fonts);
 // ---------------------------------------------------------------------
 
-// ==================================================
-// Allocate pages from available UEFI Memory Map;
-//   technically not allocating more, but returning
-//   available pre-existing page addresses.
-//   Using this as a sort of bump allocator.
-// ==================================================
-void *mmap_allocate_pages(Memory_Map_Info *mmap, UINTN pages) {
-    static void *next_page_address = NULL;  // Next page/page range address to return to caller
-    static UINTN current_descriptor = 0;    // Current descriptor number
-    static UINTN remaining_pages = 0;       // Remaining pages in current descriptor
-
-    if (remaining_pages < pages) {
-        // Not enough remaining pages in current descriptor, find the next available one
-        UINTN i = current_descriptor+1;
-        for (; i < mmap->size / mmap->desc_size; i++) {
-            EFI_MEMORY_DESCRIPTOR *desc = 
+// ===========================================================
+// Identity map a page of memory, virtual = physical address
+// ===========================================================
+extern void arch_map_page(uint64_t physical_address, uint64_t virtual_address, 
+                          Page_Allocator *allocator);
+
+void identity_map_page(UINTN address, Page_Allocator *allocator) {
+    arch_map_page(address, address, allocator);
+}
+
+// ======================================================================
+// Get cache type to map a memory descriptor's memory with: RAM is write
+//   back, MMIO & reserved memory is uncached, otherwise use the best
+//   cache type the descriptor attributes allow.
+// ======================================================================
+MAP_CACHE_TYPE efi_cache_type(EFI_MEMORY_DESCRIPTOR *desc) {
+    switch (desc->Type) {
+        case EfiReservedMemoryType:
+        case EfiUnusableMemory:
+        case EfiMemoryMappedIO:
+        case EfiMemoryMappedIOPortSpace:
+        case EfiPalCode:
+            return MAP_CACHE_UC;
+
+        default:
+            if (desc->Attribute & EFI_MEMORY_WB) return MAP_CACHE_WB;
+            if (desc->Attribute & EFI_MEMORY_WC) return MAP_CACHE_WC;
+            if (desc->Attribute & EFI_MEMORY_WT) return MAP_CACHE_WT;
+            return MAP_CACHE_UC;
+    }
+}
+
+// ==========================================================================
+// Mark a range of pages in a page allocator's bitmap as used or free
+// ==========================================================================
+void page_allocator_mark(Page_Allocator *allocator, UINTN address, UINTN pages, bool used) {
+    if (address < allocator->base) return;
+    UINTN first = (address - allocator->base) / PAGE_SIZE;
+    if (first >= allocator->total_pages) return;
+    if (pages > allocator->total_pages - first) pages = allocator->total_pages - first;
+
+    for (UINTN page = first; page < first + pages; page++) {
+        UINT64 bit = 1ULL << (page % 64);
+        UINT64 *word = &allocator->bitmap[page / 64];
+        if (used && !(*word & bit)) {
+            *word |= bit;
+            allocator->free_pages--;
+        } else if (!used && (*word & bit)) {
+            *word &= ~bit;
+            allocator->free_pages++;
+        }
+    }
+
+    if (!used && first < allocator->next_free) allocator->next_free = first;
+}
+
+// ==========================================================================
+// Initialize a page allocator for all RAM in a memory map; every page starts
+//   as used, then EfiConventionalMemory pages are freed. The bitmap is placed
+//   in the first conventional memory descriptor large enough to hold it.
+//   Boot services memory stays marked used, so the kernel can free it once 
+//   it no longer needs anything there e.g. the loader's stack.
+// ==========================================================================
+bool page_allocator_init(Page_Allocator *allocator, Memory_Map_Info *mmap) {
+    memset(allocator, 0, sizeof *allocator);
+
+    // Get highest RAM address to track
+    UINTN max_address = 0;
+    for (UINTN i = 0; i < mmap->size / mmap->desc_size; i++) {
+        EFI_MEMORY_DESCRIPTOR *desc = 
+            (EFI_MEMORY_DESCRIPTOR *)((UINT8 *)mmap->map + (i * mmap->desc_size));
+
+        if (efi_cache_type(desc) != MAP_CACHE_WB) continue;     // Not RAM
+
+        UINTN end = desc->PhysicalStart + (desc->NumberOfPages * PAGE_SIZE);
+        if (end > max_address) max_address = end;
+    }
+
+    allocator->total_pages = max_address / PAGE_SIZE;
+    UINTN bitmap_pages = (((allocator->total_pages + 63) / 64) * sizeof(UINT64) + (PAGE_SIZE-1)) / PAGE_SIZE;
+
+    // Find memory for bitmap
+    for (UINTN i = 0; i < mmap->size / mmap->desc_size; i++) {
+        EFI_MEMORY_DESCRIPTOR *desc = 
+            (EFI_MEMORY_DESCRIPTOR *)((UINT8 *)mmap->map + (i * mmap->desc_size));
+
+        // Skip page 0, to never return a NULL address as a valid allocation
+        if (desc->Type == EfiConventionalMemory && desc->PhysicalStart > 0 && 
+            desc->NumberOfPages >= bitmap_pages) {
+            allocator->bitmap = (UINT64 *)desc->PhysicalStart;
+            break;
+        }
+    }
+    if (!allocator->bitmap) return false;
+
+    memset(allocator->bitmap, 0xFF, bitmap_pages * PAGE_SIZE);  // All pages used
+    allocator->next_free = allocator->total_pages;
+
+    for (UINTN i = 0; i < mmap->size / mmap->desc_size; i++) {
+        EFI_MEMORY_DESCRIPTOR *desc = 
+            (EFI_MEMORY_DESCRIPTOR *)((UINT8 *)mmap->map + (i * mmap->desc_size));
+
+        if (desc->Type == EfiConventionalMemory)
+            page_allocator_mark(allocator, desc->PhysicalStart, desc->NumberOfPages, false);
+    }
+
+    page_allocator_mark(allocator, 0, 1, true);     // NULL page
+    page_allocator_mark(allocator, (UINTN)allocator->bitmap, bitmap_pages, true);
+    return true;
+}
+
+// ==========================================================================
+// Allocate physically contiguous pages, with the first page aligned to 
+//   <align_pages> pages (e.g. 512 for 2MiB). Returns NULL if no free range 
+//   is found. Fully used bitmap words are skipped 64 pages at a time.
+// ==========================================================================
+void *page_alloc(Page_Allocator *allocator, UINTN pages, UINTN align_pages) {
+    if (pages == 0 || pages > allocator->free_pages) return NULL;
+    if (align_pages == 0) align_pages = 1;
+
+    // Aligned address might not be an aligned page index, if base address is not aligned
+    UINTN base_page = allocator->base / PAGE_SIZE;
+    UINTN page = allocator->next_free;
+
+    while (page + pages <= allocator->total_pages) {
+        // Skip to next aligned page
+        UINTN misalignment = (base_page + page) % align_pages;
+        if (misalignment) {
+            page += align_pages - misalignment;
+            continue;
+        }
+
+        // Skip full words
+        if (allocator->bitmap[page / 64] == ~0ULL) {
+            page = (page + 64) & ~(UINTN)63;
+            continue;
+        }
+
+        // Check for a run of free pages here
+        UINTN run = 0;
+        while (run < pages && !(allocator->bitmap[(page + run) / 64] & (1ULL << ((page + run) % 64))))
+            run++;
+
+        if (run == pages) {
+            if (page == allocator->next_free) allocator->next_free = page + pages;
+
+            void *address = (void *)(allocator->base + (page * PAGE_SIZE));
+            page_allocator_mark(allocator, (UINTN)address, pages, true);
+            return address;
+        }
+
+        page += run + 1;    // Used page found, try again after it
+    }
+    return NULL;
+}
+
+// ==========================================================================
+// Initialize a page allocator for a single range of pages e.g. a 
+//   preallocated pool; the bitmap is placed at the start of the range
+// ==========================================================================
+bool page_allocator_init_range(Page_Allocator *allocator, UINTN base, UINTN pages) {
+    memset(allocator, 0, sizeof *allocator);
+
+    UINTN bitmap_pages = (((pages + 63) / 64) * sizeof(UINT64) + (PAGE_SIZE-1)) / PAGE_SIZE;
+    if (base == 0 || bitmap_pages >= pages) return false;
+
+    allocator->bitmap      = (UINT64 *)base;
+    allocator->base        = base;
+    allocator->total_pages = pages;
+
+    memset(allocator->bitmap, 0xFF, bitmap_pages * PAGE_SIZE);  // All pages used
+    allocator->next_free = pages;
+    page_allocator_mark(allocator, base, pages, false);
+    page_allocator_mark(allocator, base, bitmap_pages, true);
+    return true;
+}
+
+// ==============================
+// Free pages from page_alloc()
+// ==============================
+void page_free(Page_Allocator *allocator, void *address, UINTN pages) {
+    page_allocator_mark(allocator, (UINTN)address, pages, false);
+}
+
+// ======================================================================
+// Estimate the number of page table pages needed to map a memory map
+//   3 times (identity, physmap & runtime window), plus a few other ranges. Each range can
+//   need a partial 2MiB page table and 1GiB page directory at both ends,
+//   and a page directory per 1GiB if 1GiB pages are not supported.
+// ======================================================================
+UINTN page_table_pages_estimate(Memory_Map_Info *mmap) {
+    UINTN pages = 16;   // Top level table, framebuffer, kernel, stack, etc.
+    for (UINTN i = 0; i < mmap->size / mmap->desc_size; i++) {
+        EFI_MEMORY_DESCRIPTOR *desc = 
+            (EFI_MEMORY_DESCRIPTOR *)((UINT8 *)mmap->map + (i * mmap->desc_size));
+
+        pages += 3 * (4 + ((desc->NumberOfPages * PAGE_SIZE) / PAGE_SIZE_1GIB));
+    }
+    return pages;
+}
+
+// ======================================================================
+// Get kernel memory map type for an EFI memory type
+// ======================================================================
+KERNEL_MEMORY_TYPE kernel_memory_type(EFI_MEMORY_TYPE type) {
+    switch (type) {
+        case EfiConventionalMemory:      return KERNEL_MEMORY_USABLE;
+        case EfiLoaderCode:
+        case EfiLoaderData:
+        case EfiBootServicesCode:
+        case EfiBootServicesData:        return KERNEL_MEMORY_RECLAIMABLE;
+        case EfiACPIReclaimMemory:       return KERNEL_MEMORY_ACPI_RECLAIMABLE;
+        case EfiACPIMemoryNVS:           return KERNEL_MEMORY_ACPI_NVS;
+        case EfiRuntimeServicesCode:
+        case EfiRuntimeServicesData:     return KERNEL_MEMORY_RUNTIME;
+        case EfiMemoryMappedIO:
+        case EfiMemoryMappedIOPortSpace: return KERNEL_MEMORY_MMIO;
+        default:                         return KERNEL_MEMORY_RESERVED;
+    }
+}
+
+// ======================================================================
+// Get the end address of the run of pages starting at <address> that are 
+//   all used or all free in a page allocator, up to <end>. Pages outside 
+//   of the allocator's range count as free.
+// ======================================================================
+UINTN page_allocator_run_end(Page_Allocator *allocator, UINTN address, UINTN end, bool *used) {
+    *used = false;
+    if (address < allocator->base) return min(end, allocator->base);
+
+    UINTN page = (address - allocator->base) / PAGE_SIZE;
+    if (page >= allocator->total_pages) return end;
+
+    UINTN end_page = (end - allocator->base) / PAGE_SIZE;
+    if (end_page > allocator->total_pages) end_page = allocator->total_pages;
+
+    *used = (allocator->bitmap[page / 64] >> (page % 64)) & 1;
+    UINT64 same_word = *used ? ~0ULL : 0;   
+    for (page++; page < end_page; page++) {
+        // Skip whole words of pages in the same state
+        if (page % 64 == 0 && page + 64 <= end_page && allocator->bitmap[page / 64] == same_word) {
+            page += 63;
+            continue;
+        }
+        if (((allocator->bitmap[page / 64] >> (page % 64)) & 1) != *used) break;
+    }
+
+    return allocator->base + (page * PAGE_SIZE);
+}
+
+// ======================================================================
+// Add a range of pages to a kernel memory map. Adjacent ranges with the
+//   same type are merged into <current>, which is only written to the
+//   map when a different range is added, or a 0 page range to end the
+//   map. The count is always updated but regions are only written while
+//   there is room, so regions can be NULL to get the count needed.
+// ======================================================================
+void add_kernel_memory_region(Kernel_Memory_Region *regions, UINTN capacity, UINTN *count, 
+                              Kernel_Memory_Region *current, 
+                              UINT64 base, UINT64 pages, KERNEL_MEMORY_TYPE type) {
+    if (pages > 0 && current->pages > 0 && current->type == type && 
+        current->base + (current->pages * PAGE_SIZE) == base) {
+        current->pages += pages;
+        return;
+    }
+
+    if (current->pages > 0) {
+        if (regions && *count < capacity) regions[*count] = *current;
+        (*count)++;
+    }
+    *current = (Kernel_Memory_Region){ .base = base, .pages = pages, .type = type };
+}
+
+// ======================================================================
+// Fill out a kernel memory map from an EFI memory map, in address order. 
+//   Usable and reclaimable memory is split into KERNEL_MEMORY_KEEP
+//   regions for pages used from the page allocator, and for <keep> ranges
+//   of loader/firmware memory the kernel still needs. 
+//   Returns the number of regions needed, which may be more than capacity.
+// ======================================================================
+UINTN fill_kernel_memory_map(Memory_Map_Info *mmap, Page_Allocator *allocator, 
+                             Memory_Range *keep, UINTN keep_count,
+                             Kernel_Memory_Region *regions, UINTN capacity) {
+    UINTN count = 0;
+    Kernel_Memory_Region current = {0};
+    UINT64 min_start = 0;
+
+    // The EFI memory map is not sorted, so find each next lowest descriptor; descriptors
+    //   do not overlap and the map only has ~100 of them, so this is fine
+    while (true) {
+        EFI_MEMORY_DESCRIPTOR *desc = NULL;
+        for (UINTN i = 0; i < mmap->size / mmap->desc_size; i++) {
+            EFI_MEMORY_DESCRIPTOR *next = 
                 (EFI_MEMORY_DESCRIPTOR *)((UINT8 *)mmap->map + (i * mmap->desc_size));
 
-            if (desc->Type == EfiConventionalMemory && desc->NumberOfPages >= pages) {
-                // Found enough memory to use at this descriptor, use it
-                current_descriptor = i;
-                remaining_pages = desc->NumberOfPages - pages;
-                next_page_address = (void *)(desc->PhysicalStart + (pages * PAGE_SIZE));
-                return (void *)desc->PhysicalStart;
-            }
+            if (next->NumberOfPages > 0 && next->PhysicalStart >= min_start &&
+                (!desc || next->PhysicalStart < desc->PhysicalStart)) 
+                desc = next;
         }
+        if (!desc) break;
+        min_start = desc->PhysicalStart + 1;
+
+        KERNEL_MEMORY_TYPE type = kernel_memory_type(desc->Type);
+        UINT64 address = desc->PhysicalStart;
+        UINT64 end = address + (desc->NumberOfPages * PAGE_SIZE);
+
+        while (address < end) {
+            KERNEL_MEMORY_TYPE run_type = type;
+            UINT64 run_end = end;
+
+            if (type == KERNEL_MEMORY_USABLE || type == KERNEL_MEMORY_RECLAIMABLE) {
+                // Keep ranges, rounded out to whole pages
+                for (UINTN k = 0; k < keep_count; k++) {
+                    if (keep[k].size == 0) continue;
+                    UINT64 keep_start = keep[k].base & ~(UINT64)(PAGE_SIZE-1);
+                    UINT64 keep_end = (keep[k].base + keep[k].size + (PAGE_SIZE-1)) & ~(UINT64)(PAGE_SIZE-1);
+
+                    if (keep_start <= address && address < keep_end) {
+                        run_type = KERNEL_MEMORY_KEEP;
+                        if (keep_end < run_end) run_end = keep_end;
+                    } else if (address < keep_start && keep_start < run_end) {
+                        run_end = keep_start;
+                    }
+                }
 
-        if (i >= mmap->size / mmap->desc_size) {
-            // Ran out of descriptors to check in memory map
-            error(0, u"\r\nCould not find any memory to allocate pages for.\r\n");
-            return NULL;
+                // Pages already allocated e.g. page tables, kernel stack
+                if (type == KERNEL_MEMORY_USABLE && run_type != KERNEL_MEMORY_KEEP) {
+                    bool used = false;
+                    run_end = page_allocator_run_end(allocator, address, run_end, &used);
+                    if (used) run_type = KERNEL_MEMORY_KEEP;
+                }
+            }
+
+            add_kernel_memory_region(regions, capacity, &count, &current, 
+                                     address, (run_end - address) / PAGE_SIZE, run_type);
+            address = run_end;
         }
     }
+    add_kernel_memory_region(regions, capacity, &count, &current, 0, 0, KERNEL_MEMORY_RESERVED);
 
-    // Else we have at least enough pages for this allocation, return the current spot in 
-    //   the memory map
-    remaining_pages -= pages;
-    void *page = next_page_address;
-    next_page_address = (void *)((UINT8 *)page + (pages * PAGE_SIZE));
-    return page;
+    return count;
 }
 
-// ===========================================================
-// Identity map a page of memory, virtual = physical address
-// ===========================================================
-extern void arch_map_page(uint64_t physical_address, uint64_t virtual_address, Memory_Map_Info *mmap);
+// ======================================================================
+// Find a tag in a boot info block; returns a pointer to its data and 
+//   sets its data size if found, or returns NULL
+// ======================================================================
+void *boot_info_find_tag(Kernel_Parms *kparms, BOOT_TAG_TYPE type, UINT32 *size) {
+    UINT8 *pos = (UINT8 *)kparms + BOOT_INFO_TAGS_OFFSET;
+    UINT8 *end = (UINT8 *)kparms + kparms->size;
+
+    while (pos + sizeof(Boot_Tag) <= end) {
+        Boot_Tag *tag = (Boot_Tag *)pos;
+        if (tag->type == BOOT_TAG_END) break;
 
-void identity_map_page(UINTN address, Memory_Map_Info *mmap) {
-    arch_map_page(address, address, mmap);
+        if (tag->type == type) {
+            if (size) *size = tag->size;
+            return tag + 1;
+        }
+        pos += BOOT_TAG_SIZE(tag->size);
+    }
+    return NULL;
 }
 
+// Boot info block being built by the loader
+typedef struct {
+    UINT8 *buffer;          // Physical address of block
+    UINTN size;             // Bytes used
+    UINTN capacity;         // Bytes allocated
+    UINTN virtual_base;     // Address of block for the kernel
+} Boot_Info_Builder;
+
 // ======================================================================
-// Initialize new paging setup by identity mapping all available memory 
-//   from EFI memory map
+// Add a tag to a boot info block; returns a pointer to the tag's data to
+//   fill out, or NULL if there is no room. Tag data is zeroed.
+// ======================================================================
+void *boot_info_add_tag(Boot_Info_Builder *builder, BOOT_TAG_TYPE type, UINTN size) {
+    if (builder->size + BOOT_TAG_SIZE(size) > builder->capacity) return NULL;
+
+    Boot_Tag *tag = (Boot_Tag *)(builder->buffer + builder->size);
+    tag->type = type;
+    tag->size = size;
+    builder->size += BOOT_TAG_SIZE(size);
+
+    memset(tag + 1, 0, size);
+    return tag + 1;
+}
+
 // ======================================================================
-void identity_map_efi_mmap(Memory_Map_Info *mmap) {
+// Get the kernel's virtual address for a pointer into a boot info block
+// ======================================================================
+void *boot_info_virtual(Boot_Info_Builder *builder, void *ptr) {
+    if (!ptr) return NULL;
+    return (void *)(builder->virtual_base + ((UINT8 *)ptr - builder->buffer));
+}
+
+// ======================================================================
+// Map memory from EFI memory map at virtual = physical + offset, with
+//   each descriptor's cache type. Physically contiguous descriptors with
+//   the same cache type are mapped as 1 range, so the arch code can use
+//   large pages for as much of it as possible.
+//   If ram_only is true, only write back memory (RAM) is mapped.
+// ======================================================================
+extern void arch_map_range(uint64_t physical_address, uint64_t virtual_address, uint64_t size, 
+                           MAP_CACHE_TYPE cache, Page_Allocator *allocator);
+
+void map_efi_mmap(Memory_Map_Info *mmap, UINTN virtual_offset, bool ram_only, 
+                  Page_Allocator *allocator) {
+    UINTN range_start = 0, range_size = 0;
+    MAP_CACHE_TYPE range_cache = MAP_CACHE_WB;
+    MAP_CACHE_TYPE global = virtual_offset ? MAP_GLOBAL : 0;    // Higher half mappings
+
     for (UINTN i = 0; i < mmap->size / mmap->desc_size; i++) {
         EFI_MEMORY_DESCRIPTOR *desc = 
             (EFI_MEMORY_DESCRIPTOR *)((UINT8 *)mmap->map + (i * mmap->desc_size));
 
-        for (UINTN j = 0; j < desc->NumberOfPages; j++)
-            identity_map_page(desc->PhysicalStart + (j * PAGE_SIZE), mmap);
+        MAP_CACHE_TYPE cache = efi_cache_type(desc);
+        if (ram_only && cache != MAP_CACHE_WB) continue;
+        cache |= global;
+
+        if (range_size > 0 && desc->PhysicalStart == range_start + range_size && cache == range_cache) {
+            range_size += desc->NumberOfPages * PAGE_SIZE;  // Extend current range
+            continue;
+        }
+
+        // Map last range and start a new one at this descriptor
+        if (range_size > 0) 
+            arch_map_range(range_start, range_start + virtual_offset, range_size, range_cache, allocator);
+
+        range_start = desc->PhysicalStart;
+        range_size  = desc->NumberOfPages * PAGE_SIZE;
+        range_cache = cache;
+    }
+
+    if (range_size > 0) 
+        arch_map_range(range_start, range_start + virtual_offset, range_size, range_cache, allocator);
+}
+
+// ======================================================================
+// Initialize new paging setup by identity mapping all available memory 
+//   from EFI memory map
+// ======================================================================
+void identity_map_efi_mmap(Memory_Map_Info *mmap, Page_Allocator *allocator) {
+    map_efi_mmap(mmap, 0, false, allocator);
+}
+
+// ======================================================================
+// Page table walk helpers for arch_dump_page_tables(): the arch code 
+//   calls page_table_walk_leaf() for each leaf entry in virtual address 
+//   order, which merges them into runs. Runs are kept for checking cache
+//   type aliases, and with <dump> set each run is written to serial as
+//   "PT <virtual> <physical> <size> <page size> <cache>[ G]", hex values.
+// ======================================================================
+#define PAGE_TABLE_WALK_RUNS 512    // Runs kept for the cache alias check
+
+typedef struct {
+    UINT64 virtual_address;
+    UINT64 physical_address;
+    UINT64 size;
+    UINT32 page_index;      // Index into Page_Table_Stats pages[]
+    UINT32 cache;           // MAP_CACHE_TYPE, with MAP_GLOBAL
+} Page_Table_Run;
+
+typedef struct {
+    Page_Table_Stats *stats;
+    bool             dump;
+    Page_Table_Run   run;   // Current run, size 0 if none
+    UINT64           num_runs;
+    Page_Table_Run   runs[PAGE_TABLE_WALK_RUNS];
+} Page_Table_Walk;
+
+Page_Table_Walk page_table_walk = {0};
+
+void page_table_walk_begin(Page_Table_Stats *stats, bool dump) {
+    memset(stats, 0, sizeof *stats);
+    stats->map_conflicts = page_map_conflicts;
+    stats->walked        = true;
+    page_table_walk.stats    = stats;
+    page_table_walk.dump     = dump;
+    page_table_walk.run.size = 0;
+    page_table_walk.num_runs = 0;
+}
+
+// Count & store current run
+void page_table_walk_flush(void) {
+    Page_Table_Run *run = &page_table_walk.run;
+    if (run->size == 0) return;
+
+    Page_Table_Stats *stats = page_table_walk.stats;
+    stats->runs++;
+    stats->cache_bytes[run->cache & ~MAP_GLOBAL] += run->size;
+    if (run->cache & MAP_GLOBAL) stats->global_bytes += run->size;
+    if (page_table_walk.num_runs < PAGE_TABLE_WALK_RUNS) 
+        page_table_walk.runs[page_table_walk.num_runs++] = *run;
+
+    if (page_table_walk.dump) {
+        const char *page_sizes[] = { "4K", "2M", "1G" };
+        const char *caches[] = { "WB", "WT", "WC", "UC" };
+        char buf[96];
+        sprintf(buf, "PT %llx %llx %llx %s %s%s\r\n", 
+                run->virtual_address, run->physical_address, run->size, 
+                page_sizes[run->page_index], caches[run->cache & ~MAP_GLOBAL],
+                (run->cache & MAP_GLOBAL) ? " G" : "");
+        serial_write(buf);
+    }
+    run->size = 0;
+}
+
+void page_table_walk_leaf(UINT64 virtual_address, UINT64 physical_address, UINT32 page_index, 
+                          MAP_CACHE_TYPE cache) {
+    const UINT64 page_size = PAGE_SIZE << (9 * page_index);
+    page_table_walk.stats->pages[page_index]++;
+
+    Page_Table_Run *run = &page_table_walk.run;
+    if (run->size && run->page_index == page_index && run->cache == cache &&
+        run->virtual_address + run->size == virtual_address &&
+        run->physical_address + run->size == physical_address) {
+        run->size += page_size;
+        return;
     }
+
+    page_table_walk_flush();
+    *run = (Page_Table_Run){
+        .virtual_address  = virtual_address,
+        .physical_address = physical_address,
+        .size             = page_size,
+        .page_index       = page_index,
+        .cache            = cache,
+    };
+}
+
+// Finish walk: check for physical ranges mapped with different cache types, which the 
+//   CPU does not keep coherent, and write the summary to serial
+void page_table_walk_end(void) {
+    page_table_walk_flush();
+
+    Page_Table_Stats *stats = page_table_walk.stats;
+    for (UINT64 i = 0; i < page_table_walk.num_runs; i++) {
+        Page_Table_Run *a = &page_table_walk.runs[i];
+        for (UINT64 j = i + 1; j < page_table_walk.num_runs; j++) {
+            Page_Table_Run *b = &page_table_walk.runs[j];
+            if ((a->cache & ~MAP_GLOBAL) != (b->cache & ~MAP_GLOBAL) &&
+                a->physical_address < b->physical_address + b->size &&
+                b->physical_address < a->physical_address + a->size) 
+                stats->cache_aliases++;
+        }
+    }
+
+    UINT64 tables = stats->tables[0] + stats->tables[1] + stats->tables[2] + stats->tables[3];
+    char buf[192];
+    sprintf(buf, "Page tables: %llu tables (%llu/%llu/%llu/%llu by level), %llu KiB; "
+                 "%llu 4KiB, %llu 2MiB, %llu 1GiB pages in %llu runs\r\n",
+            tables, stats->tables[0], stats->tables[1], stats->tables[2], stats->tables[3],
+            tables * PAGE_SIZE / 1024, stats->pages[0], stats->pages[1], stats->pages[2], 
+            stats->runs);
+    serial_write(buf);
+    sprintf(buf, "Page table KiB: WB %llu, WT %llu, WC %llu, UC %llu, global %llu; "
+                 "%llu misaligned, %llu cache aliases%s, %llu map conflicts\r\n",
+            stats->cache_bytes[MAP_CACHE_WB] / 1024, stats->cache_bytes[MAP_CACHE_WT] / 1024,
+            stats->cache_bytes[MAP_CACHE_WC] / 1024, stats->cache_bytes[MAP_CACHE_UC] / 1024,
+            stats->global_bytes / 1024, stats->misaligned, stats->cache_aliases,
+            stats->runs > PAGE_TABLE_WALK_RUNS ? " (first runs only)" : "", 
+            stats->map_conflicts);
+    serial_write(buf);
 }
 
 // ======================================================================
-// Identity map runtime memory descriptors only, to use with
-//   RuntimeServices->SetVirtualAddressMap()
+// Map runtime memory descriptors into a contiguous virtual window from
+//   <virtual_base> up to <virtual_end>, in physical address order, and set
+//   the new runtime address map with RuntimeServices->SetVirtualAddressMap().
+//   Each range keeps its offset within 2MiB so large pages can be used, 
+//   unless that padding would not fit in the window; physically adjacent 
+//   ranges with the same cache type are mapped as 1.
+//   The new virtual addresses are also set in the input memory map.
+//   This is called after ExitBootServices(), so nothing is printed.
+//   Returns EFI_BUFFER_TOO_SMALL without mapping anything if the runtime
+//   ranges do not fit in the window even without padding.
 // ======================================================================
-void set_runtime_address_map(Memory_Map_Info *mmap) {
+EFI_STATUS set_runtime_address_map(Memory_Map_Info *mmap, UINTN virtual_base, UINTN virtual_end,
+                                   Page_Allocator *allocator) {
     // First get amount of memory to allocate for runtime memory map
     UINTN runtime_descriptors = 0;
     for (UINTN i = 0; i < mmap->size / mmap->desc_size; i++) {
@@ -2389,38 +4300,109 @@ void set_runtime_address_map(Memory_Map_Info *mmap) {
     }
 
     // Allocate memory for runtime memory map
-    UINTN runtime_mmap_pages = (runtime_descriptors * mmap->desc_size) + ((PAGE_SIZE-1) / PAGE_SIZE);
-    EFI_MEMORY_DESCRIPTOR *runtime_mmap = mmap_allocate_pages(mmap, runtime_mmap_pages);
-    if (!runtime_mmap) {
-        error(0, u"Could not allocate runtime descriptors memory map\r\n");
-        return;
+    UINTN runtime_mmap_size = runtime_descriptors * mmap->desc_size; 
+    UINTN runtime_mmap_pages = (runtime_mmap_size + (PAGE_SIZE-1)) / PAGE_SIZE;
+    EFI_MEMORY_DESCRIPTOR *runtime_mmap = page_alloc(allocator, runtime_mmap_pages, 1);
+    if (!runtime_mmap) return EFI_OUT_OF_RESOURCES;
+
+    // Set all runtime descriptors in new runtime memory map in address order with their
+    //   virtual addresses; first try with 2MiB offset padding, then packed if that overflows
+    for (bool pad = true; ; pad = false) {
+        UINTN virtual_address = virtual_base;
+        UINT64 min_start = 0;
+        bool fits = true;
+
+        for (UINTN curr_runtime_desc = 0; curr_runtime_desc < runtime_descriptors; curr_runtime_desc++) {
+            // Get next lowest runtime descriptor
+            EFI_MEMORY_DESCRIPTOR *desc = NULL;
+            for (UINTN i = 0; i < mmap->size / mmap->desc_size; i++) {
+                EFI_MEMORY_DESCRIPTOR *next = 
+                    (EFI_MEMORY_DESCRIPTOR *)((UINT8 *)mmap->map + (i * mmap->desc_size));
+
+                if ((next->Attribute & EFI_MEMORY_RUNTIME) && next->PhysicalStart >= min_start &&
+                    (!desc || next->PhysicalStart < desc->PhysicalStart)) 
+                    desc = next;
+            }
+            min_start = desc->PhysicalStart + 1;
+
+            // Keep same offset into a 2MiB page as the physical address
+            UINTN padding = pad ? (desc->PhysicalStart - virtual_address) & (PAGE_SIZE_2MIB-1) : 0;
+            UINTN size = desc->NumberOfPages * PAGE_SIZE;
+            if (padding > virtual_end - virtual_address || 
+                size > virtual_end - virtual_address - padding) {
+                fits = false;
+                break;
+            }
+            virtual_address += padding;
+            desc->VirtualStart = virtual_address;
+            virtual_address += size;
+
+            EFI_MEMORY_DESCRIPTOR *runtime_desc = 
+                (EFI_MEMORY_DESCRIPTOR *)((UINT8 *)runtime_mmap + (curr_runtime_desc * mmap->desc_size));
+            memcpy(runtime_desc, desc, mmap->desc_size);    
+        }
+
+        if (fits) break;
+        if (!pad) {
+            // Runtime memory stays at its physical addresses, don't leave partial virtual ones
+            for (UINTN i = 0; i < mmap->size / mmap->desc_size; i++)
+                ((EFI_MEMORY_DESCRIPTOR *)((UINT8 *)mmap->map + (i * mmap->desc_size)))->VirtualStart = 0;
+            return EFI_BUFFER_TOO_SMALL;
+        }
     }
 
-    // Identity map all runtime descriptors in each descriptor
-    UINTN runtime_mmap_size = runtime_mmap_pages * PAGE_SIZE; 
-    memset(runtime_mmap, 0, runtime_mmap_size);
+    // Map runtime ranges, merging physically & virtually adjacent ones with the same cache type
+    UINTN range_start = 0, range_virtual = 0, range_size = 0;
+    MAP_CACHE_TYPE range_cache = MAP_CACHE_WB;
 
-    // Set all runtime descriptors in new runtime memory map, and identity map them
-    UINTN curr_runtime_desc = 0;
-    for (UINTN i = 0; i < mmap->size / mmap->desc_size; i++) {
+    for (UINTN curr_runtime_desc = 0; curr_runtime_desc < runtime_descriptors; curr_runtime_desc++) {
         EFI_MEMORY_DESCRIPTOR *desc = 
-            (EFI_MEMORY_DESCRIPTOR *)((UINT8 *)mmap->map + (i * mmap->desc_size));
+            (EFI_MEMORY_DESCRIPTOR *)((UINT8 *)runtime_mmap + (curr_runtime_desc * mmap->desc_size));
 
-        if (desc->Attribute & EFI_MEMORY_RUNTIME) {
-            EFI_MEMORY_DESCRIPTOR *runtime_desc = 
-                (EFI_MEMORY_DESCRIPTOR *)((UINT8 *)runtime_mmap + (curr_runtime_desc * mmap->desc_size));
+        UINTN size = desc->NumberOfPages * PAGE_SIZE;
+        MAP_CACHE_TYPE cache = efi_cache_type(desc) | MAP_GLOBAL;
 
-            memcpy(runtime_desc, desc, mmap->desc_size);    
-            runtime_desc->VirtualStart = runtime_desc->PhysicalStart;
-            curr_runtime_desc++;
+        if (range_size > 0 && desc->PhysicalStart == range_start + range_size && 
+            desc->VirtualStart == range_virtual + range_size && cache == range_cache) {
+            range_size += size;     // Extend current range
+            continue;
         }
+
+        // Map last range and start a new one at this descriptor
+        if (range_size > 0) 
+            arch_map_range(range_start, range_virtual, range_size, range_cache, allocator);
+
+        range_start   = desc->PhysicalStart;
+        range_virtual = desc->VirtualStart;
+        range_size    = size;
+        range_cache   = cache;
     }
 
+    if (range_size > 0) 
+        arch_map_range(range_start, range_virtual, range_size, range_cache, allocator);
+
     // Set new virtual addresses for runtime memory via SetVirtualAddressMap()
-    EFI_STATUS status = rs->SetVirtualAddressMap(runtime_mmap_size, 
-                                                 mmap->desc_size, 
-                                                 mmap->desc_version,
-                                                 runtime_mmap);
-    if (EFI_ERROR(status)) error(0, u"SetVirtualAddressMap()\r\n");
+    return rs->SetVirtualAddressMap(runtime_mmap_size, 
+                                    mmap->desc_size, 
+                                    mmap->desc_version,
+                                    runtime_mmap);
+}
+
+// ======================================================================
+// Get the virtual address of a physical address in runtime memory, after
+//   set_runtime_address_map(). Returns the input address if it is not in
+//   runtime memory.
+// ======================================================================
+UINTN runtime_virtual_address(Memory_Map_Info *mmap, UINTN physical_address) {
+    for (UINTN i = 0; i < mmap->size / mmap->desc_size; i++) {
+        EFI_MEMORY_DESCRIPTOR *desc = 
+            (EFI_MEMORY_DESCRIPTOR *)((UINT8 *)mmap->map + (i * mmap->desc_size));
+
+        if ((desc->Attribute & EFI_MEMORY_RUNTIME) && 
+            physical_address >= desc->PhysicalStart &&
+            physical_address < desc->PhysicalStart + (desc->NumberOfPages * PAGE_SIZE))
+            return desc->VirtualStart + (physical_address - desc->PhysicalStart);
+    }
+    return physical_address;
 }
 
@@ -0,0 +1,248 @@
+//
+// fb.h: Kernel framebuffer drawing; row pointers, span & rectangle fills, and blits,
+//   sized from the GOP mode's pitch & pixel format. Drawing can go to an optional shadow
+//   buffer in RAM, with changed rectangles copied to the framebuffer by fb_flush().
+//
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "efi_lib.h"
+
+#define FB_MAX_DIRTY 16     // Dirty rectangles before they are merged into 1 bounding box
+
+// Rectangle, x1 & y1 are exclusive
+typedef struct {
+    uint32_t x0, y0;
+    uint32_t x1, y1;
+} FB_Rect;
+
+// Framebuffer from the loader's GOP mode; rows are <pitch> bytes apart, which can be more
+//   than the visible width. With a shadow buffer, <base> & <pitch> are the shadow's, and 
+//   drawn rectangles are tracked until fb_flush() copies them to <device>.
+typedef struct {
+    uint8_t  *base;                     // First pixel of first row drawn to
+    uint32_t width;                     // Visible pixels per row
+    uint32_t height;                    // Rows
+    uint32_t pitch;                     // Bytes per row, from PixelsPerScanLine
+    EFI_GRAPHICS_PIXEL_FORMAT format;
+    EFI_PIXEL_BITMASK         masks;    // Channel masks for PixelBitMask
+    uint8_t  *device;                   // Real framebuffer if drawing to a shadow, else NULL
+    uint32_t device_pitch;
+    uint32_t num_dirty;                 // Shadow rectangles not flushed yet
+    FB_Rect  dirty[FB_MAX_DIRTY];
+} Framebuffer;
+
+// ---------------------
+// Functions
+// ---------------------
+// Arch span functions: fill or copy <count> 32bit pixels, non-temporal stores where available.
+//   Only for the framebuffer itself; shadow buffer drawing uses cached stores.
+extern void arch_fill_span(uint32_t *dst, uint32_t value, uint64_t count);
+extern void arch_copy_span(uint32_t *dst, const uint32_t *src, uint64_t count);
+
+// ===================================================================
+// Set up framebuffer from GOP mode. Returns false if there is no
+//   framebuffer to draw to, or pixels are not 32 bits.
+// ===================================================================
+bool fb_init(Framebuffer *fb, EFI_GRAPHICS_OUTPUT_PROTOCOL_MODE *mode) {
+    EFI_GRAPHICS_OUTPUT_MODE_INFORMATION *info = mode->Info;
+    if (!mode->FrameBufferBase || info->PixelFormat >= PixelBltOnly) return false;
+
+    *fb = (Framebuffer){
+        .base   = (uint8_t *)mode->FrameBufferBase,
+        .width  = info->HorizontalResolution,
+        .height = info->VerticalResolution,
+        .pitch  = info->PixelsPerScanLine * 4,
+        .format = info->PixelFormat,
+        .masks  = info->PixelInformation,
+    };
+    return true;
+}
+
+// Get pointer to first pixel of row <y>
+uint32_t *fb_row(Framebuffer *fb, uint32_t y) {
+    return (uint32_t *)(fb->base + (uint64_t)y * fb->pitch);
+}
+
+// Put an 8 bit channel value into the bits of <mask>
+uint32_t fb_channel(uint32_t value, uint32_t mask) {
+    if (!mask) return 0;
+    uint32_t shift = __builtin_ctz(mask), bits = 32 - __builtin_clz(mask >> shift);
+    value = (bits >= 8) ? value << (bits - 8) : value >> (8 - bits);
+    return (value << shift) & mask;
+}
+
+// ===================================================================
+// Convert a 0xARGB 8888 color to the framebuffer's pixel format
+// ===================================================================
+uint32_t fb_color(Framebuffer *fb, uint32_t argb) {
+    uint32_t r = (argb >> 16) & 0xFF, g = (argb >> 8) & 0xFF, b = argb & 0xFF;
+    switch (fb->format) {
+        case PixelRedGreenBlueReserved8BitPerColor: return (b << 16) | (g << 8) | r;
+        case PixelBitMask:
+            return fb_channel(r, fb->masks.RedMask) | fb_channel(g, fb->masks.GreenMask) |
+                   fb_channel(b, fb->masks.BlueMask);
+        case PixelBlueGreenRedReserved8BitPerColor:
+        default: return argb;
+    }
+}
+
+// Fill span of pixels drawn to; cached stores into a shadow buffer, as it is read back by
+//   fb_flush() soon after, else the arch's non-temporal stores straight to the framebuffer
+void fb_fill_span(Framebuffer *fb, uint32_t *dst, uint32_t value, uint64_t count) {
+    if (!fb->device) { arch_fill_span(dst, value, count); return; }
+    while (count--) *dst++ = value;
+}
+
+// Copy span of pixels drawn to, cached or non-temporal like fb_fill_span()
+void fb_copy_span(Framebuffer *fb, uint32_t *dst, const uint32_t *src, uint64_t count) {
+    if (!fb->device) { arch_copy_span(dst, src, count); return; }
+    while (count--) *dst++ = *src++;
+}
+
+// Clip rectangle to framebuffer; returns false if nothing is left to draw
+bool fb_clip(Framebuffer *fb, uint32_t x, uint32_t y, uint32_t *w, uint32_t *h) {
+    if (x >= fb->width || y >= fb->height) return false;
+    *w = min(*w, fb->width - x);
+    *h = min(*h, fb->height - y);
+    return *w && *h;
+}
+
+// ===================================================================
+// Mark a rectangle as drawn, for fb_flush(). Rectangles that overlap
+//   or touch are merged, e.g. glyphs printed along a line; when the
+//   list is full, everything is merged into 1 bounding box.
+// ===================================================================
+void fb_dirty(Framebuffer *fb, uint32_t x, uint32_t y, uint32_t w, uint32_t h) {
+    if (!fb->device || !fb_clip(fb, x, y, &w, &h)) return;
+
+    FB_Rect rect = { x, y, x + w, y + h };
+    for (uint32_t i = 0; i < fb->num_dirty; i++) {
+        FB_Rect *d = &fb->dirty[i];
+        if (rect.x0 <= d->x1 && d->x0 <= rect.x1 && rect.y0 <= d->y1 && d->y0 <= rect.y1) {
+            *d = (FB_Rect){ min(d->x0, rect.x0), min(d->y0, rect.y0), 
+                            max(d->x1, rect.x1), max(d->y1, rect.y1) };
+            return;
+        }
+    }
+
+    if (fb->num_dirty == FB_MAX_DIRTY) {
+        for (uint32_t i = 0; i < fb->num_dirty; i++) {
+            FB_Rect *d = &fb->dirty[i];
+            rect = (FB_Rect){ min(d->x0, rect.x0), min(d->y0, rect.y0), 
+                              max(d->x1, rect.x1), max(d->y1, rect.y1) };
+        }
+        fb->num_dirty = 0;
+    }
+    fb->dirty[fb->num_dirty++] = rect;
+}
+
+// ===================================================================
+// Draw to a shadow buffer in write back RAM from now on, instead of
+//   the framebuffer. Shadow contents start undefined, so the caller 
+//   should clear or redraw the screen next.
+//   Returns false if the shadow buffer could not be allocated.
+// ===================================================================
+bool fb_enable_shadow(Framebuffer *fb, Page_Allocator *allocator) {
+    if (fb->device) return true;
+
+    UINTN pages = ((uint64_t)fb->width * fb->height * 4 + PAGE_SIZE-1) / PAGE_SIZE;
+    uint8_t *shadow = page_alloc(allocator, pages, 1);
+    if (!shadow) return false;
+
+    fb->device       = fb->base;
+    fb->device_pitch = fb->pitch;
+    fb->base         = shadow;
+    fb->pitch        = fb->width * 4;
+    fb->num_dirty    = 0;
+    return true;
+}
+
+// ===================================================================
+// Copy dirty shadow rectangles to the framebuffer, a span per row or
+//   1 span for full width rectangles when the pitches match. 
+//   Spans use non-temporal stores; the framebuffer is never read.
+// ===================================================================
+void fb_flush(Framebuffer *fb) {
+    if (!fb->device) return;
+
+    for (uint32_t i = 0; i < fb->num_dirty; i++) {
+        FB_Rect r = fb->dirty[i];
+        uint32_t w = r.x1 - r.x0;
+        uint8_t *dst = fb->device + (uint64_t)r.y0 * fb->device_pitch + r.x0 * 4;
+        uint8_t *src = fb->base   + (uint64_t)r.y0 * fb->pitch        + r.x0 * 4;
+        if (w == fb->width && fb->device_pitch == fb->pitch) {
+            arch_copy_span((uint32_t *)dst, (uint32_t *)src, (uint64_t)w * (r.y1 - r.y0));
+            continue;
+        }
+
+        for (uint32_t y = r.y0; y < r.y1; y++, dst += fb->device_pitch, src += fb->pitch)
+            arch_copy_span((uint32_t *)dst, (uint32_t *)src, w);
+    }
+    fb->num_dirty = 0;
+}
+
+// ===================================================================
+// Fill rectangle with a 0xARGB color, a span per row
+// ===================================================================
+void fb_fill_rect(Framebuffer *fb, uint32_t x, uint32_t y, uint32_t w, uint32_t h, uint32_t argb) {
+    if (!fb_clip(fb, x, y, &w, &h)) return;
+
+    uint32_t color = fb_color(fb, argb);
+    uint8_t *row = (uint8_t *)(fb_row(fb, y) + x);
+    for (uint32_t i = 0; i < h; i++, row += fb->pitch)
+        fb_fill_span(fb, (uint32_t *)row, color, w);
+    fb_dirty(fb, x, y, w, h);
+}
+
+// ===================================================================
+// Fill whole framebuffer with a 0xARGB color; as 1 span if there is
+//   no padding at the end of rows
+// ===================================================================
+void fb_clear(Framebuffer *fb, uint32_t argb) {
+    if (fb->pitch == fb->width * 4) {
+        fb_fill_span(fb, fb_row(fb, 0), fb_color(fb, argb), (uint64_t)fb->width * fb->height);
+        fb_dirty(fb, 0, 0, fb->width, fb->height);
+    } else {
+        fb_fill_rect(fb, 0, 0, fb->width, fb->height, argb);
+    }
+}
+
+// ===================================================================
+// Copy a w x h block of pixels to x,y. Source pixels are already in
+//   the framebuffer's format, with rows <src_pitch> bytes apart.
+// ===================================================================
+void fb_blit(Framebuffer *fb, uint32_t x, uint32_t y, const uint32_t *src, uint32_t src_pitch,
+             uint32_t w, uint32_t h) {
+    if (!fb_clip(fb, x, y, &w, &h)) return;
+
+    uint8_t *row = (uint8_t *)(fb_row(fb, y) + x);
+    const uint8_t *src_row = (const uint8_t *)src;
+    for (uint32_t i = 0; i < h; i++, row += fb->pitch, src_row += src_pitch)
+        fb_copy_span(fb, (uint32_t *)row, (const uint32_t *)src_row, w);
+    fb_dirty(fb, x, y, w, h);
+}
+
+// ===================================================================
+// Scroll the top <height> rows up by <rows>, and fill the rows left
+//   at the bottom of that area with a 0xARGB color. With a shadow the
+//   rows are copied in RAM; without one this reads the framebuffer.
+// ===================================================================
+void fb_scroll(Framebuffer *fb, uint32_t height, uint32_t rows, uint32_t argb) {
+    height = min(height, fb->height);
+    if (rows >= height) {
+        fb_fill_rect(fb, 0, 0, fb->width, height, argb);
+        return;
+    }
+
+    if (fb->device) {
+        for (uint32_t y = 0; y < height - rows; y++) 
+            fb_copy_span(fb, fb_row(fb, y), fb_row(fb, y + rows), fb->width);
+        fb_dirty(fb, 0, 0, fb->width, height - rows);
+    } else {
+        memcpy(fb_row(fb, 0), fb_row(fb, rows), (uint64_t)fb->pitch * (height - rows));
+    }
+    fb_fill_rect(fb, 0, height - rows, fb->width, rows, argb);
+}
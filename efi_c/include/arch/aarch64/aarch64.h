@@ -10,28 +10,348 @@
 #define ARCH_COFF_MACHINE 0xaa64    // Machine type bytes for PE Coff Header
 
 // TODO:
-void arch_setup_and_call_kernel(Entry_Point entry, void *kernel_stack, uint32_t stack_size, 
-                                Kernel_Parms *kparms) {
-    (void)entry, (void)kernel_stack, (void)stack_size, (void)kparms;
+void arch_setup_and_call_kernel(Entry_Point entry, Boot_CPU *bsp, Kernel_Parms *kparms) {
+    (void)entry, (void)bsp, (void)kparms;
+}
+
+// Get this CPU's affinity fields from MPIDR_EL1, to match MADT GICC entries
+uint64_t arch_cpu_id(void) {
+    uint64_t mpidr;
+    __asm__ __volatile__ ("mrs %0, mpidr_el1" : "=r"(mpidr));
+    return mpidr & 0xFF00FFFFFFULL;
+}
+
+// =====================================================================
+// Get caches from CLIDR_EL1 & CCSIDR_EL1 for each level/type selected 
+//   in CSSELR_EL1. When MPIDR_EL1.MT is set, Aff0 is the thread in a 
+//   core, so threads per core is 1 more than the highest Aff0 of all 
+//   CPUs' MPIDRs from MP services, or of this CPU's without them. 
+//   Packages are not in system registers; 1 package is assumed.
+// =====================================================================
+void arch_get_cpu_topology(CPU_Topology *topology, uint32_t logical_cpus) {
+    uint64_t clidr, mpidr;
+    __asm__ __volatile__ ("mrs %0, clidr_el1" : "=r"(clidr));
+    __asm__ __volatile__ ("mrs %0, mpidr_el1" : "=r"(mpidr));
+
+    uint32_t threads = 1;
+    if (mpidr & (1 << 24)) {
+        threads = (mpidr & 0xFF) + 1;
+        for (UINTN i = 0; mp_services && i < num_cpus; i++) {
+            EFI_PROCESSOR_INFORMATION info;
+            if (!EFI_ERROR(mp_services->GetProcessorInfo(mp_services, i, &info)))
+                threads = max(threads, (uint32_t)(info.ProcessorId & 0xFF) + 1);  // MPIDR on aarch64
+        }
+    }
+
+    *topology = (CPU_Topology){ 
+        .logical_cpus      = logical_cpus, 
+        .packages          = 1, 
+        .threads_per_core  = threads,
+        .cores_per_package = max(logical_cpus / threads, 1),
+    };
+
+    for (uint32_t level = 0; level < 7 && topology->num_caches < MAX_CPU_CACHES; level++) {
+        uint32_t ctype = (clidr >> (level * 3)) & 0x7;     // 1 = I, 2 = D, 3 = I & D, 4 = unified
+        if (ctype == 0) break;
+
+        for (uint32_t instruction = 0; instruction < 2; instruction++) {
+            CPU_CACHE_TYPE type = ctype == 4   ? CPU_CACHE_UNIFIED :
+                                  instruction  ? CPU_CACHE_INSTRUCTION : CPU_CACHE_DATA;
+            if ((instruction && !(ctype & 1)) || (!instruction && ctype == 1) || 
+                topology->num_caches == MAX_CPU_CACHES) 
+                continue;
+
+            uint64_t ccsidr;
+            __asm__ __volatile__ ("msr csselr_el1, %1; isb; mrs %0, ccsidr_el1" 
+                                  : "=r"(ccsidr) : "r"((uint64_t)((level << 1) | instruction)));
+
+            CPU_Cache *cache = &topology->caches[topology->num_caches++];
+            cache->level     = level + 1;
+            cache->type      = type;
+            cache->line_size = 1 << ((ccsidr & 0x7) + 4);
+            cache->ways      = ((ccsidr >> 3) & 0x3FF) + 1;
+            cache->sets      = ((ccsidr >> 13) & 0x7FFF) + 1;
+            cache->size      = cache->ways * cache->sets * cache->line_size;
+        }
+    }
+}
+
+// TODO:
+void arch_init_cpu_tables(Boot_CPU *cpu) {
+    (void)cpu;
+}
+
+// TODO:
+uint64_t arch_init_cpu(Boot_CPU *cpu, uint32_t *xsave_size) {
+    (void)cpu, (void)xsave_size;
+    return 0;
+}
+
+// TODO: APs are started with PSCI CPU_ON, not a trampoline
+bool arch_init_ap_trampoline(uint64_t trampoline) {
+    (void)trampoline;
+    return false;
+}
+
+// TODO:
+uint32_t arch_start_aps(Kernel_Parms *kparms, AP_Entry_Point entry) {
+    (void)kparms, (void)entry;
+    return 0;
 }
 
 // TODO:
 void arch_cpu_halt(void) {
 }
 
+// Exit QEMU with semihosting SYS_EXIT (needs -semihosting), as ADP_Stopped_ApplicationExit
+//   with the exit code
+void arch_debug_exit(uint32_t code) {
+    uint64_t block[2] = { 0x20026, code };
+    register uint64_t x0 __asm__("x0") = 0x18;
+    register uint64_t x1 __asm__("x1") = (uint64_t)block;
+    __asm__ __volatile__ ("hlt #0xf000" : : "r"(x0), "r"(x1) : "memory");
+}
+
+// Read virtual counter-timer
+uint64_t arch_read_timestamp(void) {
+    uint64_t count;
+    __asm__ __volatile__ ("isb; mrs %0, cntvct_el0" : "=r"(count));
+    return count;
+}
+
+// Get generic timer frequency, set by firmware in CNTFRQ_EL0
+uint64_t arch_calibrate_timestamp(uint64_t rsdp, CLOCK_SOURCE *source, uint32_t *flags) {
+    (void)rsdp;
+    uint64_t frequency;
+    __asm__ __volatile__ ("mrs %0, cntfrq_el0" : "=r"(frequency));
+    *source = CLOCK_SOURCE_CNTFRQ;
+    *flags = CLOCK_INVARIANT;
+
+    // Some firmware leaves CNTFRQ_EL0 unset, measure it instead
+    if (!frequency) {
+        frequency = efi_timestamp_frequency(50000000);
+        *source = CLOCK_SOURCE_TIMESTAMP;
+    }
+    return frequency;
+}
+
+// =====================================================================
+// Enable PMUv3 counters: the cycle counter, and event counters 0-2 for
+//   INST_RETIRED, LL_CACHE_MISS_RD, & L1D_TLB_REFILL where the common
+//   event ID registers say they are implemented. Returns PMU_EVENT bits
+//   counted; 0 without PMUv3.
+// =====================================================================
+uint32_t pmu_event_counters = 0;    // Event counters set up, read by arch_pmu_read()
+
+uint32_t arch_pmu_init(void) {
+    uint64_t dfr0, pmcr, pmceid0, pmceid1;
+    __asm__ __volatile__ ("mrs %0, id_aa64dfr0_el1" : "=r"(dfr0));
+    uint64_t pmu_version = (dfr0 >> 8) & 0xF;
+    if (pmu_version == 0 || pmu_version == 0xF) return 0;   // None or IMPLEMENTATION DEFINED
+
+    __asm__ __volatile__ ("mrs %0, pmcr_el0" : "=r"(pmcr));
+    __asm__ __volatile__ ("mrs %0, pmceid0_el0" : "=r"(pmceid0));
+    __asm__ __volatile__ ("mrs %0, pmceid1_el0" : "=r"(pmceid1));
+    uint64_t counters = (pmcr >> 11) & 0x1F;
+
+    // Event IDs 0x00-0x1F are PMCEID0 bits, 0x20-0x3F are PMCEID1 bits
+    const struct { PMU_EVENT event; uint64_t id; bool implemented; } events[] = {
+        { PMU_INSTRUCTIONS, 0x08, pmceid0 & (1 << 0x08) },
+        { PMU_LLC_MISSES,   0x37, pmceid1 & (1 << (0x37 - 0x20)) },
+        { PMU_DTLB_MISSES,  0x05, pmceid0 & (1 << 0x05) },
+    };
+
+    uint32_t enabled = 1 << PMU_CYCLES;
+    uint64_t counter_enables = 1ULL << 31;  // Cycle counter
+    pmu_event_counters = min(counters, ARRAY_SIZE(events));
+    for (uint32_t i = 0; i < pmu_event_counters; i++) {
+        if (!events[i].implemented) continue;
+        __asm__ __volatile__ ("msr pmselr_el0, %0\n"
+                              "isb\n"
+                              "msr pmxevtyper_el0, %1" : : "r"((uint64_t)i), "r"(events[i].id));
+        counter_enables |= 1ULL << i;
+        enabled |= 1 << events[i].event;
+    }
+
+    // Enable counters with a 64 bit cycle counter (PMCR E & LC), then each counter
+    __asm__ __volatile__ ("msr pmcr_el0, %0\n"
+                          "msr pmcntenset_el0, %1\n"
+                          "isb" : : "r"(pmcr | (1 << 0) | (1 << 6)), "r"(counter_enables));
+    return enabled;
+}
+
+void arch_pmu_read(uint64_t counts[PMU_EVENT_COUNT]) {
+    if (!(pmu_events & (1 << PMU_CYCLES))) return;     // No PMUv3
+
+    __asm__ __volatile__ ("mrs %0, pmccntr_el0" : "=r"(counts[PMU_CYCLES]));
+    const PMU_EVENT events[] = { PMU_INSTRUCTIONS, PMU_LLC_MISSES, PMU_DTLB_MISSES };
+    for (uint32_t i = 0; i < pmu_event_counters; i++) {
+        __asm__ __volatile__ ("msr pmselr_el0, %1\n"
+                              "isb\n"
+                              "mrs %0, pmxevcntr_el0" : "=r"(counts[events[i]]) : "r"((uint64_t)i));
+    }
+}
+
+// Get serial port for serial_write(): the ACPI SPCR console MMIO address, if any
+uint64_t arch_serial_base(uint64_t rsdp) {
+    ACPI_TABLE_HEADER *spcr = acpi_find_table(rsdp, "SPCR");
+    if (spcr && spcr->length >= 52 && ((uint8_t *)spcr)[40] == 0)      // System memory space
+        return *(uint64_t *)((uint8_t *)spcr + 44);
+    return 0;
+}
+
+// Write a character to a PL011 UART, waiting while the transmit FIFO is full
+void arch_serial_putc(uint64_t base, char c) {
+    volatile uint32_t *uart = (uint32_t *)base;
+    for (uint32_t timeout = 100000; timeout && (uart[0x18 / 4] & (1 << 5)); timeout--)  // FR TXFF
+        ;
+    uart[0] = c;                                                        // DR
+}
+
+// ==========================================================================
+// Fill <count> 32bit pixels with a value. The 16 byte aligned middle of
+//   <dst> uses STNP non-temporal pair stores of q registers, 64 bytes per
+//   loop, so large fills don't evict the cache.
+// ==========================================================================
+void arch_fill_span(uint32_t *dst, uint32_t value, uint64_t count) {
+    while (count && ((uint64_t)dst & 15)) { *dst++ = value; count--; }
+
+    uint64_t blocks = count / 16;
+    if (blocks) {
+        __asm__ __volatile__ (
+            "dup v0.4s, %w[value]\n"
+            "1:\n"
+            "stnp q0, q0, [%[dst]]\n"
+            "stnp q0, q0, [%[dst], #32]\n"
+            "add %[dst], %[dst], #64\n"
+            "subs %[blocks], %[blocks], #1\n"
+            "b.ne 1b\n"
+            : [dst]"+r"(dst), [blocks]"+r"(blocks)
+            : [value]"r"(value)
+            : "v0", "memory", "cc");
+        count %= 16;
+    }
+    while (count--) *dst++ = value;
+}
+
+// ==========================================================================
+// Copy <count> 32bit pixels, with unaligned q register loads & STNP 
+//   stores to the 16 byte aligned middle of <dst> like arch_fill_span()
+// ==========================================================================
+void arch_copy_span(uint32_t *dst, const uint32_t *src, uint64_t count) {
+    while (count && ((uint64_t)dst & 15)) { *dst++ = *src++; count--; }
+
+    uint64_t blocks = count / 16;
+    if (blocks) {
+        __asm__ __volatile__ (
+            "1:\n"
+            "ldp q0, q1, [%[src]]\n"
+            "ldp q2, q3, [%[src], #32]\n"
+            "stnp q0, q1, [%[dst]]\n"
+            "stnp q2, q3, [%[dst], #32]\n"
+            "add %[src], %[src], #64\n"
+            "add %[dst], %[dst], #64\n"
+            "subs %[blocks], %[blocks], #1\n"
+            "b.ne 1b\n"
+            : [dst]"+r"(dst), [src]"+r"(src), [blocks]"+r"(blocks)
+            :
+            : "v0", "v1", "v2", "v3", "memory", "cc");
+        count %= 16;
+    }
+    while (count--) *dst++ = *src++;
+}
+
 // TODO:
-void arch_map_page(uint64_t physical_address, uint64_t virtual_address, Memory_Map_Info *mmap) {
-    (void)physical_address, (void)virtual_address, (void)mmap;
+void arch_map_page(uint64_t physical_address, uint64_t virtual_address, Page_Allocator *allocator) {
+    (void)physical_address, (void)virtual_address, (void)allocator;
 }
 
 // TODO:
-void arch_unmap_page(UINTN virtual_address) {
-    (void)virtual_address;
+void arch_map_range(uint64_t physical_address, uint64_t virtual_address, uint64_t size, 
+                    MAP_CACHE_TYPE cache, Page_Allocator *allocator) {
+    (void)physical_address, (void)virtual_address, (void)size, (void)cache, (void)allocator;
+}
+
+// TODO:
+void arch_set_cache_type(uint64_t virtual_address, uint64_t size, MAP_CACHE_TYPE cache) {
+    (void)virtual_address, (void)size, (void)cache;
+}
+
+// TODO:
+void arch_unmap_range(uint64_t virtual_address, uint64_t size, Page_Allocator *allocator) {
+    (void)virtual_address, (void)size, (void)allocator;
+}
+
+// TODO:
+void arch_unmap_page(uint64_t virtual_address, Page_Allocator *allocator) {
+    (void)virtual_address, (void)allocator;
+}
+
+// The loader does not build aarch64 translation tables yet, so there is nothing of its own to
+//   walk; stats are left marked as not walked rather than reporting 0 tables as checked
+void arch_dump_page_tables(Page_Table_Stats *stats, bool dump) {
+    (void)dump;
+    memset(stats, 0, sizeof *stats);
+    serial_write("Page table stats: not available on aarch64\r\n");
 }
 
 // TODO:
-void arch_init_page_tables(Memory_Map_Info *mmap) {
-    void *page_table = mmap_allocate_pages(mmap, 1);
+void arch_init_page_tables(Page_Allocator *allocator) {
+    void *page_table = page_alloc(allocator, 1, 1);
     memset(page_table, 0, PAGE_SIZE);  
 }
 
+// Interrupts & the one-shot timer are x86_64 only: there are no VBAR_EL1 exception vectors
+//   or GIC setup here, so IRQs stay masked, handlers are never called, and the kernel busy 
+//   waits on the timestamp clock instead of using a timer.
+//   Registers as an exception vector would save them, lowest address first.
+typedef struct {
+    uint64_t x[31];
+    uint64_t sp, elr, spsr;
+} Interrupt_Frame;
+
+typedef void (*Interrupt_Handler)(Interrupt_Frame *frame);
+
+void arch_enable_interrupts(void) {
+    __asm__ __volatile__ ("msr daifclr, #2" : : : "memory");
+}
+
+bool arch_disable_interrupts(void) {
+    uint64_t daif;
+    __asm__ __volatile__ ("mrs %0, daif; msr daifset, #2" : "=r"(daif) : : "memory");
+    return !(daif & (1 << 7));  // I bit clear = IRQs were enabled
+}
+
+void arch_restore_interrupts(bool enabled) {
+    if (enabled) arch_enable_interrupts();
+}
+
+// A pending IRQ wakes up "wfi" even with IRQs masked, so they are left as they are; with no
+//   vectors installed, IRQs stay masked and are never taken
+void arch_wait_for_interrupt(void) {
+    __asm__ __volatile__ ("wfi" : : : "memory");
+}
+
+// No exception vectors, so there is nothing to call handlers from
+void arch_set_interrupt_handler(uint8_t vector, Interrupt_Handler handler) {
+    (void)vector, (void)handler;
+}
+
+// No vectors are installed: VBAR_EL1 still points at firmware vectors in memory the kernel can
+//   reclaim, so IRQs are masked and this returns false to keep the kernel from unmasking them
+bool arch_init_interrupts(void) {
+    __asm__ __volatile__ ("msr daifset, #2" : : : "memory");
+    return false;
+}
+
+// No timer interrupt without the GIC; callers fall back to polling the timestamp clock
+bool arch_init_timer(Kernel_Parms *kparms, Interrupt_Handler handler) {
+    (void)kparms, (void)handler;
+    return false;
+}
+
+// Never called, arch_init_timer() reports no timer
+void arch_set_timer(uint64_t deadline) {
+    (void)deadline;
+}
+
@@ -92,6 +92,95 @@ typedef struct {
     TSS_LDT_Descriptor tss;                 // Offset 0x48
 } GDT;
 
+// Per CPU GDT & TSS, in a Boot_CPU's arch_data page
+typedef struct {
+    GDT gdt;
+    TSS tss;
+} CPU_Tables;
+
+// AP trampoline: real mode startup code at the start of a page below 1MiB, with this data at
+//   AP_TRAMPOLINE_DATA_OFFSET in the same page. APs are started one at a time, and each one 
+//   loads its stack & parameters from here before incrementing started.
+#define AP_TRAMPOLINE_DATA_OFFSET 0xF00
+
+typedef struct {
+    uint64_t gdt[3];                    // Temporary GDT: null, 64 bit code, & data descriptors
+    uint16_t gdtr_limit;                // GDTR for 32 bit "lgdtl" in real mode
+    uint32_t gdtr_base;
+    uint16_t pad;
+    uint32_t long_mode_offset;          // Far pointer for "ljmpl" into 64 bit code
+    uint16_t long_mode_selector;
+    uint16_t pad2;
+    uint64_t cr0;                       // Control registers & EFER from the BSP
+    uint64_t cr3;
+    uint64_t cr4;
+    uint64_t efer;
+    uint64_t stack;                     // Values for the AP being started
+    uint64_t entry;
+    uint64_t kparms;
+    uint64_t cpu;
+    volatile uint32_t started;          // Incremented by each AP once it read the values above
+} __attribute__((packed)) AP_Trampoline_Data;
+
+#define IA32_APIC_BASE_MSR   0x1B
+#define IA32_EFER_MSR        0xC0000080
+#define X2APIC_ICR_MSR       0x830
+#define APIC_BASE_X2APIC     (1 << 10)  // x2APIC mode enabled in IA32_APIC_BASE
+#define LAPIC_ICR_LOW        0x300      // xAPIC register offsets
+#define LAPIC_ICR_HIGH       0x310
+#define LAPIC_ICR_PENDING    (1 << 12)  // Delivery status: send pending
+#define ICR_INIT             0x4500     // INIT, level assert
+#define ICR_STARTUP          0x4600     // Start up (SIPI), level assert; vector = page number
+
+// IDT = Interrupt Descriptor Table
+typedef struct {
+    uint16_t offset_15_0;
+    uint16_t selector;          // Code segment in GDT
+    uint8_t  ist;               // Interrupt stack table index, 0 = use current stack
+    uint8_t  type_attributes;   // 0x8E = present, DPL 0, 64 bit interrupt gate
+    uint16_t offset_31_16;
+    uint32_t offset_63_32;
+    uint32_t reserved;
+} __attribute__((packed)) IDT_Entry;
+
+// Registers saved by the interrupt stubs, then pushed by the CPU, lowest address first
+typedef struct {
+    uint64_t r15, r14, r13, r12, r11, r10, r9, r8;
+    uint64_t rbp, rdi, rsi, rdx, rcx, rbx, rax;
+    uint64_t vector, error_code;    // Error code is 0 if the CPU does not push one
+    uint64_t rip, cs, rflags, rsp, ss;
+} Interrupt_Frame;
+
+typedef void (*Interrupt_Handler)(Interrupt_Frame *frame);
+
+#define TIMER_VECTOR    0x40
+#define SPURIOUS_VECTOR 0xFF
+
+// Local APIC registers (xAPIC MMIO offsets; x2APIC MSR = 0x800 + (offset >> 4))
+#define LAPIC_TPR            0x080
+#define LAPIC_EOI            0x0B0
+#define LAPIC_SPURIOUS       0x0F0
+#define LAPIC_LVT_TIMER      0x320
+#define LAPIC_TIMER_INITIAL  0x380
+#define LAPIC_TIMER_CURRENT  0x390
+#define LAPIC_TIMER_DIVIDE   0x3E0
+#define LAPIC_SOFT_ENABLE    (1 << 8)   // In spurious interrupt vector register
+#define LVT_MASKED           (1 << 16)
+#define LVT_TSC_DEADLINE     (2 << 17)  // Timer mode, one-shot is 0
+#define IA32_TSC_DEADLINE_MSR 0x6E0
+
+// Architectural performance monitoring, CPUID leaf 0xA version 2+
+#define IA32_PMC0_MSR                  0xC1     // General purpose counters, PMC0-n
+#define IA32_PERFEVTSEL0_MSR           0x186    // Event selects for PMC0-n
+#define IA32_FIXED_CTR0_MSR            0x309    // Instructions retired
+#define IA32_FIXED_CTR1_MSR            0x30A    // Core cycles
+#define IA32_FIXED_CTR_CTRL_MSR        0x38D
+#define IA32_PERF_GLOBAL_CTRL_MSR      0x38F
+#define PERFEVTSEL_USR_OS_EN           ((1 << 16) | (1 << 17) | (1 << 22))
+#define PERFEVTSEL_LLC_MISSES          0x412E   // Architectural event, umask 0x41
+#define PERFEVTSEL_DTLB_LOAD_WALKS     0x0108   // DTLB_LOAD_MISSES.MISS_CAUSES_A_WALK, model specific
+#define APIC_BASE_ENABLE     (1 << 11)  // In IA32_APIC_BASE
+
 // Page table structure: 512 64bit entries per table/level
 typedef struct {
     uint64_t entries[512];
@@ -102,28 +191,486 @@ enum {
     PRESENT    = (1 << 0),
     READWRITE  = (1 << 1),
     USER       = (1 << 2),
+    WRITE_THROUGH = (1 << 3),   // PWT bit; PAT index bit 0
+    CACHE_DISABLE = (1 << 4),   // PCD bit; PAT index bit 1
+    PAT_4KIB   = (1 << 7),  // PAT index bit 2 for 4KiB pages in a PT entry
+    LARGE_PAGE = (1 << 7),  // PS bit; maps a 2MiB page in a PDT entry or 1GiB page in a PDPT 
+                            //   entry, instead of pointing to the next level table
+    GLOBAL     = (1 << 8),  // Not flushed from the TLB on CR3 loads, if CR4.PGE is set
+    PAT_LARGE  = (1 << 12), // PAT index bit 2 for 2MiB/1GiB pages
 };
 
+// Control register bits set by arch_enable_cpu_features()
+#define CR0_MP         (1 << 1)     // Monitor coprocessor
+#define CR0_EM         (1 << 2)     // x87 emulation, must be clear for SSE
+#define CR4_PGE        (1 << 7)     // Global pages
+#define CR4_OSFXSR     (1 << 9)     // FXSAVE/FXRSTOR & SSE
+#define CR4_OSXMMEXCPT (1 << 10)    // Unmasked SSE exceptions (#XM)
+#define CR4_FSGSBASE   (1 << 16)
+#define CR4_PCIDE      (1 << 17)
+#define CR4_OSXSAVE    (1 << 18)
+
+// XCR0 state components
+#define XCR0_X87       (1 << 0)
+#define XCR0_SSE       (1 << 1)
+#define XCR0_AVX       (1 << 2)
+#define XCR0_AVX512    (7 << 5)     // Opmask, ZMM0-15 upper halves, & ZMM16-31
+
+// PAT MSR value programmed before loading the new page tables. Entries 0-3 are the power on 
+//   defaults, so PWT/PCD bits mean the same as before. Entry 4 (PAT bit set) is write combining.
+//   PA0 = WB (06), PA1 = WT (04), PA2 = UC- (07), PA3 = UC (00), 
+//   PA4 = WC (01), PA5 = WT (04), PA6 = UC- (07), PA7 = UC (00)
+#define IA32_PAT_MSR   0x277
+#define IA32_PAT_VALUE 0x0007040100070406ULL
+
 #define ARCH_COFF_MACHINE 0x8664    // Machine type bytes for PE Coff Header
 
 #define PHYS_PAGE_ADDR_MASK 0x000FFFFFFFFFF000  // 52 bit physical address limit, lowest 12 bits are for flags only
 
+#define TLB_FLUSH_THRESHOLD 32  // Max pages to invlpg after unmapping, before reloading CR3 instead
+
 // ---------------------
 // Global variables
 // ---------------------
 Page_Table *pml4 = NULL;        // Top level 4 page table for x86_64 long mode paging
+bool gib_pages_supported = false;   // Can CPU map 1GiB pages in PDPT entries?
+
+IDT_Entry idt[256] = {0};                   // Shared by all CPUs
+Interrupt_Handler interrupt_handlers[256] = {0};
+uint64_t lapic_base = 0;                    // xAPIC registers, 0 if not in use
+bool lapic_x2apic = false;                  // Local APIC registers are MSRs instead
+bool tsc_deadline_timer = false;            // One-shot timer set by TSC value, else LAPIC count
+uint64_t lapic_timer_frequency = 0;         // LAPIC timer ticks per second, without TSC-deadline
 
 // ---------------------
 // Functions
 // ---------------------
-extern void *mmap_allocate_pages(Memory_Map_Info *mmap, uint64_t pages);
+extern void *page_alloc(Page_Allocator *allocator, UINTN pages, UINTN align_pages);
+extern void page_free(Page_Allocator *allocator, void *address, UINTN pages);
 extern void *memset(void *dst, uint8_t c, uint64_t len);
 
+extern void *memcpy(void *dst, void *src, uint64_t len);
+
 // Clear interrupts and halt CPU
 void arch_cpu_halt(void) {
     __asm__ ("cli; hlt");
 }
 
+// Read CPU timestamp counter
+uint64_t arch_read_timestamp(void) {
+    uint32_t low, high;
+    __asm__ __volatile__ ("rdtsc" : "=a"(low), "=d"(high));
+    return ((uint64_t)high << 32) | low;
+}
+
+// Read/write a model specific register
+uint64_t rdmsr(uint32_t msr) {
+    uint32_t low, high;
+    __asm__ __volatile__ ("rdmsr" : "=a"(low), "=d"(high) : "c"(msr));
+    return ((uint64_t)high << 32) | low;
+}
+
+void wrmsr(uint32_t msr, uint64_t value) {
+    __asm__ __volatile__ ("wrmsr" : : "c"(msr), "a"((uint32_t)value), "d"((uint32_t)(value >> 32)));
+}
+
+// Get CPU identification & feature information for a CPUID leaf/subleaf
+void cpuid(uint32_t leaf, uint32_t subleaf, 
+           uint32_t *eax, uint32_t *ebx, uint32_t *ecx, uint32_t *edx) {
+    __asm__ __volatile__ ("cpuid" 
+                          : "=a"(*eax), "=b"(*ebx), "=c"(*ecx), "=d"(*edx) 
+                          : "a"(leaf), "c"(subleaf));
+}
+
+// Write to/read from an I/O port
+void outb(uint16_t port, uint8_t value) {
+    __asm__ __volatile__ ("outb %0, %1" : : "a"(value), "Nd"(port));
+}
+
+uint8_t inb(uint16_t port) {
+    uint8_t value;
+    __asm__ __volatile__ ("inb %1, %0" : "=a"(value) : "Nd"(port));
+    return value;
+}
+
+uint32_t inl(uint16_t port) {
+    uint32_t value;
+    __asm__ __volatile__ ("inl %1, %0" : "=a"(value) : "Nd"(port));
+    return value;
+}
+
+// Exit QEMU through its isa-debug-exit device at port 0xF4, with status (code << 1) | 1; 
+//   this does nothing without that device, so callers should halt after
+void arch_debug_exit(uint32_t code) {
+    outb(0xF4, code);
+}
+
+// Short delay of roughly 1 microsecond, from a write to the unused POST code port
+void io_delay(void) {
+    outb(0x80, 0);
+}
+
+// =====================================================================
+// Get this CPU's local APIC ID: the x2APIC ID from CPUID leaf 0xB if 
+//   available, or the 8 bit initial APIC ID otherwise
+// =====================================================================
+uint64_t arch_cpu_id(void) {
+    uint32_t eax, ebx, ecx, edx;
+    cpuid(0, 0, &eax, &ebx, &ecx, &edx);
+    if (eax >= 0xB) {
+        cpuid(0xB, 0, &eax, &ebx, &ecx, &edx);
+        if (ebx != 0) return edx;
+    }
+    cpuid(1, 0, &eax, &ebx, &ecx, &edx);
+    return ebx >> 24;
+}
+
+// =====================================================================
+// Get packages, cores & SMT threads from CPUID leaf 0x1F or 0xB, or 
+//   leaves 1 & 4 on older CPUs, and caches from leaf 4 (Intel) or 
+//   0x8000001D (AMD), which use the same format. logical_cpus is the 
+//   number of enabled CPUs e.g. from the MADT, to count packages.
+// =====================================================================
+void arch_get_cpu_topology(CPU_Topology *topology, uint32_t logical_cpus) {
+    uint32_t eax, ebx, ecx, edx;
+    uint32_t max_leaf, max_ext_leaf, vendor_ebx;
+    *topology = (CPU_Topology){ .logical_cpus = logical_cpus, .threads_per_core = 1 };
+
+    cpuid(0, 0, &max_leaf, &vendor_ebx, &ecx, &edx);
+    cpuid(0x80000000, 0, &max_ext_leaf, &ebx, &ecx, &edx);
+    bool amd = vendor_ebx == 0x68747541;    // "Auth"enticAMD
+
+    // Threads per core & logical CPUs per package
+    uint32_t per_package = 0;
+    uint32_t topology_leaf = max_leaf >= 0x1F ? 0x1F : max_leaf >= 0xB ? 0xB : 0;
+    if (topology_leaf) {
+        for (uint32_t level = 0; level < 8; level++) {
+            cpuid(topology_leaf, level, &eax, &ebx, &ecx, &edx);
+            uint32_t level_type = (ecx >> 8) & 0xFF;
+            if (level_type == 0) break;                     // Invalid, no more levels
+            if (level_type == 1) topology->threads_per_core = max(ebx & 0xFFFF, 1);   // SMT
+            per_package = ebx & 0xFFFF;                     // Last level is the package
+        }
+    }
+    if (!per_package) {
+        cpuid(1, 0, &eax, &ebx, &ecx, &edx);
+        per_package = (edx & (1 << 28)) ? (ebx >> 16) & 0xFF : 1;  // HTT
+        if (max_leaf >= 4 && !amd) {
+            cpuid(4, 0, &eax, &ebx, &ecx, &edx);
+            uint32_t cores = (eax >> 26) + 1;
+            if (per_package > cores) topology->threads_per_core = per_package / cores;
+        }
+    }
+    per_package = max(per_package, 1);
+    topology->cores_per_package = max(per_package / topology->threads_per_core, 1);
+    topology->packages = max((logical_cpus + per_package - 1) / per_package, 1);
+
+    // Caches, each subleaf is 1 cache until type 0
+    uint32_t cache_leaf = 0;
+    if (amd && max_ext_leaf >= 0x8000001D) {
+        cpuid(0x80000001, 0, &eax, &ebx, &ecx, &edx);
+        if (ecx & (1 << 22)) cache_leaf = 0x8000001D;       // TopologyExtensions
+    } else if (!amd && max_leaf >= 4) {
+        cache_leaf = 4;
+    }
+    for (uint32_t i = 0; cache_leaf && i < MAX_CPU_CACHES; i++) {
+        cpuid(cache_leaf, i, &eax, &ebx, &ecx, &edx);
+        if ((eax & 0x1F) == 0) break;
+
+        CPU_Cache *cache  = &topology->caches[topology->num_caches++];
+        cache->type       = eax & 0x1F;  // 1 = data, 2 = instruction, 3 = unified
+        cache->level      = (eax >> 5) & 0x7;
+        cache->shared_by  = ((eax >> 14) & 0xFFF) + 1;
+        cache->line_size  = (ebx & 0xFFF) + 1;
+        cache->ways       = (ebx >> 22) + 1;
+        cache->sets       = ecx + 1;
+        cache->size       = cache->ways * (((ebx >> 12) & 0x3FF) + 1) * cache->line_size * cache->sets;
+    }
+}
+
+// =====================================================================
+// Get TSC frequency: from CPUID leaf 0x15 if it reports the crystal 
+//   clock, else measured over ~50ms against the HPET, the ACPI PM timer, 
+//   or bs->Stall(), in that order of what is available. Sets the source 
+//   used and CLOCK_INVARIANT if the TSC runs at a constant rate in all
+//   power states (CPUID 0x80000007 EDX bit 8).
+// =====================================================================
+uint64_t arch_calibrate_timestamp(uint64_t rsdp, CLOCK_SOURCE *source, uint32_t *flags) {
+    const uint64_t CALIBRATE_NS = 50000000;     // 50ms
+    uint32_t eax, ebx, ecx, edx, max_leaf;
+
+    *flags = 0;
+    cpuid(0x80000000, 0, &eax, &ebx, &ecx, &edx);
+    if (eax >= 0x80000007) {
+        cpuid(0x80000007, 0, &eax, &ebx, &ecx, &edx);
+        if (edx & (1 << 8)) *flags |= CLOCK_INVARIANT;
+    }
+
+    // TSC/crystal clock ratio & crystal frequency
+    cpuid(0, 0, &max_leaf, &ebx, &ecx, &edx);
+    if (max_leaf >= 0x15) {
+        cpuid(0x15, 0, &eax, &ebx, &ecx, &edx);
+        if (eax && ebx && ecx) {
+            *source = CLOCK_SOURCE_CPUID;
+            return ((uint64_t)ecx * ebx) / eax;
+        }
+    }
+
+    // HPET, if the firmware has its main counter running
+    ACPI_TABLE_HEADER *hpet_table = acpi_find_table(rsdp, "HPET");
+    if (hpet_table && hpet_table->length >= 52) {
+        uint64_t base = *(uint64_t *)((uint8_t *)hpet_table + 44);  // Base address in GAS at 40
+        volatile uint64_t *hpet = (uint64_t *)base;
+        uint64_t period_fs = hpet[0] >> 32;                          // Capabilities & ID
+        if (base && (hpet[2] & 1) && period_fs) {                    // Config, ENABLE_CNF
+            uint64_t target = (CALIBRATE_NS * 1000000) / period_fs;
+            uint64_t start = hpet[30];                               // Main counter at 0xF0
+            uint64_t tsc_start = arch_read_timestamp();
+            uint64_t elapsed = 0;
+            while (elapsed < target) elapsed = hpet[30] - start;
+            uint64_t tsc_ticks = arch_read_timestamp() - tsc_start;
+
+            *source = CLOCK_SOURCE_HPET;
+            return (tsc_ticks * 1000000000) / ((elapsed * period_fs) / 1000000);
+        }
+    }
+
+    // ACPI PM timer at 3.579545MHz, 24 or 32 bits
+    ACPI_TABLE_HEADER *fadt = acpi_find_table(rsdp, "FACP");
+    if (fadt && fadt->length >= 116) {
+        uint8_t *fadt_bytes = (uint8_t *)fadt;
+        uint16_t port = *(uint32_t *)(fadt_bytes + 76);             // PM_TMR_BLK
+        if (fadt->length >= 220 && fadt_bytes[208] == 1 &&          // X_PM_TMR_BLK in I/O space
+            *(uint64_t *)(fadt_bytes + 212)) 
+            port = *(uint64_t *)(fadt_bytes + 212);
+        uint32_t mask = (*(uint32_t *)(fadt_bytes + 112) & (1 << 8)) ? 0xFFFFFFFF : 0xFFFFFF;
+
+        if (port) {
+            const uint64_t PM_TIMER_HZ = 3579545;
+            uint32_t target = (PM_TIMER_HZ * CALIBRATE_NS) / 1000000000;
+            uint32_t start = inl(port) & mask;
+            uint64_t tsc_start = arch_read_timestamp();
+            uint32_t elapsed = 0;
+            while (elapsed < target) elapsed = ((inl(port) & mask) - start) & mask;
+            uint64_t tsc_ticks = arch_read_timestamp() - tsc_start;
+
+            *source = CLOCK_SOURCE_PM_TIMER;
+            return (tsc_ticks * PM_TIMER_HZ) / elapsed;
+        }
+    }
+
+    // Firmware timestamp counter, if it has one
+    uint64_t frequency = efi_timestamp_frequency(CALIBRATE_NS);
+    if (frequency) {
+        *source = CLOCK_SOURCE_TIMESTAMP;
+        return frequency;
+    }
+
+    // Boot services stall, least accurate
+    if (bs) {
+        uint64_t tsc_start = arch_read_timestamp();
+        bs->Stall(CALIBRATE_NS / 1000);
+        uint64_t tsc_ticks = arch_read_timestamp() - tsc_start;
+
+        *source = CLOCK_SOURCE_STALL;
+        return (tsc_ticks * 1000000000) / CALIBRATE_NS;
+    }
+
+    *source = CLOCK_SOURCE_NONE;
+    return 0;
+}
+
+// =====================================================================
+// Enable architectural performance counters from CPUID leaf 0xA: fixed
+//   counters for instructions & cycles, PMC0 for LLC misses, & PMC1 for
+//   dTLB load walks on Intel models known to have that event. Returns 
+//   PMU_EVENT bits counted; 0 with no PMU, as under QEMU TCG or a 
+//   hypervisor that hides it.
+// =====================================================================
+uint32_t pmu_gp_counters = 0;   // Set up by arch_pmu_init(), read by arch_pmu_read()
+bool pmu_fixed_counters = false;
+
+// DTLB_LOAD_MISSES.MISS_CAUSES_A_WALK is not architectural; event 08H umask 01H only means 
+//   that on Intel family 6 Sandy Bridge through Skylake & derivatives (Kaby/Coffee/Comet Lake)
+bool pmu_dtlb_walks_supported(void) {
+    uint32_t eax, ebx, ecx, edx;
+    cpuid(0, 0, &eax, &ebx, &ecx, &edx);
+    if (ebx != 0x756E6547 || edx != 0x49656E69 || ecx != 0x6C65746E) return false;  // GenuineIntel
+
+    cpuid(1, 0, &eax, &ebx, &ecx, &edx);
+    uint32_t family = (eax >> 8) & 0xF;
+    uint32_t model  = ((eax >> 4) & 0xF) | (((eax >> 16) & 0xF) << 4);
+    if (family != 6) return false;
+
+    const uint8_t models[] = {
+        0x2A, 0x2D,                     // Sandy Bridge
+        0x3A, 0x3E,                     // Ivy Bridge
+        0x3C, 0x3F, 0x45, 0x46,         // Haswell
+        0x3D, 0x47, 0x4F, 0x56,         // Broadwell
+        0x4E, 0x5E, 0x55,               // Skylake
+        0x8E, 0x9E, 0xA5, 0xA6,         // Kaby/Coffee/Comet Lake
+    };
+    for (uint32_t i = 0; i < ARRAY_SIZE(models); i++)
+        if (model == models[i]) return true;
+    return false;
+}
+
+uint32_t arch_pmu_init(void) {
+    uint32_t eax, ebx, ecx, edx;
+    cpuid(0, 0, &eax, &ebx, &ecx, &edx);
+    if (eax < 0xA) return 0;
+
+    cpuid(0xA, 0, &eax, &ebx, &ecx, &edx);
+    uint32_t version = eax & 0xFF, gp_counters = (eax >> 8) & 0xFF;
+    uint32_t events_length = (eax >> 24) & 0xFF;    // EBX bits that are valid
+    uint32_t missing = ebx | ~((1ULL << events_length) - 1);
+    if (version < 2) return 0;  // Global control MSR is version 2+
+
+    uint32_t events = 0;
+    uint64_t global_ctrl = 0;
+
+    // Fixed counters 0 & 1 count in ring 0 & 3
+    pmu_fixed_counters = (edx & 0x1F) >= 2 && !(missing & (1 << 0)) && !(missing & (1 << 1));
+    if (pmu_fixed_counters) {
+        wrmsr(IA32_FIXED_CTR_CTRL_MSR, rdmsr(IA32_FIXED_CTR_CTRL_MSR) | 0x33);
+        global_ctrl |= (1ULL << 32) | (1ULL << 33);
+        events |= (1 << PMU_INSTRUCTIONS) | (1 << PMU_CYCLES);
+    }
+
+    // General purpose counters for misses
+    pmu_gp_counters = min(gp_counters, 2);
+    if (pmu_gp_counters >= 1 && !(missing & (1 << 4))) {
+        wrmsr(IA32_PERFEVTSEL0_MSR, PERFEVTSEL_LLC_MISSES | PERFEVTSEL_USR_OS_EN);
+        global_ctrl |= 1 << 0;
+        events |= 1 << PMU_LLC_MISSES;
+    }
+    if (pmu_gp_counters >= 2 && !pmu_dtlb_walks_supported()) pmu_gp_counters = 1;
+    if (pmu_gp_counters >= 2) {
+        wrmsr(IA32_PERFEVTSEL0_MSR + 1, PERFEVTSEL_DTLB_LOAD_WALKS | PERFEVTSEL_USR_OS_EN);
+        global_ctrl |= 1 << 1;
+        events |= 1 << PMU_DTLB_MISSES;
+    }
+
+    if (global_ctrl) wrmsr(IA32_PERF_GLOBAL_CTRL_MSR, rdmsr(IA32_PERF_GLOBAL_CTRL_MSR) | global_ctrl);
+    return events;
+}
+
+void arch_pmu_read(uint64_t counts[PMU_EVENT_COUNT]) {
+    if (pmu_fixed_counters) {
+        counts[PMU_INSTRUCTIONS] = rdmsr(IA32_FIXED_CTR0_MSR);
+        counts[PMU_CYCLES]       = rdmsr(IA32_FIXED_CTR1_MSR);
+    }
+    if (pmu_gp_counters >= 1) counts[PMU_LLC_MISSES]  = rdmsr(IA32_PMC0_MSR);
+    if (pmu_gp_counters >= 2) counts[PMU_DTLB_MISSES] = rdmsr(IA32_PMC0_MSR + 1);
+}
+
+// =====================================================================
+// Get serial port for serial_write(): the ACPI SPCR console if it is an
+//   I/O port 16550, or COM1. The UART is left as firmware set it up.
+// =====================================================================
+uint64_t arch_serial_base(uint64_t rsdp) {
+    ACPI_TABLE_HEADER *spcr = acpi_find_table(rsdp, "SPCR");
+    if (spcr && spcr->length >= 52) {
+        uint8_t *spcr_bytes = (uint8_t *)spcr;
+        uint64_t address = *(uint64_t *)(spcr_bytes + 44);      // Base address in GAS at 40
+        if (spcr_bytes[40] == 1 && address) return address;     // System I/O space
+    }
+    return 0x3F8;
+}
+
+// Write a character to a 16550 UART, waiting for the transmit holding register to empty
+void arch_serial_putc(uint64_t base, char c) {
+    for (uint32_t timeout = 100000; timeout && !(inb(base + 5) & 0x20); timeout--)   // LSR THRE
+        ;
+    outb(base, c);
+}
+
+// ==========================================================================
+// Fill <count> 32bit pixels with <value>. The 16 byte aligned middle uses 
+//   SSE2 non-temporal stores, 64 bytes per loop, which go to memory without
+//   reading lines into the cache; ends are plain stores.
+// ==========================================================================
+void arch_fill_span(uint32_t *dst, uint32_t value, uint64_t count) {
+    while (count && ((uint64_t)dst & 15)) { *dst++ = value; count--; }
+
+    uint64_t blocks = count / 16;
+    if (blocks) {
+        __asm__ __volatile__ (
+            "movd %[value], %%xmm0\n"
+            "pshufd $0, %%xmm0, %%xmm0\n"
+            "1:\n"
+            "movntdq %%xmm0, (%[dst])\n"
+            "movntdq %%xmm0, 16(%[dst])\n"
+            "movntdq %%xmm0, 32(%[dst])\n"
+            "movntdq %%xmm0, 48(%[dst])\n"
+            "addq $64, %[dst]\n"
+            "decq %[blocks]\n"
+            "jnz 1b\n"
+            "sfence\n"  // Order non-temporal stores before later stores
+            : [dst]"+r"(dst), [blocks]"+r"(blocks)
+            : [value]"r"(value)
+            : "xmm0", "memory", "cc");
+        count %= 16;
+    }
+    while (count--) *dst++ = value;
+}
+
+// ==========================================================================
+// Copy <count> 32bit pixels, with SSE2 unaligned loads & non-temporal 
+//   stores to the 16 byte aligned middle of <dst> like arch_fill_span()
+// ==========================================================================
+void arch_copy_span(uint32_t *dst, const uint32_t *src, uint64_t count) {
+    while (count && ((uint64_t)dst & 15)) { *dst++ = *src++; count--; }
+
+    uint64_t blocks = count / 16;
+    if (blocks) {
+        __asm__ __volatile__ (
+            "1:\n"
+            "movdqu   (%[src]), %%xmm0\n"
+            "movdqu 16(%[src]), %%xmm1\n"
+            "movdqu 32(%[src]), %%xmm2\n"
+            "movdqu 48(%[src]), %%xmm3\n"
+            "movntdq %%xmm0,   (%[dst])\n"
+            "movntdq %%xmm1, 16(%[dst])\n"
+            "movntdq %%xmm2, 32(%[dst])\n"
+            "movntdq %%xmm3, 48(%[dst])\n"
+            "addq $64, %[src]\n"
+            "addq $64, %[dst]\n"
+            "decq %[blocks]\n"
+            "jnz 1b\n"
+            "sfence\n"
+            : [dst]"+r"(dst), [src]"+r"(src), [blocks]"+r"(blocks)
+            :
+            : "xmm0", "xmm1", "xmm2", "xmm3", "memory", "cc");
+        count %= 16;
+    }
+    while (count--) *dst++ = *src++;
+}
+
+// =====================================================================
+// Get page table entry bits for a cache type, using the PAT entries 
+//   from IA32_PAT_VALUE. Without PAT support, write combining falls back
+//   to UC- so that an MTRR WC setting for the range can still apply.
+// =====================================================================
+uint64_t page_cache_flags(MAP_CACHE_TYPE cache, bool large_page) {
+    static int pat_supported = -1;  // Check CPUID.01H:EDX bit 16 (PAT) only once
+    if (pat_supported < 0) {
+        uint32_t eax, ebx, ecx, edx;
+        cpuid(1, 0, &eax, &ebx, &ecx, &edx);
+        pat_supported = (edx >> 16) & 1;
+    }
+
+    switch (cache) {
+        case MAP_CACHE_WT: return WRITE_THROUGH;                    // PAT index 1
+        case MAP_CACHE_UC: return CACHE_DISABLE | WRITE_THROUGH;    // PAT index 3
+        case MAP_CACHE_WC: 
+            if (!pat_supported) return CACHE_DISABLE;               // PAT index 2, UC-
+            return large_page ? PAT_LARGE : PAT_4KIB;               // PAT index 4
+        case MAP_CACHE_WB: 
+        default:           return 0;                                // PAT index 0
+    }
+}
+
 // ===================================
 // Return example Task State Segment
 // ===================================
@@ -165,20 +712,105 @@ GDT example_gdt(TSS tss, uint64_t tss_address) {
     };
 }
 
-// ============================================================================
-// Set page tables & paging, do other arch specific settings, and call kernel
-// ============================================================================
-void arch_setup_and_call_kernel(Entry_Point entry, void *kernel_stack, uint32_t stack_size, 
-                                Kernel_Parms *kparms) {
-    TSS tss = example_tss();
-    uint64_t tss_address = (UINTN)&tss;
-    GDT gdt = example_gdt(tss, tss_address);
-    Descriptor_Register gdtr = {.limit = sizeof gdt - 1, .base = (uint64_t)&gdt}; 
-
-    // Set new page tables (CR3 = PML4) and GDT (lgdt && ltr), and call entry point with parms
+// ==========================================================================
+// Set up a CPU's own GDT & TSS in its arch_data page. The TSS uses the 
+//   CPU's stack for RSP0.
+// ==========================================================================
+void arch_init_cpu_tables(Boot_CPU *cpu) {
+    CPU_Tables *tables = cpu->arch_data;
+    tables->tss = example_tss();
+    tables->tss.RSP0_lower = cpu->stack_top & 0xFFFFFFFF;
+    tables->tss.RSP0_upper = cpu->stack_top >> 32;
+    tables->gdt = example_gdt(tables->tss, (uint64_t)&tables->tss);
+}
+
+// ==========================================================================
+// Detect & enable CPU features from CPUID: SSE, XSAVE with x87/SSE/AVX/
+//   AVX-512 state in XCR0, global pages, PCID, & FSGSBASE. Returns the 
+//   CPU_FEATURE_* bits enabled, and the bytes needed to save FPU/SIMD 
+//   state for them. CR4.PGE is cleared first, which flushes all TLB 
+//   entries including global ones e.g. left over from firmware.
+//   PCIDE needs long mode with CR3 bits 11:0 = 0, which is true here.
+// ==========================================================================
+uint64_t arch_enable_cpu_features(uint32_t *xsave_size) {
+    uint32_t eax, ebx, ecx, edx;
+    uint32_t max_leaf, ecx_1, edx_1, ebx_7 = 0;
+    uint64_t features = CPU_FEATURE_SSE;    // Always there in x86_64
+    uint64_t cr0, cr4;
+
+    cpuid(0, 0, &max_leaf, &ebx, &ecx, &edx);
+    cpuid(1, 0, &eax, &ebx, &ecx_1, &edx_1);
+    if (max_leaf >= 7) cpuid(7, 0, &eax, &ebx_7, &ecx, &edx);
+
+    __asm__ __volatile__ ("movq %%CR0, %0; movq %%CR4, %1" : "=r"(cr0), "=r"(cr4));
+    cr0 = (cr0 & ~(uint64_t)CR0_EM) | CR0_MP;
+    cr4 |= CR4_OSFXSR | CR4_OSXMMEXCPT;
+    __asm__ __volatile__ ("movq %0, %%CR0" : : "r"(cr0));
+    __asm__ __volatile__ ("movq %0, %%CR4" : : "r"(cr4 & ~(uint64_t)CR4_PGE) : "memory");
+
+    if (edx_1 & (1 << 13)) {
+        cr4 |= CR4_PGE;
+        features |= CPU_FEATURE_GLOBAL_PAGES;
+    }
+    if (ecx_1 & (1 << 17)) {
+        cr4 |= CR4_PCIDE;
+        features |= CPU_FEATURE_PCID;
+        if (ebx_7 & (1 << 10)) features |= CPU_FEATURE_INVPCID;
+    }
+    if (ebx_7 & (1 << 0)) {
+        cr4 |= CR4_FSGSBASE;
+        features |= CPU_FEATURE_FSGSBASE;
+    }
+    if (ecx_1 & (1 << 26)) cr4 |= CR4_OSXSAVE;
+    __asm__ __volatile__ ("movq %0, %%CR4" : : "r"(cr4) : "memory");
+
+    uint32_t size = 512;    // FXSAVE area
+    if ((ecx_1 & (1 << 26)) && max_leaf >= 0xD) {
+        // Enable all supported state components this code knows about; AVX-512 needs 
+        //   AVX state enabled too
+        uint32_t supported;
+        cpuid(0xD, 0, &supported, &ebx, &ecx, &edx);
+        uint64_t xcr0 = XCR0_X87 | XCR0_SSE;
+        features |= CPU_FEATURE_XSAVE;
+        if ((ecx_1 & (1 << 28)) && (supported & XCR0_AVX)) {
+            xcr0 |= XCR0_AVX;
+            features |= CPU_FEATURE_AVX;
+            if ((ebx_7 & (1 << 16)) && (supported & XCR0_AVX512) == XCR0_AVX512) {
+                xcr0 |= XCR0_AVX512;
+                features |= CPU_FEATURE_AVX512;
+            }
+        }
+        __asm__ __volatile__ ("xsetbv" : : "c"(0), "a"((uint32_t)xcr0), "d"((uint32_t)(xcr0 >> 32)));
+
+        cpuid(0xD, 0, &eax, &ebx, &ecx, &edx);  // EBX = size for features enabled in XCR0
+        size = ebx;
+    }
+
+    if (xsave_size) *xsave_size = size;
+    return features;
+}
+
+// ==========================================================================
+// Per CPU settings, run on each CPU with the kernel page tables loaded:
+//   enable CPU features, program PAT for write combining, and load the 
+//   CPU's GDT & TSS. Returns the CPU_FEATURE_* bits enabled.
+// ==========================================================================
+uint64_t arch_init_cpu(Boot_CPU *cpu, uint32_t *xsave_size) {
+    CPU_Tables *tables = cpu->arch_data;
+    Descriptor_Register gdtr = {.limit = sizeof tables->gdt - 1, .base = (uint64_t)&tables->gdt}; 
+
+    // Program PAT for write combining page mappings, if supported; caches are flushed first, 
+    //   and the TLB after by reloading CR3
+    uint32_t eax, ebx, ecx, edx;
+    cpuid(1, 0, &eax, &ebx, &ecx, &edx);
+    if (edx & (1 << 16)) {
+        __asm__ __volatile__ ("cli; wbinvd" : : : "memory");
+        wrmsr(IA32_PAT_MSR, IA32_PAT_VALUE);
+        __asm__ __volatile__ ("movq %%CR3, %%RAX; movq %%RAX, %%CR3" : : : "rax", "memory");
+    }
+
     __asm__ __volatile__(
         "cli\n"                     // Clear interrupts before setting new GDT/TSS, etc.
-        "movq %[pml4], %%CR3\n"     // Load new page tables
         "lgdt %[gdt]\n"             // Load new GDT from gdtr register
         "ltr %[tss]\n"              // Load new task register with new TSS value (byte offset into GDT)
 
@@ -196,86 +828,835 @@ void arch_setup_and_call_kernel(Entry_Point entry, void *kernel_stack, uint32_t
         "movq %%RAX, %%FS\n"    // Extra segment (2), these also have different uses in Long Mode
         "movq %%RAX, %%GS\n"    // Extra segment (3), these also have different uses in Long Mode
         "movq %%RAX, %%SS\n"    // Stack segment
+      :
+      : [gdt]"m"(gdtr), [tss]"r"((uint16_t)offsetof(GDT, tss))
+      : "rax", "memory");
 
-        // Set new stack value to use (for SP/stack pointer, etc.)
+    return arch_enable_cpu_features(xsave_size);
+}
+
+// ============================================================================
+// Set page tables & paging, do other arch specific settings, and call kernel
+//   on the BSP's stack
+// ============================================================================
+void arch_setup_and_call_kernel(Entry_Point entry, Boot_CPU *bsp, Kernel_Parms *kparms) {
+    // Set new page tables (CR3 = PML4), then the BSP's own GDT, TSS & CPU features
+    __asm__ __volatile__ ("cli; movq %0, %%CR3" : : "r"(pml4) : "memory");
+    kparms->cpu_features = arch_init_cpu(bsp, &kparms->xsave_size);
+
+    __asm__ __volatile__(
+        // Set new stack value to use (for SP/stack pointer, etc.); the top is the next CPU's
+        //   tables page, so reserve the MS ABI shadow space below it & keep 16 byte alignment
         "movq %[stack], %%RSP\n"
+        "andq $-16, %%RSP\n"
+        "subq $32, %%RSP\n"        // MS ABI shadow space
 
         // Call new entry point in higher memory
         "callq *%[entry]\n" // First parameter is kparms in RCX in input constraints below, for MS ABI
       :
-      : [pml4]"r"(pml4), [gdt]"m"(gdtr), [tss]"r"((uint16_t)offsetof(GDT, tss)),
-        [stack]"gm"((uint64_t)kernel_stack + stack_size),    // Top of newly allocated stack
-        [entry]"r"(entry), "c"(kparms)
-      : "rax", "memory");
+      : [stack]"r"(bsp->stack_top), [entry]"r"(entry), "c"(kparms)
+      : "memory");
+}
+
+// ============================================================================
+// Get the start & end of the AP trampoline code, and the offset of its 64 bit
+//   part. The code runs from a copy at the start of a page below 1MiB, with 
+//   CS = page >> 4 & IP = 0, and finds its data at AP_TRAMPOLINE_DATA_OFFSET:
+//   load temporary GDT, set CR4, CR3, EFER.LME & CR0.PG/PE from the BSP, 
+//   far jump to 64 bit code, then call entry(kparms, cpu) on the AP's stack
+// ============================================================================
+void ap_trampoline_code(uint8_t **start, uint8_t **end, uint8_t **long_mode) {
+    __asm__ __volatile__(
+        "leaq 1f(%%RIP), %[start]\n"
+        "leaq 2f(%%RIP), %[long_mode]\n"
+        "leaq 4f(%%RIP), %[end]\n"
+        "jmp 4f\n"
+
+        ".code16\n"
+        "1:\n"
+        "cli\n"
+        "cld\n"
+        "movw %%CS, %%AX\n"
+        "movw %%AX, %%DS\n"
+        "lgdtl %c[gdtr]\n"
+        "movl %c[cr4], %%EAX\n"
+        "movl %%EAX, %%CR4\n"
+        "movl %c[cr3], %%EAX\n"     // Page tables are below 4GiB
+        "movl %%EAX, %%CR3\n"
+        "movl $0xC0000080, %%ECX\n" // IA32_EFER
+        "movl %c[efer], %%EAX\n"
+        "xorl %%EDX, %%EDX\n"
+        "wrmsr\n"
+        "movl %c[cr0], %%EAX\n"     // Enables protected mode & paging together
+        "movl %%EAX, %%CR0\n"
+        "ljmpl *%c[far_jump]\n"
+
+        ".code64\n"
+        "2:\n"
+        "movw $0x10, %%AX\n"
+        "movw %%AX, %%DS\n"
+        "movw %%AX, %%ES\n"
+        "movw %%AX, %%FS\n"
+        "movw %%AX, %%GS\n"
+        "movw %%AX, %%SS\n"
+        "leaq 1b(%%RIP), %%RBX\n"   // Trampoline page
+        "movq %c[stack](%%RBX), %%RSP\n"
+        "movq %c[kparms](%%RBX), %%RCX\n"
+        "movq %c[cpu](%%RBX), %%RDX\n"
+        "movq %c[entry](%%RBX), %%RAX\n"
+        "lock incl %c[started](%%RBX)\n"   // BSP can reuse the data now
+        "subq $32, %%RSP\n"         // MS ABI shadow space
+        "callq *%%RAX\n"
+        "3:\n"
+        "cli\n"
+        "hlt\n"
+        "jmp 3b\n"
+        "4:\n"
+      : [start]"=r"(*start), [end]"=r"(*end), [long_mode]"=r"(*long_mode)
+      : [gdtr]"i"(AP_TRAMPOLINE_DATA_OFFSET + offsetof(AP_Trampoline_Data, gdtr_limit)),
+        [far_jump]"i"(AP_TRAMPOLINE_DATA_OFFSET + offsetof(AP_Trampoline_Data, long_mode_offset)),
+        [cr0]"i"(AP_TRAMPOLINE_DATA_OFFSET + offsetof(AP_Trampoline_Data, cr0)),
+        [cr3]"i"(AP_TRAMPOLINE_DATA_OFFSET + offsetof(AP_Trampoline_Data, cr3)),
+        [cr4]"i"(AP_TRAMPOLINE_DATA_OFFSET + offsetof(AP_Trampoline_Data, cr4)),
+        [efer]"i"(AP_TRAMPOLINE_DATA_OFFSET + offsetof(AP_Trampoline_Data, efer)),
+        [stack]"i"(AP_TRAMPOLINE_DATA_OFFSET + offsetof(AP_Trampoline_Data, stack)),
+        [kparms]"i"(AP_TRAMPOLINE_DATA_OFFSET + offsetof(AP_Trampoline_Data, kparms)),
+        [cpu]"i"(AP_TRAMPOLINE_DATA_OFFSET + offsetof(AP_Trampoline_Data, cpu)),
+        [entry]"i"(AP_TRAMPOLINE_DATA_OFFSET + offsetof(AP_Trampoline_Data, entry)),
+        [started]"i"(AP_TRAMPOLINE_DATA_OFFSET + offsetof(AP_Trampoline_Data, started))
+      : "memory");
+}
+
+// ============================================================================
+// Copy AP trampoline code into a page below 1MiB and set its temporary GDT &
+//   far jump. Returns false if the page can not be used for a SIPI vector.
+// ============================================================================
+bool arch_init_ap_trampoline(uint64_t trampoline) {
+    uint8_t *start, *end, *long_mode;
+    ap_trampoline_code(&start, &end, &long_mode);
+    if (trampoline >= 0x100000 || (trampoline & (PAGE_SIZE-1)) || 
+        (uint64_t)(end - start) > AP_TRAMPOLINE_DATA_OFFSET) 
+        return false;
+
+    memset((void *)trampoline, 0, PAGE_SIZE);
+    memcpy((void *)trampoline, start, end - start);
+
+    AP_Trampoline_Data *data = (AP_Trampoline_Data *)(trampoline + AP_TRAMPOLINE_DATA_OFFSET);
+    data->gdt[1]             = 0x00AF9A000000FFFF;  // Same selectors as example_gdt()
+    data->gdt[2]             = 0x00CF92000000FFFF;
+    data->gdtr_limit         = sizeof data->gdt - 1;
+    data->gdtr_base          = (uint32_t)(uint64_t)&data->gdt;
+    data->long_mode_offset   = (uint32_t)(trampoline + (long_mode - start));
+    data->long_mode_selector = 0x8;
+    return true;
+}
+
+// ============================================================================
+// Send an INIT or SIPI to a CPU through the local APIC, in x2APIC mode if the
+//   firmware enabled it
+// ============================================================================
+void send_ipi(uint64_t lapic_base, bool x2apic, uint64_t apic_id, uint32_t command) {
+    if (x2apic) {
+        wrmsr(X2APIC_ICR_MSR, (apic_id << 32) | command);
+        return;
+    }
+
+    volatile uint32_t *icr_low  = (uint32_t *)(lapic_base + LAPIC_ICR_LOW);
+    volatile uint32_t *icr_high = (uint32_t *)(lapic_base + LAPIC_ICR_HIGH);
+    *icr_high = (uint32_t)apic_id << 24;
+    *icr_low  = command;
+    for (uint32_t i = 0; i < 1000 && (*icr_low & LAPIC_ICR_PENDING); i++) io_delay();
+}
+
+// ============================================================================
+// Start APs from kparms->cpus one at a time with INIT-SIPI-SIPI, each calling
+//   entry(kparms, cpu) on its own stack with the current page tables. The low 
+//   memory identity mapping for the trampoline must still be in place.
+//   Returns the number of APs started.
+// ============================================================================
+uint32_t arch_start_aps(Kernel_Parms *kparms, AP_Entry_Point entry) {
+    if (!kparms->ap_trampoline || kparms->cpu_count < 2) return 0;
+
+    AP_Trampoline_Data *data = (AP_Trampoline_Data *)(kparms->ap_trampoline + AP_TRAMPOLINE_DATA_OFFSET);
+    uint64_t cr0, cr3, cr4;
+    __asm__ __volatile__ ("movq %%CR0, %0; movq %%CR3, %1; movq %%CR4, %2" 
+                          : "=r"(cr0), "=r"(cr3), "=r"(cr4));
+    data->cr0    = cr0;
+    data->cr3    = cr3;
+    data->cr4    = cr4 & ~(1ULL << 17);                 // PCIDE can only be set in long mode
+    data->efer   = rdmsr(IA32_EFER_MSR) & 0x901;        // SCE, LME, NXE
+    data->entry  = (uint64_t)entry;
+    data->kparms = (uint64_t)kparms;
+
+    bool x2apic = rdmsr(IA32_APIC_BASE_MSR) & APIC_BASE_X2APIC;
+    uint64_t vector = kparms->ap_trampoline >> 12;
+    uint32_t started = 0;
+
+    for (UINTN i = 0; i < kparms->cpu_count; i++) {
+        Boot_CPU *cpu = &kparms->cpus[i];
+        if (cpu->flags & BOOT_CPU_BSP) continue;
+
+        data->stack = cpu->stack_top;
+        data->cpu   = (uint64_t)cpu;
+        uint32_t count = data->started;
+        __asm__ __volatile__ ("mfence" : : : "memory");
+
+        // INIT, wait 10ms, then up to 2 SIPIs; wait 200us for the first and 100ms for the second
+        send_ipi(kparms->interrupt_controller_base, x2apic, cpu->hw_id, ICR_INIT);
+        for (uint32_t j = 0; j < 10000; j++) io_delay();
+
+        for (uint32_t sipi = 0; sipi < 2 && data->started == count; sipi++) {
+            send_ipi(kparms->interrupt_controller_base, x2apic, cpu->hw_id, ICR_STARTUP | vector);
+            for (uint32_t j = 0; j < (sipi == 0 ? 200 : 100000) && data->started == count; j++) 
+                io_delay();
+        }
+
+        if (data->started != count) {
+            cpu->flags |= BOOT_CPU_STARTED;
+            started++;
+        }
+    }
+    return started;
+}
+
+// ====================================================================
+// Get a zeroed page for a new page table
+// ====================================================================
+Page_Table *alloc_page_table(Page_Allocator *allocator) {
+    Page_Table *table = page_alloc(allocator, 1, 1);
+    if (table) memset(table, 0, sizeof *table);
+    return table;
+}
+
+// ============================================================
+// Get next level table from a table entry, allocating it if 
+//   the entry is empty. Returns NULL if out of memory.
+// ============================================================
+Page_Table *next_page_table(Page_Table *table, uint64_t index, Page_Allocator *allocator) {
+    if (!(table->entries[index] & PRESENT)) {
+        Page_Table *new_table = alloc_page_table(allocator);
+        if (!new_table) return NULL;
+        table->entries[index] = (uint64_t)new_table | PRESENT | READWRITE | USER;
+    }
+    return (Page_Table *)(table->entries[index] & PHYS_PAGE_ADDR_MASK);
+}
+
+// ======================================================================
+// Map a virtual address range to a physical address range, using the 
+//   largest pages that alignment and size allow; 1GiB pages if the CPU 
+//   supports them, then 2MiB pages, then 4KiB pages.
+//   Each table is walked to once, and consecutive entries in it are 
+//   filled in a single pass. Already mapped pages are left as is.
+// ======================================================================
+void arch_map_range(uint64_t physical_address, uint64_t virtual_address, uint64_t size, 
+                    MAP_CACHE_TYPE cache, Page_Allocator *allocator) {
+    uint64_t flags = PRESENT | READWRITE | USER;   // 0b111
+    if (cache & MAP_GLOBAL) flags |= GLOBAL;
+    cache &= ~MAP_GLOBAL;
+    uint64_t flags_4kib  = flags | page_cache_flags(cache, false);
+    uint64_t flags_large = flags | page_cache_flags(cache, true) | LARGE_PAGE;
+    size = (size + (PAGE_SIZE-1)) & ~(uint64_t)(PAGE_SIZE-1);
+
+    // Move to next page of <page_size>, or next page boundary if not aligned
+    #define NEXT_PAGE(page_size) { \
+        uint64_t step = (page_size) - (virtual_address & ((page_size)-1)); \
+        if (step > size) step = size; \
+        physical_address += step; \
+        virtual_address  += step; \
+        size             -= step; \
+    }
+
+    while (size > 0) {
+        Page_Table *pdpt = next_page_table(pml4, (virtual_address >> 39) & 0x1FF, allocator);
+        if (!pdpt) return;
+
+        for (uint64_t pdpt_index = (virtual_address >> 30) & 0x1FF; pdpt_index < 512 && size > 0; pdpt_index++) {
+            uint64_t *pdpt_entry = &pdpt->entries[pdpt_index];
+            if (gib_pages_supported && !(*pdpt_entry & PRESENT) && size >= PAGE_SIZE_1GIB &&
+                !((physical_address | virtual_address) & (PAGE_SIZE_1GIB-1))) {
+                *pdpt_entry = (physical_address & PHYS_PAGE_ADDR_MASK) | flags_large;
+                NEXT_PAGE(PAGE_SIZE_1GIB);
+                continue;
+            }
+            if (*pdpt_entry & LARGE_PAGE) {
+                // Already mapped by a 1GiB page
+                if (((*pdpt_entry & PHYS_PAGE_ADDR_MASK & ~(PAGE_SIZE_1GIB-1)) | 
+                     (virtual_address & (PAGE_SIZE_1GIB-1))) != physical_address)
+                    page_map_conflicts++;
+                NEXT_PAGE(PAGE_SIZE_1GIB);
+                continue;
+            }
+
+            Page_Table *pdt = next_page_table(pdpt, pdpt_index, allocator);
+            if (!pdt) return;
+
+            for (uint64_t pdt_index = (virtual_address >> 21) & 0x1FF; pdt_index < 512 && size > 0; pdt_index++) {
+                uint64_t *pdt_entry = &pdt->entries[pdt_index];
+                if (!(*pdt_entry & PRESENT) && size >= PAGE_SIZE_2MIB &&
+                    !((physical_address | virtual_address) & (PAGE_SIZE_2MIB-1))) {
+                    *pdt_entry = (physical_address & PHYS_PAGE_ADDR_MASK) | flags_large;
+                    NEXT_PAGE(PAGE_SIZE_2MIB);
+                    continue;
+                }
+                if (*pdt_entry & LARGE_PAGE) {
+                    // Already mapped by a 2MiB page
+                    if (((*pdt_entry & PHYS_PAGE_ADDR_MASK & ~(PAGE_SIZE_2MIB-1)) | 
+                         (virtual_address & (PAGE_SIZE_2MIB-1))) != physical_address)
+                        page_map_conflicts++;
+                    NEXT_PAGE(PAGE_SIZE_2MIB);
+                    continue;
+                }
+
+                Page_Table *pt = next_page_table(pdt, pdt_index, allocator);
+                if (!pt) return;
+
+                // Fill in consecutive 4KiB pages for the rest of this page table
+                for (uint64_t pt_index = (virtual_address >> 12) & 0x1FF; pt_index < 512 && size > 0; pt_index++) {
+                    uint64_t *pt_entry = &pt->entries[pt_index];
+                    if (!(*pt_entry & PRESENT)) 
+                        *pt_entry = (physical_address & PHYS_PAGE_ADDR_MASK) | flags_4kib;
+                    else if ((*pt_entry & PHYS_PAGE_ADDR_MASK) != (physical_address & PHYS_PAGE_ADDR_MASK))
+                        page_map_conflicts++;   // Already mapped to another address
+                    NEXT_PAGE(PAGE_SIZE);
+                }
+            }
+        }
+    }
+    #undef NEXT_PAGE
 }
 
 // ==================================================================
 // Map a virtual address to a physical address for a page of memory
 // ==================================================================
-void arch_map_page(uint64_t physical_address, uint64_t virtual_address, Memory_Map_Info *mmap) {
-    int flags = PRESENT | READWRITE | USER;   // 0b111
+void arch_map_page(uint64_t physical_address, uint64_t virtual_address, Page_Allocator *allocator) {
+    arch_map_range(physical_address, virtual_address, PAGE_SIZE, MAP_CACHE_WB, allocator);
+}
+
+// =====================================================================
+// Split a 1GiB or 2MiB page entry into a new table of 512 pages of the
+//   next smaller size, mapping the same memory. Returns false if out 
+//   of memory.
+// =====================================================================
+bool split_large_page(uint64_t *entry, uint64_t page_size, Page_Allocator *allocator) {
+    Page_Table *table = alloc_page_table(allocator);
+    if (!table) return false;
+
+    uint64_t physical_address = *entry & PHYS_PAGE_ADDR_MASK & ~(page_size-1);
+    uint64_t flags = (*entry & ~PHYS_PAGE_ADDR_MASK) | (*entry & PAT_LARGE);
+    uint64_t new_page_size = page_size / 512;
+    if (new_page_size == PAGE_SIZE) {
+        // PTEs have no PS bit, and the PAT bit moves down to bit 7
+        flags &= ~(uint64_t)(LARGE_PAGE | PAT_LARGE);
+        if (*entry & PAT_LARGE) flags |= PAT_4KIB;
+    }
 
-    uint64_t pml4_index = ((virtual_address) >> 39) & 0x1FF;   // 0-511
-    uint64_t pdpt_index = ((virtual_address) >> 30) & 0x1FF;   // 0-511
-    uint64_t pdt_index  = ((virtual_address) >> 21) & 0x1FF;   // 0-511
-    uint64_t pt_index   = ((virtual_address) >> 12) & 0x1FF;   // 0-511
+    for (uint64_t i = 0; i < 512; i++) 
+        table->entries[i] = (physical_address + (i * new_page_size)) | flags;
 
-    // Make sure pdpt exists, if not then allocate it
-    if (!(pml4->entries[pml4_index] & PRESENT)) {
-        void *pdpt_address = mmap_allocate_pages(mmap, 1);
+    *entry = (uint64_t)table | PRESENT | READWRITE | USER;
+    return true;
+}
+
+// ========================================================================
+// If a page table has no entries left, unlink it from its parent entry 
+//   and free it
+// ========================================================================
+void reclaim_page_table(uint64_t *parent_entry, Page_Allocator *allocator) {
+    Page_Table *table = (Page_Table *)(*parent_entry & PHYS_PAGE_ADDR_MASK);
+    for (uint64_t i = 0; i < 512; i++)
+        if (table->entries[i]) return;  
+
+    *parent_entry = 0;
+    page_free(allocator, table, 1);
+}
+
+// ============================================================================
+// Unmap a virtual address range. Large pages only partly in the range are 
+//   split first. Tables left empty are freed, and TLB entries are flushed 
+//   once at the end: invlpg per unmapped page, or a CR3 reload for large ranges
+// ============================================================================
+void arch_unmap_range(uint64_t virtual_address, uint64_t size, Page_Allocator *allocator) {
+    uint64_t flush_addresses[TLB_FLUSH_THRESHOLD];  // Unmapped pages to invlpg
+    uint64_t num_flushes = 0;
+    bool unmapped_global = false;   // A CR3 reload does not flush global pages
+    uint64_t cr3 = 0;
+    size = (size + (PAGE_SIZE-1)) & ~(uint64_t)(PAGE_SIZE-1);
+
+    // Move to next page of <page_size>, or next page boundary if not aligned
+    #define NEXT_PAGE(page_size) { \
+        uint64_t step = (page_size) - (virtual_address & ((page_size)-1)); \
+        if (step > size) step = size; \
+        virtual_address += step; \
+        size            -= step; \
+    }
 
-        memset(pdpt_address, 0, sizeof(Page_Table));
-        pml4->entries[pml4_index] = (uint64_t)pdpt_address | flags;  
+    // Clear a page entry and add page to TLB flush list
+    #define UNMAP_PAGE(entry, page_size) { \
+        if (*(entry) & GLOBAL) unmapped_global = true; \
+        *(entry) = 0; \
+        if (num_flushes < TLB_FLUSH_THRESHOLD) flush_addresses[num_flushes] = virtual_address; \
+        num_flushes++; \
+        NEXT_PAGE(page_size); \
     }
 
-    // Make sure pdt exists, if not then allocate it
-    Page_Table *pdpt = (Page_Table *)(pml4->entries[pml4_index] & PHYS_PAGE_ADDR_MASK);
-    if (!(pdpt->entries[pdpt_index] & PRESENT)) {
-        void *pdt_address = mmap_allocate_pages(mmap, 1);
+    while (size > 0) {
+        uint64_t *pml4_entry = &pml4->entries[(virtual_address >> 39) & 0x1FF];
+        if (!(*pml4_entry & PRESENT)) {
+            NEXT_PAGE(512ULL * PAGE_SIZE_1GIB);    // Nothing mapped in this 512GiB
+            continue;
+        }
+
+        Page_Table *pdpt = (Page_Table *)(*pml4_entry & PHYS_PAGE_ADDR_MASK);
+        for (uint64_t pdpt_index = (virtual_address >> 30) & 0x1FF; pdpt_index < 512 && size > 0; pdpt_index++) {
+            uint64_t *pdpt_entry = &pdpt->entries[pdpt_index];
+            if (!(*pdpt_entry & PRESENT)) {
+                NEXT_PAGE(PAGE_SIZE_1GIB);
+                continue;
+            }
+            if (*pdpt_entry & LARGE_PAGE) {
+                if (!(virtual_address & (PAGE_SIZE_1GIB-1)) && size >= PAGE_SIZE_1GIB) {
+                    UNMAP_PAGE(pdpt_entry, PAGE_SIZE_1GIB);
+                    continue;
+                }
+                if (!split_large_page(pdpt_entry, PAGE_SIZE_1GIB, allocator)) goto flush;
+            }
+
+            Page_Table *pdt = (Page_Table *)(*pdpt_entry & PHYS_PAGE_ADDR_MASK);
+            for (uint64_t pdt_index = (virtual_address >> 21) & 0x1FF; pdt_index < 512 && size > 0; pdt_index++) {
+                uint64_t *pdt_entry = &pdt->entries[pdt_index];
+                if (!(*pdt_entry & PRESENT)) {
+                    NEXT_PAGE(PAGE_SIZE_2MIB);
+                    continue;
+                }
+                if (*pdt_entry & LARGE_PAGE) {
+                    if (!(virtual_address & (PAGE_SIZE_2MIB-1)) && size >= PAGE_SIZE_2MIB) {
+                        UNMAP_PAGE(pdt_entry, PAGE_SIZE_2MIB);
+                        continue;
+                    }
+                    if (!split_large_page(pdt_entry, PAGE_SIZE_2MIB, allocator)) goto flush;
+                }
 
-        memset(pdt_address, 0, sizeof(Page_Table));
-        pdpt->entries[pdpt_index] = (uint64_t)pdt_address | flags;  
+                Page_Table *pt = (Page_Table *)(*pdt_entry & PHYS_PAGE_ADDR_MASK);
+                for (uint64_t pt_index = (virtual_address >> 12) & 0x1FF; pt_index < 512 && size > 0; pt_index++) {
+                    if (pt->entries[pt_index] & PRESENT) {
+                        UNMAP_PAGE(&pt->entries[pt_index], PAGE_SIZE);
+                    } else {
+                        NEXT_PAGE(PAGE_SIZE);
+                    }
+                }
+                reclaim_page_table(pdt_entry, allocator);
+            }
+            reclaim_page_table(pdpt_entry, allocator);
+        }
+        reclaim_page_table(pml4_entry, allocator);
     }
+    #undef UNMAP_PAGE
+    #undef NEXT_PAGE
+
+    flush:
+    // Only flush the TLB if these page tables are the active ones
+    __asm__ __volatile__ ("movq %%CR3, %0" : "=r"(cr3));
+    if ((cr3 & PHYS_PAGE_ADDR_MASK) != (uint64_t)pml4) return;
+
+    uint64_t cr4 = 0;
+    __asm__ __volatile__ ("movq %%CR4, %0" : "=r"(cr4));
+    if (num_flushes > TLB_FLUSH_THRESHOLD && unmapped_global && (cr4 & CR4_PGE)) {
+        // Too many single page flushes, and some were global; toggling CR4.PGE flushes all 
+        //   TLB entries including global ones
+        __asm__ __volatile__ ("movq %0, %%CR4; movq %1, %%CR4" 
+                              : : "r"(cr4 & ~(uint64_t)CR4_PGE), "r"(cr4) : "memory");
+    } else if (num_flushes > TLB_FLUSH_THRESHOLD) {
+        // Too many single page flushes, flush all non global TLB entries instead
+        __asm__ __volatile__ ("movq %0, %%CR3" : : "r"(cr3) : "memory");
+    } else {
+        for (uint64_t i = 0; i < num_flushes; i++)
+            __asm__ __volatile__ ("invlpg (%0)" : : "r"(flush_addresses[i]) : "memory");
+    }
+}
+
+// ==============================================================================
+// Change cache type of already mapped pages in the active page tables, e.g. to
+//   compare framebuffer write performance. Large pages are changed as a whole.
+// ==============================================================================
+void arch_set_cache_type(uint64_t virtual_address, uint64_t size, MAP_CACHE_TYPE cache) {
+    uint64_t cr3 = 0;
+    __asm__ __volatile__ ("movq %%CR3, %0" : "=r"(cr3));
+    Page_Table *root = (Page_Table *)(cr3 & PHYS_PAGE_ADDR_MASK);
 
-    // Make sure pt exists, if not then allocate it
-    Page_Table *pdt = (Page_Table *)(pdpt->entries[pdpt_index] & PHYS_PAGE_ADDR_MASK);
-    if (!(pdt->entries[pdt_index] & PRESENT)) {
-        void *pt_address = mmap_allocate_pages(mmap, 1);
+    const uint64_t cache_mask_4kib  = WRITE_THROUGH | CACHE_DISABLE | PAT_4KIB;
+    const uint64_t cache_mask_large = WRITE_THROUGH | CACHE_DISABLE | PAT_LARGE;
+    uint64_t flags_4kib  = page_cache_flags(cache, false);
+    uint64_t flags_large = page_cache_flags(cache, true);
 
-        memset(pt_address, 0, sizeof(Page_Table));
-        pdt->entries[pdt_index] = (uint64_t)pt_address | flags;  
+    for (uint64_t end = virtual_address + size; virtual_address < end; ) {
+        uint64_t *entry = &root->entries[(virtual_address >> 39) & 0x1FF];
+        if (!(*entry & PRESENT)) break;
+
+        Page_Table *pdpt = (Page_Table *)(*entry & PHYS_PAGE_ADDR_MASK);
+        entry = &pdpt->entries[(virtual_address >> 30) & 0x1FF];
+        if (!(*entry & PRESENT)) break;
+        if (*entry & LARGE_PAGE) {
+            *entry = (*entry & ~cache_mask_large) | flags_large;
+            virtual_address = (virtual_address + PAGE_SIZE_1GIB) & ~(uint64_t)(PAGE_SIZE_1GIB-1);
+            continue;
+        }
+
+        Page_Table *pdt = (Page_Table *)(*entry & PHYS_PAGE_ADDR_MASK);
+        entry = &pdt->entries[(virtual_address >> 21) & 0x1FF];
+        if (!(*entry & PRESENT)) break;
+        if (*entry & LARGE_PAGE) {
+            *entry = (*entry & ~cache_mask_large) | flags_large;
+            virtual_address = (virtual_address + PAGE_SIZE_2MIB) & ~(uint64_t)(PAGE_SIZE_2MIB-1);
+            continue;
+        }
+
+        Page_Table *pt = (Page_Table *)(*entry & PHYS_PAGE_ADDR_MASK);
+        entry = &pt->entries[(virtual_address >> 12) & 0x1FF];
+        if (*entry & PRESENT) *entry = (*entry & ~cache_mask_4kib) | flags_4kib;
+        virtual_address = (virtual_address + PAGE_SIZE) & ~(uint64_t)(PAGE_SIZE-1);
     }
 
-    // Map new page physical address if not present
-    Page_Table *pt = (Page_Table *)(pdt->entries[pdt_index] & PHYS_PAGE_ADDR_MASK);
-    if (!(pt->entries[pt_index] & PRESENT)) 
-        pt->entries[pt_index] = (physical_address & PHYS_PAGE_ADDR_MASK) | flags;
+    // Flush caches and the TLB for the new memory type to take effect
+    __asm__ __volatile__ ("wbinvd; movq %0, %%CR3" : : "r"(cr3) : "memory");
 }
 
 // ==============================
 // Unmap a page/virtual address 
 // ==============================
-void arch_unmap_page(UINTN virtual_address) {
-    uint64_t pml4_index = ((virtual_address) >> 39) & 0x1FF;   // 0-511
-    uint64_t pdpt_index = ((virtual_address) >> 30) & 0x1FF;   // 0-511
-    uint64_t pdt_index  = ((virtual_address) >> 21) & 0x1FF;   // 0-511
-    uint64_t pt_index   = ((virtual_address) >> 12) & 0x1FF;   // 0-511
-
-    Page_Table *pdpt = (Page_Table *)(pml4->entries[pml4_index] & PHYS_PAGE_ADDR_MASK);
-    Page_Table *pdt = (Page_Table *)(pdpt->entries[pdpt_index] & PHYS_PAGE_ADDR_MASK);
-    Page_Table *pt = (Page_Table *)(pdt->entries[pdt_index] & PHYS_PAGE_ADDR_MASK);
-
-    pt->entries[pt_index] = 0;  // Clear page in page table to unmap the physical address there
-
-    // Flush the TLB cache for this page
-    __asm__ ("invlpg (%0)\n" : : "r"(virtual_address));
+void arch_unmap_page(uint64_t virtual_address, Page_Allocator *allocator) {
+    arch_unmap_range(virtual_address, PAGE_SIZE, allocator);
 }
 
 // =============================================================
 // Initialize page tables by setting up new level 4 page table
 // =============================================================
-void arch_init_page_tables(Memory_Map_Info *mmap) {
-    pml4 = mmap_allocate_pages(mmap, 1);
-    memset(pml4, 0, sizeof *pml4);  
+void arch_init_page_tables(Page_Allocator *allocator) {
+    pml4 = alloc_page_table(allocator);
+
+    // Check for 1GiB page support: CPUID 0x80000001 EDX bit 26 (Page1GB)
+    uint32_t eax, ebx, ecx, edx;
+    cpuid(0x80000000, 0, &eax, &ebx, &ecx, &edx);
+    if (eax >= 0x80000001) {
+        cpuid(0x80000001, 0, &eax, &ebx, &ecx, &edx);
+        gib_pages_supported = edx & (1 << 26);
+    }
+}
+
+// ===================================================================
+// Get cache type of a leaf page table entry, from its PAT index and
+//   the IA32_PAT_VALUE entries; UC- is reported as uncached
+// ===================================================================
+MAP_CACHE_TYPE page_entry_cache(uint64_t entry, bool large_page) {
+    const MAP_CACHE_TYPE pat_types[8] = {
+        MAP_CACHE_WB, MAP_CACHE_WT, MAP_CACHE_UC, MAP_CACHE_UC,
+        MAP_CACHE_WC, MAP_CACHE_WT, MAP_CACHE_UC, MAP_CACHE_UC,
+    };
+    uint64_t index = ((entry & WRITE_THROUGH) ? 1 : 0) | ((entry & CACHE_DISABLE) ? 2 : 0) |
+                     ((entry & (large_page ? PAT_LARGE : PAT_4KIB)) ? 4 : 0);
+    MAP_CACHE_TYPE cache = pat_types[index];
+    if (entry & GLOBAL) cache |= MAP_GLOBAL;
+    return cache;
+}
+
+// ==============================================================================
+// Walk the page tables being built (or the active ones if none), and fill in
+//   table counts, mapped pages & cache types, and inconsistencies. The summary 
+//   goes to serial, and with <dump> set, every contiguous run of mappings.
+// ==============================================================================
+void arch_dump_page_tables(Page_Table_Stats *stats, bool dump) {
+    Page_Table *root = pml4;
+    if (!root) {
+        uint64_t cr3 = 0;
+        __asm__ __volatile__ ("movq %%CR3, %0" : "=r"(cr3));
+        root = (Page_Table *)(cr3 & PHYS_PAGE_ADDR_MASK);
+    }
+
+    page_table_walk_begin(stats, dump);
+    stats->tables[0] = 1;
+
+    for (uint64_t pml4_index = 0; pml4_index < 512; pml4_index++) {
+        uint64_t pml4_entry = root->entries[pml4_index];
+        if (!(pml4_entry & PRESENT)) continue;
+
+        // Upper half addresses are sign extended from bit 47
+        uint64_t virtual_base = pml4_index << 39;
+        if (pml4_index >= 256) virtual_base |= 0xFFFF000000000000ULL;
+
+        Page_Table *pdpt = (Page_Table *)(pml4_entry & PHYS_PAGE_ADDR_MASK);
+        stats->tables[1]++;
+        for (uint64_t pdpt_index = 0; pdpt_index < 512; pdpt_index++) {
+            uint64_t pdpt_entry = pdpt->entries[pdpt_index];
+            if (!(pdpt_entry & PRESENT)) continue;
+
+            uint64_t pdpt_virtual = virtual_base + (pdpt_index << 30);
+            if (pdpt_entry & LARGE_PAGE) {
+                uint64_t physical = pdpt_entry & PHYS_PAGE_ADDR_MASK & ~(uint64_t)PAT_LARGE;
+                if (physical & (PAGE_SIZE_1GIB-1)) stats->misaligned++;
+                page_table_walk_leaf(pdpt_virtual, physical & ~(uint64_t)(PAGE_SIZE_1GIB-1), 2,
+                                     page_entry_cache(pdpt_entry, true));
+                continue;
+            }
+
+            Page_Table *pdt = (Page_Table *)(pdpt_entry & PHYS_PAGE_ADDR_MASK);
+            stats->tables[2]++;
+            for (uint64_t pdt_index = 0; pdt_index < 512; pdt_index++) {
+                uint64_t pdt_entry = pdt->entries[pdt_index];
+                if (!(pdt_entry & PRESENT)) continue;
+
+                uint64_t pdt_virtual = pdpt_virtual + (pdt_index << 21);
+                if (pdt_entry & LARGE_PAGE) {
+                    uint64_t physical = pdt_entry & PHYS_PAGE_ADDR_MASK & ~(uint64_t)PAT_LARGE;
+                    if (physical & (PAGE_SIZE_2MIB-1)) stats->misaligned++;
+                    page_table_walk_leaf(pdt_virtual, physical & ~(uint64_t)(PAGE_SIZE_2MIB-1), 1,
+                                         page_entry_cache(pdt_entry, true));
+                    continue;
+                }
+
+                Page_Table *pt = (Page_Table *)(pdt_entry & PHYS_PAGE_ADDR_MASK);
+                stats->tables[3]++;
+                for (uint64_t pt_index = 0; pt_index < 512; pt_index++) {
+                    uint64_t pt_entry = pt->entries[pt_index];
+                    if (!(pt_entry & PRESENT)) continue;
+
+                    page_table_walk_leaf(pdt_virtual + (pt_index << 12), 
+                                         pt_entry & PHYS_PAGE_ADDR_MASK, 0,
+                                         page_entry_cache(pt_entry, false));
+                }
+            }
+        }
+    }
+
+    page_table_walk_end();
+}
+
+// ====================================================================
+// Interrupt enable/disable & wait. arch_disable_interrupts() returns 
+//   whether interrupts were enabled, for arch_restore_interrupts().
+//   arch_wait_for_interrupt() enables interrupts and halts until one 
+//   arrives; "sti" delays interrupts by 1 instruction, so one that is 
+//   already pending is not missed before "hlt".
+// ====================================================================
+void arch_enable_interrupts(void) {
+    __asm__ __volatile__ ("sti" : : : "memory");
+}
+
+bool arch_disable_interrupts(void) {
+    uint64_t rflags;
+    __asm__ __volatile__ ("pushfq; popq %0; cli" : "=r"(rflags) : : "memory");
+    return rflags & (1 << 9);   // IF
+}
+
+void arch_restore_interrupts(bool enabled) {
+    if (enabled) arch_enable_interrupts();
+}
+
+void arch_wait_for_interrupt(void) {
+    __asm__ __volatile__ ("sti; hlt" : : : "memory");
+}
+
+// ====================================================================
+// Read/write a local APIC register, as MSR in x2APIC mode
+// ====================================================================
+uint32_t lapic_read(uint32_t reg) {
+    if (lapic_x2apic) return rdmsr(0x800 + (reg >> 4));
+    return *(volatile uint32_t *)(lapic_base + reg);
+}
+
+void lapic_write(uint32_t reg, uint32_t value) {
+    if (lapic_x2apic) wrmsr(0x800 + (reg >> 4), value);
+    else *(volatile uint32_t *)(lapic_base + reg) = value;
+}
+
+// ====================================================================
+// Called from the interrupt stubs with the saved registers. Unhandled 
+//   exceptions halt the CPU; other unhandled vectors are ignored.
+//   Interrupts from the local APIC get an EOI after the handler.
+// ====================================================================
+__attribute__((sysv_abi)) void interrupt_dispatch(Interrupt_Frame *frame) {
+    Interrupt_Handler handler = interrupt_handlers[frame->vector & 0xFF];
+    if (handler) handler(frame);
+    else if (frame->vector < 32) while (true) arch_cpu_halt();
+
+    if (frame->vector >= 32 && frame->vector != SPURIOUS_VECTOR && (lapic_x2apic || lapic_base))
+        lapic_write(LAPIC_EOI, 0);
+}
+
+// ====================================================================
+// Get interrupt stubs: 256 stubs of 16 bytes each, one per vector. Each
+//   pushes a 0 error code if the CPU does not push one, and the vector, 
+//   then saves registers & FPU/SSE state and calls interrupt_dispatch()
+//   with a 16 byte aligned stack.
+// ====================================================================
+uint8_t *interrupt_stubs(void) {
+    uint8_t *stubs;
+    __asm__ __volatile__(
+        "leaq 1f(%%RIP), %[stubs]\n"
+        "jmp 3f\n"
+
+        ".balign 16\n"
+        "1:\n"
+        ".set isr_vector, 0\n"
+        ".rept 256\n"
+        ".balign 16\n"
+        // Exceptions with an error code: #DF, #TS, #NP, #SS, #GP, #PF, #AC, #CP, #VC, #SX
+        ".if (isr_vector == 8) || (isr_vector >= 10 && isr_vector <= 14) || (isr_vector == 17) || "
+            "(isr_vector == 21) || (isr_vector == 29) || (isr_vector == 30)\n"
+        ".else\n"
+        "pushq $0\n"
+        ".endif\n"
+        "pushq $isr_vector\n"
+        "jmp 2f\n"
+        ".set isr_vector, isr_vector + 1\n"
+        ".endr\n"
+
+        "2:\n"
+        "pushq %%RAX\n"
+        "pushq %%RBX\n"
+        "pushq %%RCX\n"
+        "pushq %%RDX\n"
+        "pushq %%RSI\n"
+        "pushq %%RDI\n"
+        "pushq %%RBP\n"
+        "pushq %%R8\n"
+        "pushq %%R9\n"
+        "pushq %%R10\n"
+        "pushq %%R11\n"
+        "pushq %%R12\n"
+        "pushq %%R13\n"
+        "pushq %%R14\n"
+        "pushq %%R15\n"
+        "cld\n"
+        "movq %%RSP, %%RDI\n"       // Interrupt_Frame
+        "movq %%RSP, %%RBP\n"       // Callee saved, to restore stack after
+        "andq $-16, %%RSP\n"
+        "subq $512, %%RSP\n"
+        "fxsave64 (%%RSP)\n"
+        "callq %P[dispatch]\n"
+        "fxrstor64 (%%RSP)\n"
+        "movq %%RBP, %%RSP\n"
+        "popq %%R15\n"
+        "popq %%R14\n"
+        "popq %%R13\n"
+        "popq %%R12\n"
+        "popq %%R11\n"
+        "popq %%R10\n"
+        "popq %%R9\n"
+        "popq %%R8\n"
+        "popq %%RBP\n"
+        "popq %%RDI\n"
+        "popq %%RSI\n"
+        "popq %%RDX\n"
+        "popq %%RCX\n"
+        "popq %%RBX\n"
+        "popq %%RAX\n"
+        "addq $16, %%RSP\n"         // Vector & error code
+        "iretq\n"
+        "3:\n"
+      : [stubs]"=r"(stubs)
+      : [dispatch]"i"(interrupt_dispatch)
+      : "memory");
+    return stubs;
+}
+
+// ====================================================================
+// Set a handler for an interrupt vector, NULL to remove it
+// ====================================================================
+void arch_set_interrupt_handler(uint8_t vector, Interrupt_Handler handler) {
+    interrupt_handlers[vector] = handler;
+}
+
+// ====================================================================
+// Fill & load the IDT, on each CPU. The legacy PICs are masked, as
+//   firmware can leave their timer interrupt enabled.
+//   Returns true, interrupts can be enabled after this.
+// ====================================================================
+bool arch_init_interrupts(void) {
+    if (!idt[0].type_attributes) {
+        uint8_t *stubs = interrupt_stubs();
+        for (uint64_t i = 0; i < 256; i++) {
+            uint64_t stub = (uint64_t)stubs + (i * 16);
+            idt[i] = (IDT_Entry){
+                .offset_15_0     = stub & 0xFFFF,
+                .selector        = 0x8,     // 64 bit kernel code segment
+                .type_attributes = 0x8E,
+                .offset_31_16    = (stub >> 16) & 0xFFFF,
+                .offset_63_32    = stub >> 32,
+            };
+        }
+
+        outb(0x21, 0xFF);
+        outb(0xA1, 0xFF);
+    }
+
+    Descriptor_Register idtr = {.limit = sizeof idt - 1, .base = (uint64_t)idt};
+    __asm__ __volatile__ ("lidt %0" : : "m"(idtr));
+    return true;
+}
+
+// ====================================================================
+// Enable the local APIC, in x2APIC mode if supported, and set up a 
+//   one-shot timer calling handler: TSC-deadline mode if supported, 
+//   else a LAPIC count calibrated against the timestamp clock. xAPIC 
+//   mode uses the loader's uncached mapping of the registers. 
+//   Returns false if there is no usable timer.
+// ====================================================================
+bool arch_init_timer(Kernel_Parms *kparms, Interrupt_Handler handler) {
+    uint32_t eax, ebx, ecx, edx;
+    cpuid(1, 0, &eax, &ebx, &ecx, &edx);
+    if (!(edx & (1 << 9))) return false;    // No local APIC
+
+    uint64_t apic_base = rdmsr(IA32_APIC_BASE_MSR);
+    if (ecx & (1 << 21)) {
+        wrmsr(IA32_APIC_BASE_MSR, apic_base | APIC_BASE_ENABLE | APIC_BASE_X2APIC);
+        lapic_x2apic = true;
+    } else if (kparms->interrupt_controller_base) {
+        lapic_base = kparms->interrupt_controller_base;
+    } else {
+        return false;
+    }
+
+    arch_set_interrupt_handler(TIMER_VECTOR, handler);
+    lapic_write(LAPIC_TPR, 0);
+    lapic_write(LAPIC_SPURIOUS, LAPIC_SOFT_ENABLE | SPURIOUS_VECTOR);
+
+    tsc_deadline_timer = ecx & (1 << 24);
+    if (tsc_deadline_timer) {
+        lapic_write(LAPIC_LVT_TIMER, TIMER_VECTOR | LVT_TSC_DEADLINE);
+        return true;
+    }
+
+    // Count LAPIC timer ticks over 10ms, divide by 1
+    if (!timestamp_clock.frequency) return false;
+    lapic_write(LAPIC_TIMER_DIVIDE, 0xB);
+    lapic_write(LAPIC_LVT_TIMER, TIMER_VECTOR | LVT_MASKED);
+    lapic_write(LAPIC_TIMER_INITIAL, 0xFFFFFFFF);
+    uint64_t start = now_ns();
+    while (now_ns() - start < 10000000) ;
+    lapic_timer_frequency = (uint64_t)(0xFFFFFFFF - lapic_read(LAPIC_TIMER_CURRENT)) * 100;
+    lapic_write(LAPIC_TIMER_INITIAL, 0);
+
+    lapic_write(LAPIC_LVT_TIMER, TIMER_VECTOR);     // One-shot
+    return lapic_timer_frequency != 0;
+}
+
+// ====================================================================
+// Set the one-shot timer to fire at a timestamp, or stop it if 0. A 
+//   deadline already passed fires right away.
+// ====================================================================
+void arch_set_timer(uint64_t deadline) {
+    if (tsc_deadline_timer) {
+        wrmsr(IA32_TSC_DEADLINE_MSR, deadline);
+        return;
+    }
+
+    uint64_t count = 0;
+    if (deadline) {
+        uint64_t now = arch_read_timestamp();
+        uint64_t ns = deadline > now ? ticks_to_ns(deadline - now) : 0;
+        count = ((ns / 1000000000) * lapic_timer_frequency) + 
+                (((ns % 1000000000) * lapic_timer_frequency) / 1000000000);
+        count = max(min(count, 0xFFFFFFFF), 1);
+    }
+    lapic_write(LAPIC_TIMER_INITIAL, count);
 }
 
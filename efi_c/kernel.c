@@ -8,6 +8,8 @@
 #define arch_header <arch/ARCH/ARCH.h>
 #include arch_header
 
+#include "fb.h"
+
 // ------------------------------
 // Global variables / Constants
 // ------------------------------
@@ -26,52 +28,164 @@ const uint32_t colors[COLOR_MAX] = {
     [DARK_GRAY]  = 0xFF222222, 
 };
 
-uint32_t *fb = NULL;  // Framebuffer
-uint32_t xres = 0;    // X/Horizontal resolution of framebuffer
-uint32_t yres = 0;    // Y/Vertical resolution of framebuffer
-uint32_t x = 0;       // X offset into framebuffer
-uint32_t y = 0;       // Y offset into framebuffer
+Framebuffer screen = {0};   // Framebuffer from loader's GOP mode
+uint32_t x = 0;             // X offset into framebuffer
+uint32_t y = 0;             // Y offset into framebuffer
+
+volatile uint32_t aps_running = 0;  // Application processors that reached ap_main()
+
+// One-shot timer callbacks, run from the timer interrupt
+#define MAX_TIMERS 16
+
+typedef void (*Timer_Callback)(void *arg);
+
+typedef struct {
+    UINT64         deadline;    // Timestamp to run at
+    Timer_Callback callback;    // NULL if slot is free
+    void           *arg;
+} Timer;
+
+Timer timers[MAX_TIMERS] = {0};
+bool timer_available = false;   // Is there a timer interrupt, else sleep_ns() busy waits
 
 const uint32_t text_fg_color = colors[LIGHT_GRAY];
 const uint32_t text_bg_color = colors[DARK_GRAY];
 
 void print_string(char *string, Bitmap_Font *font);
+void fb_fill_benchmark(Kernel_Parms *kargs, Bitmap_Font *font);
+void fb_draw_benchmark(Kernel_Parms *kargs);
+void print_memory_summary(Kernel_Parms *kargs, Bitmap_Font *font);
+void print_boot_stages(Bitmap_Font *font, bool full);
+void print_page_table_stats(Page_Table_Stats *stats, Bitmap_Font *font);
+noreturn void EFIAPI ap_main(Kernel_Parms *kargs, Boot_CPU *cpu);
+void timer_interrupt(Interrupt_Frame *frame);
+bool timer_callback(UINT64 ns, Timer_Callback callback, void *arg);
+void sleep_ns(UINT64 ns);
 
 // ==============
 // MAIN
 // ==============
 __attribute__((section(".kernel"), aligned(0x1000))) 
 noreturn void EFIAPI kmain(Kernel_Parms *kargs) {
-    // Grab Framebuffer/GOP info
-    fb = (UINT32 *)kargs->gop_mode.FrameBufferBase;  
-    xres = kargs->gop_mode.Info->PixelsPerScanLine;
-    yres = kargs->gop_mode.Info->VerticalResolution;
+    UINT64 kmain_time = arch_read_timestamp();  // End of loader handoff
+
+    // Check boot info is from a loader this kernel understands
+    if (kargs->magic != BOOT_INFO_MAGIC || kargs->version != BOOT_INFO_VERSION) 
+        while (true) arch_cpu_halt();
+
+    // Use loader's calibrated clock for now_ns(), and end the loader's last boot stage
+    timestamp_clock = kargs->clock;
+    serial_base = kargs->serial_base;
+    boot_stages = kargs->boot_stages;
+    boot_stage("kmain", NULL);
+
+    // Set up interrupts & one-shot timer for sleep_ns()/timer_callback(); interrupts are only
+    //   enabled if the arch installed its own handlers
+    if (arch_init_interrupts()) {
+        timer_available = arch_init_timer(kargs, timer_interrupt);
+        arch_enable_interrupts();
+    }
+
+    // Grab Framebuffer/GOP info; without a framebuffer there is only serial output
+    if (!fb_init(&screen, &kargs->gop_mode)) 
+        serial_write("No linear framebuffer in GOP mode\r\n");
+
+    char *cmdline = boot_info_find_tag(kargs, BOOT_TAG_CMDLINE, NULL);
+    const bool fb_bench = cmdline && strstr(cmdline, "fb_bench");
+
+    // Draw through a shadow buffer in RAM from here unless turned off. With "fb_bench", 
+    //   clear, fill & blit speeds go to serial drawing straight to the framebuffer, then
+    //   through the shadow buffer
+    if (fb_bench) fb_draw_benchmark(kargs);
+    if (screen.base && !(cmdline && strstr(cmdline, "no_shadow_fb"))) {
+        if (!fb_enable_shadow(&screen, &kargs->page_allocator)) 
+            serial_write("Could not allocate framebuffer shadow buffer\r\n");
+        else if (fb_bench) 
+            fb_draw_benchmark(kargs);
+    }
 
     // Clear screen to solid color
-    UINTN color = colors[DARK_GRAY];
-    for (y = 0; y < yres; y++) 
-        for (x = 0; x < xres; x++) 
-            fb[y*xres + x] = color;
+    fb_clear(&screen, colors[DARK_GRAY]);
+    fb_flush(&screen);
 
-    // Print test string(s)
+    // Compare write combining vs uncached framebuffer writes if asked for ("fb_bench"), 
+    //   this clears the screen again and prints the results at the top
     x = y = 0;  // Reset to 0,0 position
     Bitmap_Font *font1 = &kargs->fonts[0];
     Bitmap_Font *font2 = &kargs->fonts[1];
+    if (fb_bench) fb_fill_benchmark(kargs, font1);
+
+    // Print test string(s)
     print_string("Hello, kernel bitmap font world!", font1);
     print_string("\r\nFont 1 Name: ", font1);
     print_string(font1->name, font1);
     print_string("\r\nFont 2 Name: ", font2);
     print_string(font2->name, font2);
+    print_string("\r\n", font1);
+    print_memory_summary(kargs, font1);
+
+    // Print loader handoff timing
+    char buf[128];
+    sprintf(buf, "Handoff ticks: %llu load to kmain, %llu exiting boot services (%llu retries)\r\n",
+            kmain_time - kargs->load_start_time, 
+            kargs->exit_bs_end_time - kargs->exit_bs_start_time, (UINT64)kargs->exit_bs_retries);
+    print_string(buf, font1);
+    if (timestamp_clock.frequency) {
+        sprintf(buf, "Handoff: %llu us load to kmain, %llu us exiting boot services; "
+                     "clock %llu Hz, source %llu, flags %llx\r\n",
+                ticks_to_ns(kmain_time - kargs->load_start_time) / 1000, 
+                ticks_to_ns(kargs->exit_bs_end_time - kargs->exit_bs_start_time) / 1000,
+                timestamp_clock.frequency, (UINT64)timestamp_clock.source, 
+                (UINT64)timestamp_clock.flags);
+        print_string(buf, font1);
+    }
+
+    // Print boot stage times to serial, and a summary or the full breakdown on screen
+    print_boot_stages(font1, cmdline && strstr(cmdline, "boot_stages"));
+    if (cmdline && strstr(cmdline, "page_tables")) print_page_table_stats(&kargs->page_tables, font1);
+
+    // Headless benchmark runs ("make bench") only need the boot stages, exit QEMU
+    if (cmdline && strstr(cmdline, "bench_exit")) {
+        arch_debug_exit(0);
+        while (true) arch_cpu_halt();
+    }
+
+    // Print CPU features the loader enabled
+    sprintf(buf, "CPU features: %llx, XSAVE size: %llu bytes\r\n", 
+            kargs->cpu_features, (UINT64)kargs->xsave_size);
+    print_string(buf, font1);
+    sprintf(buf, "CPU topology: %llu packages, %llu cores per package, %llu threads per core\r\n",
+            (UINT64)kargs->topology.packages, (UINT64)kargs->topology.cores_per_package, 
+            (UINT64)kargs->topology.threads_per_core);
+    print_string(buf, font1);
+
+    // Print command line from boot info, if any
+    if (cmdline) {
+        print_string("Command line: ", font1);
+        print_string(cmdline, font1);
+        print_string("\r\n", font1);
+    }
 
-    // Test runtime services by waiting a few seconds and then shutting down
-    EFI_TIME old_time = {0}, new_time = {0};
-    EFI_TIME_CAPABILITIES time_cap = {0};
-    UINTN i = 0;
-    while (i < 3) {
-        kargs->RuntimeServices->GetTime(&new_time, &time_cap);
-        if (old_time.Second != new_time.Second) {
-            i++;
-            old_time.Second = new_time.Second;
+    // Start application processors from the loader's CPU list
+    uint32_t aps_started = arch_start_aps(kargs, ap_main);
+    sprintf(buf, "CPUs: %llu, APs started %llu/%llu\r\n", (UINT64)kargs->cpu_count, 
+            (UINT64)aps_started, (UINT64)(kargs->cpu_count - 1));
+    print_string(buf, font1);
+
+    // Wait a few seconds and then shut down; sleep on the timer or the calibrated clock if there
+    //   is one, else test runtime services by polling the RTC
+    if (timestamp_clock.frequency) {
+        sleep_ns(3 * 1000000000ULL);
+    } else {
+        EFI_TIME old_time = {0}, new_time = {0};
+        EFI_TIME_CAPABILITIES time_cap = {0};
+        UINTN i = 0;
+        while (i < 3) {
+            kargs->RuntimeServices->GetTime(&new_time, &time_cap);
+            if (old_time.Second != new_time.Second) {
+                i++;
+                old_time.Second = new_time.Second;
+            }
         }
     }
 
@@ -81,33 +195,295 @@ noreturn void EFIAPI kmain(Kernel_Parms *kargs) {
     // Uncomment if qemu/hardware works does not work with shutdown;
     // Infinite loop, do not return back to UEFI,
     //   this is in case my hardware (laptop) doesn't shut off from ResetSystem
-    //   Can still use power button manually to shut down fine
-    while (true) arch_cpu_halt();
+    //   Can still use power button manually to shut down fine.
+    //   Idle with interrupts on, there is no periodic tick to wake up for.
+    while (true) arch_wait_for_interrupt();
 
     // Should not return after shutting down
     //__builtin_unreachable();
 }
 
+// ==================================================================
+// Application processor entry point, called on the AP's own stack 
+//   from arch_start_aps() with the kernel page tables
+// ==================================================================
+noreturn void EFIAPI ap_main(Kernel_Parms *kargs, Boot_CPU *cpu) {
+    (void)kargs;
+    arch_init_cpu(cpu, NULL);
+    __atomic_add_fetch(&aps_running, 1, __ATOMIC_SEQ_CST);
+
+    while (true) arch_cpu_halt();
+}
+
+// ==================================================================
+// Set the arch one-shot timer for the earliest pending callback, or
+//   stop it if there are none. Interrupts must be disabled.
+// ==================================================================
+void arm_next_timer(void) {
+    UINT64 earliest = 0;
+    for (UINTN i = 0; i < MAX_TIMERS; i++) {
+        if (timers[i].callback && (!earliest || timers[i].deadline < earliest)) 
+            earliest = timers[i].deadline;
+    }
+    arch_set_timer(earliest);
+}
+
+// ==================================================================
+// Timer interrupt: run all callbacks that are due, then rearm
+// ==================================================================
+void timer_interrupt(Interrupt_Frame *frame) {
+    (void)frame;
+    UINT64 now = arch_read_timestamp();
+    for (UINTN i = 0; i < MAX_TIMERS; i++) {
+        if (!timers[i].callback || timers[i].deadline > now) continue;
+
+        Timer timer = timers[i];
+        timers[i].callback = NULL;  // Free slot first, callback can add a new timer
+        timer.callback(timer.arg);
+    }
+    arm_next_timer();
+}
+
+// ==================================================================
+// Run callback(arg) from the timer interrupt after ns nanoseconds. 
+//   Returns false if there is no timer or no free timer slot.
+// ==================================================================
+bool timer_callback(UINT64 ns, Timer_Callback callback, void *arg) {
+    if (!timer_available) return false;
+
+    bool enabled = arch_disable_interrupts();
+    bool added = false;
+    for (UINTN i = 0; i < MAX_TIMERS && !added; i++) {
+        if (timers[i].callback) continue;
+        timers[i] = (Timer){ 
+            .deadline = arch_read_timestamp() + ns_to_ticks(ns), 
+            .callback = callback, 
+            .arg      = arg,
+        };
+        added = true;
+    }
+    if (added) arm_next_timer();
+    arch_restore_interrupts(enabled);
+    return added;
+}
+
+// Timer callback to end a sleep_ns()
+void wake_up(void *arg) {
+    *(volatile bool *)arg = true;
+}
+
+// ==================================================================
+// Sleep for ns nanoseconds, halting the CPU until the timer fires. 
+//   Without a timer, busy wait on the timestamp clock instead.
+// ==================================================================
+void sleep_ns(UINT64 ns) {
+    volatile bool done = false;
+    if (!timer_callback(ns, wake_up, (void *)&done)) {
+        UINT64 end = now_ns() + ns;
+        while (now_ns() < end) ;
+        return;
+    }
+
+    // Check done with interrupts disabled, so the wake up can not happen between the check & halt
+    bool enabled = arch_disable_interrupts();
+    while (!done) {
+        arch_wait_for_interrupt();
+        arch_disable_interrupts();
+    }
+    arch_restore_interrupts(enabled);
+}
+
+// ==========================================================================
+// Framebuffer fill benchmark: time full screen fills with the framebuffer 
+//   mapped write combining and then uncached, and print the results
+// ==========================================================================
+void fb_fill_benchmark(Kernel_Parms *kargs, Bitmap_Font *font) {
+    const uint32_t FRAMES = 16;
+    const MAP_CACHE_TYPE cache_types[] = { MAP_CACHE_WC, MAP_CACHE_UC };
+    uint64_t cycles[ARRAY_SIZE(cache_types)] = {0};
+
+    UINTN fb_base = kargs->gop_mode.FrameBufferBase;
+    UINTN fb_size = kargs->gop_mode.FrameBufferSize;
+
+    for (UINTN i = 0; i < ARRAY_SIZE(cache_types); i++) {
+        arch_set_cache_type(fb_base, fb_size, cache_types[i]);
+
+        uint64_t start = arch_read_timestamp();
+        for (uint32_t frame = 0; frame < FRAMES; frame++) {
+            fb_clear(&screen, text_bg_color);
+            fb_flush(&screen);  // Framebuffer writes happen here with a shadow buffer
+        }
+        __sync_synchronize();   // Make sure all buffered writes are done
+
+        cycles[i] = (arch_read_timestamp() - start) / FRAMES;
+    }
+    arch_set_cache_type(fb_base, fb_size, MAP_CACHE_WC);
+
+    // Print results
+    char buf[128];
+    sprintf(buf, "Framebuffer fill, %ux%u, timestamp ticks per frame:\r\n", screen.width, screen.height);
+    print_string(buf, font);
+    sprintf(buf, "Write combining: %llu\r\nUncached: %llu\r\n", cycles[0], cycles[1]);
+    print_string(buf, font);
+    if (cycles[0] > 0) {
+        sprintf(buf, "WC speedup: %llu.%llux\r\n", 
+                cycles[1] / cycles[0], ((cycles[1] * 10) / cycles[0]) % 10);
+        print_string(buf, font);
+    }
+}
+
+// ==========================================================================
+// Framebuffer drawing benchmark: full screen clears, rectangle fills, and 
+//   blits from RAM, in megapixels per second to serial. With a shadow 
+//   buffer each draw is flushed, so times include the framebuffer copy.
+// ==========================================================================
+void fb_draw_benchmark(Kernel_Parms *kargs) {
+    if (!screen.base || !timestamp_clock.frequency) return;
+
+    const uint32_t FRAMES = 16, RECTS = 256, RECT_SIZE = 128, BLITS = 256, BLIT_SIZE = 256;
+    const char *names[] = { "clear", "fill 128x128", "blit 256x256" };
+    uint64_t pixels[ARRAY_SIZE(names)] = {0}, ticks[ARRAY_SIZE(names)] = {0};
+
+    // Full screen clears
+    uint64_t start = arch_read_timestamp();
+    for (uint32_t i = 0; i < FRAMES; i++) {
+        fb_clear(&screen, colors[(i & 1) ? LIGHT_GRAY : DARK_GRAY]);
+        fb_flush(&screen);
+    }
+    ticks[0]  = arch_read_timestamp() - start;
+    pixels[0] = (uint64_t)FRAMES * screen.width * screen.height;
+
+    // Rectangles spread over the screen, not overlapping the screen edges
+    uint32_t rect_w = min(RECT_SIZE, screen.width), rect_h = min(RECT_SIZE, screen.height);
+    uint32_t span_x = screen.width - rect_w + 1, span_y = screen.height - rect_h + 1;
+    start = arch_read_timestamp();
+    for (uint32_t i = 0; i < RECTS; i++) {
+        fb_fill_rect(&screen, (i * 97) % span_x, (i * 61) % span_y, rect_w, rect_h, 
+                     colors[i % COLOR_MAX]);
+        fb_flush(&screen);
+    }
+    ticks[1]  = arch_read_timestamp() - start;
+    pixels[1] = (uint64_t)RECTS * rect_w * rect_h;
+
+    // Blits from a pattern image in RAM
+    UINTN image_pages = (BLIT_SIZE * BLIT_SIZE * 4 + PAGE_SIZE-1) / PAGE_SIZE;
+    uint32_t *image = page_alloc(&kargs->page_allocator, image_pages, 1);
+    if (image) {
+        for (uint32_t i = 0; i < BLIT_SIZE * BLIT_SIZE; i++) 
+            image[i] = fb_color(&screen, 0xFF000000 | (i * 0x010305));
+
+        uint32_t blit_w = min(BLIT_SIZE, screen.width), blit_h = min(BLIT_SIZE, screen.height);
+        span_x = screen.width - blit_w + 1, span_y = screen.height - blit_h + 1;
+        start = arch_read_timestamp();
+        for (uint32_t i = 0; i < BLITS; i++) {
+            fb_blit(&screen, (i * 97) % span_x, (i * 61) % span_y, image, BLIT_SIZE * 4, 
+                    blit_w, blit_h);
+            fb_flush(&screen);
+        }
+        ticks[2]  = arch_read_timestamp() - start;
+        pixels[2] = (uint64_t)BLITS * blit_w * blit_h;
+
+        page_free(&kargs->page_allocator, image, image_pages);
+    }
+
+    char buf[128];
+    sprintf(buf, "\r\nFramebuffer %ux%u, pitch %u bytes, pixel format %u, %hhs (MPix/s):\r\n", 
+            screen.width, screen.height, screen.device ? screen.device_pitch : screen.pitch, 
+            (UINT32)screen.format, screen.device ? "shadow buffer" : "direct");
+    serial_write(buf);
+    for (UINTN i = 0; i < ARRAY_SIZE(names); i++) {
+        UINT64 ns = ticks_to_ns(ticks[i]);
+        if (!ns) continue;
+        sprintf(buf, "fb %s: %llu\r\n", names[i], pixels[i] * 1000 / ns);
+        serial_write(buf);
+    }
+}
+
+// ======================================================================
+// Print total memory for each kernel memory map type
+// ======================================================================
+void print_memory_summary(Kernel_Parms *kargs, Bitmap_Font *font) {
+    UINT64 pages[KERNEL_MEMORY_RESERVED+1] = {0};
+    for (UINTN i = 0; i < kargs->memory_map_count; i++) 
+        pages[kargs->memory_map[i].type] += kargs->memory_map[i].pages;
+
+    char buf[128];
+    sprintf(buf, "Memory map: %llu regions\r\n", (UINT64)kargs->memory_map_count);
+    print_string(buf, font);
+    sprintf(buf, "Usable: %llu MiB, Reclaimable: %llu MiB, Kept: %llu MiB\r\n",
+            pages[KERNEL_MEMORY_USABLE] / 256, pages[KERNEL_MEMORY_RECLAIMABLE] / 256,
+            pages[KERNEL_MEMORY_KEEP] / 256);
+    print_string(buf, font);
+}
+
+// ======================================================================
+// Print time spent in each boot stage from efi_main() to kmain(): all
+//   stages to serial, and on screen either all stages or a summary of 
+//   the load time & slowest stage. Waiting on the user is not counted.
+// ======================================================================
+void print_boot_stages(Bitmap_Font *font, bool full) {
+    if (boot_stages.count < 2) return;
+
+    char buf[160];
+    UINT64 total_ticks = 0;
+    UINT32 slowest = 0;
+    serial_write("\r\nBoot stages (us):\r\n");
+    if (full) print_string("Boot stages (us):\r\n", font);
+    for (UINT32 i = 0; i < boot_stages.count - 1; i++) {
+        Boot_Stage *stage = &boot_stages.stages[i];
+        UINT64 ticks = boot_stages.stages[i+1].timestamp - stage->timestamp;
+        if (!(stage->flags & BOOT_STAGE_WAIT)) {
+            total_ticks += ticks;
+            if (ticks > boot_stages.stages[slowest+1].timestamp - boot_stages.stages[slowest].timestamp) 
+                slowest = i;
+        }
+
+        sprintf(buf, "%llu: %s%s\r\n", ticks_to_ns(ticks) / 1000, stage->name,
+                (stage->flags & BOOT_STAGE_WAIT) ? " (waiting)" : "");
+        serial_write(buf);
+        if (full) print_string(buf, font);
+    }
+
+    Boot_Stage *slow = &boot_stages.stages[slowest];
+    sprintf(buf, "Boot: %llu us efi_main to kmain, slowest stage %s at %llu us "
+                 "(%llu stages, %llu dropped)\r\n", 
+            ticks_to_ns(total_ticks) / 1000, slow->name, 
+            ticks_to_ns(boot_stages.stages[slowest+1].timestamp - slow->timestamp) / 1000,
+            (UINT64)boot_stages.count, (UINT64)boot_stages.dropped);
+    serial_write(buf);
+    print_string(buf, font);
+}
+
+// ======================================================================
+// Print the loader's stats for the page tables the kernel started with
+// ======================================================================
+void print_page_table_stats(Page_Table_Stats *stats, Bitmap_Font *font) {
+    if (!stats->walked) {
+        print_string("Page tables: not checked by the loader on this arch\r\n", font);
+        return;
+    }
+
+    char buf[160];
+    UINT64 tables = stats->tables[0] + stats->tables[1] + stats->tables[2] + stats->tables[3];
+    sprintf(buf, "Page tables: %llu tables, %llu KiB; %llu 4KiB, %llu 2MiB, %llu 1GiB pages\r\n",
+            tables, tables * PAGE_SIZE / 1024, stats->pages[0], stats->pages[1], stats->pages[2]);
+    print_string(buf, font);
+    sprintf(buf, "Page table checks: %llu misaligned, %llu cache aliases, %llu map conflicts\r\n",
+            stats->misaligned, stats->cache_aliases, stats->map_conflicts);
+    print_string(buf, font);
+}
+
 // ======================================================================
 // Print a line feed visually (go down 1 line and/or scroll the screen)
 // ======================================================================
 void line_feed(Bitmap_Font *font) {
     // Can we draw another line of characters below current line?
-    if (y + font->height < yres - font->height) y += font->height; // Yes, go down 1 line 
+    if (y + font->height < screen.height - font->height) y += font->height; // Yes, go down 1 line 
     else {
-        // No more room, move all lines on screen 1 row up by overwriting 1st line with lines 2+
-        // NOTE: This is probably slow due to reading and writing to framebuffer
-        uint32_t char_line_px    = xres * font->height;
-        uint32_t char_line_bytes = char_line_px * 4;    // Assuming ARGB8888
-        uint32_t char_lines      = yres / font->height;
-
-        memcpy(fb, fb + char_line_px, char_line_bytes * (char_lines-1)); 
-
-        // Blank out last row by making all pixels the background color 
-        // Get X,Y start of last character line 
-        uint32_t px = ((yres / font->height) - 1) * font->height * xres; 
-        for (uint32_t i = 0; i < char_line_px; i++)
-            fb[px++] = text_bg_color;
+        // No more room, move all lines on screen 1 row up by overwriting 1st line with lines 2+,
+        //   and blank out the last line. Without a shadow buffer this reads the framebuffer.
+        uint32_t char_lines = screen.height / font->height;
+        fb_scroll(&screen, char_lines * font->height, font->height, text_bg_color);
     }
 }
 
@@ -115,6 +491,9 @@ void line_feed(Bitmap_Font *font) {
 // Print a bitmapped font string to the screen (framebuffer)
 // ===========================================================
 void print_string(char *string, Bitmap_Font *font) {
+    if (!screen.base) return;
+
+    uint32_t fg = fb_color(&screen, text_fg_color), bg = fb_color(&screen, text_bg_color);
     uint32_t glyph_size = ((font->width + 7) / 8) * font->height;   // Size of all glyph lines
     uint32_t glyph_width_bytes = (font->width + 7) / 8;             // Size of 1 line of a glyph
     for (char c = *string++; c != '\0'; c = *string++) {
@@ -150,25 +529,26 @@ void print_string(char *string, Bitmap_Font *font) {
                              ((uint64_t)glyph[6] <<  8) |
                              ((uint64_t)glyph[7] <<  0) 
                              : *(uint64_t *)glyph;   // Else pixels are stored right to left
+            uint32_t *row = fb_row(&screen, y) + x;
             for (uint32_t px = 0; px < font->width; px++) {
-                fb[y*xres + x] = bytes & mask ? text_fg_color : text_bg_color;
+                row[px] = bytes & mask ? fg : bg;
                 mask >>= 1;
-                x++;            // Next pixel of character
             }
             y++;                // Next line of character
-            x -= font->width;   // Back up to start of character 
             glyph += glyph_width_bytes;
         }
 
         // Go to start of next character, top left pixel
         y -= font->height;      
-        if (x + font->width < xres - font->width) x += font->width; 
+        fb_dirty(&screen, x, y, font->width, font->height);
+        if (x + font->width < screen.width - font->width) x += font->width; 
         else {
             // Wrap text to next line with a CR/LF
             x = 0;
             line_feed(font);
         }
     }
+    fb_flush(&screen);  // Show string, if drawing to a shadow buffer
 }
 
 
@@ -5,6 +5,7 @@ qemu-system-aarch64 ^
 -name TESTOS ^
 -machine virt ^
 -cpu max ^
+-smp 4 ^
 -device virtio-gpu-pci ^
 -usb ^
 -device qemu-xhci ^
@@ -7,6 +7,7 @@ qemu-system-aarch64 \
 -name TESTOS \
 -machine virt \
 -cpu max \
+-smp 4 \
 -device virtio-gpu-pci \
 -display gtk,gl=on,zoom-to-fit=off,window-close=on \
 -usb \
@@ -3,6 +3,7 @@ qemu-system-x86_64 ^
 -drive format=raw,file=../UEFI-GPT-image-creator/test.hdd ^
 -bios ../UEFI-GPT-image-creator/bios64.bin ^
 -m 256M ^
+-smp 4 ^
 -vga std ^
 -name TESTOS ^
 -machine q35 ^
@@ -5,6 +5,7 @@ qemu-system-x86_64 \
 -drive format=raw,file=../UEFI-GPT-image-creator/test.hdd \
 -bios ../UEFI-GPT-image-creator/bios64.bin \
 -m 256M \
+-smp 4 \
 -vga std \
 -display gtk,gl=on,zoom-to-fit=off,window-close=on \
 -name TESTOS \